@@ -1756,6 +1756,7 @@ int bdrv_open(BlockDriverState **pbs, const char *filename,
 
 typedef struct BlockReopenQueueEntry {
      bool prepared;
+     bool was_read_only;
      BDRVReopenState state;
      QSIMPLEQ_ENTRY(BlockReopenQueueEntry) entry;
 } BlockReopenQueueEntry;
@@ -1908,6 +1909,7 @@ int bdrv_reopen_multiple(BlockReopenQueue *bs_queue, Error **errp)
     bdrv_drain_all();
 
     QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
+        bs_entry->was_read_only = bs_entry->state.bs->read_only;
         if (bdrv_reopen_prepare(&bs_entry->state, bs_queue, &local_err)) {
             error_propagate(errp, local_err);
             goto cleanup;
@@ -1922,6 +1924,21 @@ int bdrv_reopen_multiple(BlockReopenQueue *bs_queue, Error **errp)
         bdrv_reopen_commit(&bs_entry->state);
     }
 
+    /* Only now are all nodes writable, including the children that the
+     * drivers write their bitmaps to.  The reopen itself has succeeded, so
+     * a failure here only costs the bitmaps. */
+    QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
+        BlockDriverState *bs = bs_entry->state.bs;
+
+        if (bs_entry->was_read_only && !bs->read_only &&
+            bs->drv->bdrv_reopen_bitmaps_rw) {
+            if (bs->drv->bdrv_reopen_bitmaps_rw(bs, &local_err) < 0) {
+                error_report_err(local_err);
+                local_err = NULL;
+            }
+        }
+    }
+
     ret = 0;
 
 cleanup:
@@ -2134,9 +2151,6 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_flush(bs);
     bdrv_drain(bs); /* in case flush left pending I/O */
 
-    bdrv_release_named_dirty_bitmaps(bs);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
-
     if (bs->blk) {
         blk_dev_change_media_cb(bs->blk, false);
     }
@@ -2144,6 +2158,7 @@ static void bdrv_close(BlockDriverState *bs)
     if (bs->drv) {
         BdrvChild *child, *next;
 
+        /* Drivers store persistent dirty bitmaps on close */
         bs->drv->bdrv_close(bs);
         bs->drv = NULL;
 
@@ -2180,6 +2195,9 @@ static void bdrv_close(BlockDriverState *bs)
         bs->full_open_options = NULL;
     }
 
+    bdrv_release_named_dirty_bitmaps(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
     }
@@ -3042,6 +3060,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(const BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_get_specific_stats) {
+        return drv->bdrv_get_specific_stats(bs);
+    }
+    return NULL;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -683,9 +683,9 @@ static int blk_check_request(BlockBackend *blk, int64_t sector_num,
                                   nb_sectors * BDRV_SECTOR_SIZE);
 }
 
-static int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
-                                      unsigned int bytes, QEMUIOVector *qiov,
-                                      BdrvRequestFlags flags)
+int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
+                               unsigned int bytes, QEMUIOVector *qiov,
+                               BdrvRequestFlags flags)
 {
     int ret = blk_check_byte_request(blk, offset, bytes);
     if (ret < 0) {
@@ -695,9 +695,9 @@ static int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
     return bdrv_co_do_preadv(blk_bs(blk), offset, bytes, qiov, flags);
 }
 
-static int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
-                                      unsigned int bytes, QEMUIOVector *qiov,
-                                      BdrvRequestFlags flags)
+int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
+                                unsigned int bytes, QEMUIOVector *qiov,
+                                BdrvRequestFlags flags)
 {
     int ret;
 
@@ -1467,6 +1467,17 @@ int blk_write_compressed(BlockBackend *blk, int64_t sector_num,
     return bdrv_write_compressed(blk_bs(blk), sector_num, buf, nb_sectors);
 }
 
+int coroutine_fn blk_co_write_compressed(BlockBackend *blk, int64_t sector_num,
+                                         const uint8_t *buf, int nb_sectors)
+{
+    int ret = blk_check_request(blk, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_write_compressed(blk_bs(blk), sector_num, buf, nb_sectors);
+}
+
 int blk_truncate(BlockBackend *blk, int64_t offset)
 {
     if (!blk_is_available(blk)) {
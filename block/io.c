@@ -1744,8 +1744,30 @@ int bdrv_is_allocated_above(BlockDriverState *top,
     return 0;
 }
 
-int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                          const uint8_t *buf, int nb_sectors)
+typedef struct WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+} WriteCompressedCo;
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    WriteCompressedCo *wco = opaque;
+
+    wco->ret = bdrv_co_write_compressed(wco->bs, wco->sector_num, wco->buf,
+                                        wco->nb_sectors);
+}
+
+/*
+ * Drivers implementing bdrv_co_write_compressed may yield while a cluster is
+ * compressed, so callers running in coroutines can keep several compressed
+ * writes in flight, and they can complete in any order.
+ */
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
     int ret;
@@ -1753,7 +1775,7 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (!drv) {
         return -ENOMEDIUM;
     }
-    if (!drv->bdrv_write_compressed) {
+    if (!drv->bdrv_co_write_compressed && !drv->bdrv_write_compressed) {
         return -ENOTSUP;
     }
     ret = bdrv_check_request(bs, sector_num, nb_sectors);
@@ -1763,9 +1785,39 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
+    if (drv->bdrv_co_write_compressed) {
+        return drv->bdrv_co_write_compressed(bs, sector_num, buf, nb_sectors);
+    }
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
+int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                          const uint8_t *buf, int nb_sectors)
+{
+    Coroutine *co;
+    WriteCompressedCo wco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .buf = buf,
+        .nb_sectors = nb_sectors,
+        .ret = NOT_DONE,
+    };
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_write_compressed_co_entry(&wco);
+    } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &wco);
+        while (wco.ret == NOT_DONE) {
+            aio_poll(aio_context, true);
+        }
+    }
+    return wco.ret;
+}
+
 int bdrv_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
                       int64_t pos, int size)
 {
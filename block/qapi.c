@@ -438,6 +438,9 @@ static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
 
     s->stats->wr_highest_offset = bs->wr_highest_offset;
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    s->has_driver_specific = s->driver_specific != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(NULL, bs->file->bs, query_backing);
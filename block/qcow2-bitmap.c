@@ -0,0 +1,1011 @@
+/*
+ * Persistent dirty bitmaps for the QCOW2 format
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The bitmaps of an image are loaded into BdrvDirtyBitmaps when it is opened
+ * or reopened read/write and written back when it is closed, inactivated or
+ * reopened read-only; in between, only the copies in memory are up to date
+ * and the bitmaps are flagged in_use in the image.  Bitmaps that this
+ * implementation cannot use are left alone in the image.  See
+ * docs/specs/qcow2.txt for the format.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "block/block_int.h"
+#include "block/dirty-bitmap.h"
+#include "qemu-common.h"
+#include "qcow2.h"
+
+/* Limits of this implementation, stricter than those of the format */
+#define BME_MAX_TABLE_SIZE 0x8000000
+#define BME_MAX_PHYS_SIZE 0x20000000 /* 512 MB of bitmap data in RAM */
+#define BME_MAX_GRANULARITY_BITS 31
+#define BME_MIN_GRANULARITY_BITS 9
+#define BME_MAX_NAME_SIZE 1023
+
+/* Bitmap directory entry flags */
+#define BME_RESERVED_FLAGS 0xfffffff8U
+#define BME_FLAG_IN_USE (1U << 0)
+#define BME_FLAG_AUTO   (1U << 1)
+
+/* Bitmap table entries */
+#define BME_TABLE_ENTRY_RESERVED_MASK 0xff000000000001feULL
+#define BME_TABLE_ENTRY_OFFSET_MASK 0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_FLAG_ALL_ONES 1
+
+/* Bitmap types */
+#define BT_DIRTY_TRACKING_BITMAP 1
+
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    /* entries are 8 byte aligned */
+    uint64_t bitmap_table_offset;
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data and name follow */
+} Qcow2BitmapDirEntry;
+
+/* A bitmap directory entry in CPU byte order */
+typedef struct Qcow2Bitmap {
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint32_t extra_data_size;
+    char *name;
+
+    /* offset of the entry in the directory */
+    uint64_t dir_entry_offset;
+    /* bitmap table being written, in CPU byte order */
+    uint64_t *table;
+} Qcow2Bitmap;
+
+static uint64_t dir_entry_size(uint64_t name_size, uint64_t extra_data_size)
+{
+    return align_offset(sizeof(Qcow2BitmapDirEntry) + name_size +
+                        extra_data_size, 8);
+}
+
+static void bitmaps_free(Qcow2Bitmap *bitmaps, uint32_t nb_bitmaps)
+{
+    uint32_t i;
+
+    if (bitmaps == NULL) {
+        return;
+    }
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+        g_free(bitmaps[i].table);
+    }
+    g_free(bitmaps);
+}
+
+/* Number of bitmap data clusters for @nb_sectors of guest data */
+static uint64_t bitmap_data_clusters(BDRVQcow2State *s, uint64_t nb_sectors,
+                                     int granularity_bits)
+{
+    uint64_t bits = DIV_ROUND_UP(nb_sectors,
+                    1ULL << (granularity_bits - BDRV_SECTOR_BITS));
+
+    return size_to_clusters(s, DIV_ROUND_UP(bits, 8));
+}
+
+/* Number of guest sectors covered by one cluster of bitmap data */
+static uint64_t bitmap_sectors_per_cluster(BDRVQcow2State *s,
+                                           int granularity_bits)
+{
+    return ((uint64_t)s->cluster_size * 8) <<
+           (granularity_bits - BDRV_SECTOR_BITS);
+}
+
+/*
+ * Reads a bitmap directory of @nb_bitmaps entries and checks its structure.
+ * If @pdir is not NULL, the raw directory is returned there as well.
+ */
+static int bitmap_directory_read(BlockDriverState *bs, uint64_t dir_offset,
+                                 uint64_t dir_size, uint32_t nb_bitmaps,
+                                 Qcow2Bitmap **pbitmaps, uint8_t **pdir,
+                                 Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Bitmap *bitmaps = NULL;
+    uint8_t *dir;
+    uint64_t pos = 0;
+    uint32_t i, j;
+    int ret;
+
+    dir = g_try_malloc(dir_size);
+    if (dir == NULL) {
+        error_setg(errp, "Could not allocate the bitmap directory");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file->bs, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the bitmap directory");
+        goto fail;
+    }
+
+    bitmaps = g_new0(Qcow2Bitmap, nb_bitmaps);
+    for (i = 0; i < nb_bitmaps; i++) {
+        Qcow2BitmapDirEntry *e = (Qcow2BitmapDirEntry *)(dir + pos);
+        Qcow2Bitmap *bm = &bitmaps[i];
+        uint16_t name_size;
+
+        ret = -EINVAL;
+        if (dir_size - pos < sizeof(*e)) {
+            error_setg(errp, "Bitmap directory is truncated");
+            goto fail;
+        }
+
+        bm->table_offset = be64_to_cpu(e->bitmap_table_offset);
+        bm->table_size = be32_to_cpu(e->bitmap_table_size);
+        bm->flags = be32_to_cpu(e->flags);
+        bm->type = e->type;
+        bm->granularity_bits = e->granularity_bits;
+        bm->extra_data_size = be32_to_cpu(e->extra_data_size);
+        bm->dir_entry_offset = pos;
+        name_size = be16_to_cpu(e->name_size);
+
+        if (name_size == 0 || name_size > BME_MAX_NAME_SIZE) {
+            error_setg(errp, "Bitmap directory entry %" PRIu32 " has an "
+                       "invalid name size", i);
+            goto fail;
+        }
+        if (dir_entry_size(name_size, bm->extra_data_size) > dir_size - pos) {
+            error_setg(errp, "Bitmap directory is truncated");
+            goto fail;
+        }
+        bm->name = g_strndup((char *)(e + 1) + bm->extra_data_size,
+                             name_size);
+
+        if (offset_into_cluster(s, bm->table_offset) ||
+            (bm->table_size && !bm->table_offset) ||
+            bm->table_size > BME_MAX_TABLE_SIZE) {
+            error_setg(errp, "Bitmap '%s' has an invalid bitmap table",
+                       bm->name);
+            goto fail;
+        }
+        for (j = 0; j < i; j++) {
+            if (!strcmp(bitmaps[j].name, bm->name)) {
+                error_setg(errp, "Duplicate bitmap name '%s'", bm->name);
+                goto fail;
+            }
+        }
+
+        pos += dir_entry_size(name_size, bm->extra_data_size);
+    }
+
+    if (pos != dir_size) {
+        error_setg(errp, "Bitmap directory size does not match its entries");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    *pbitmaps = bitmaps;
+    if (pdir) {
+        *pdir = dir;
+    } else {
+        g_free(dir);
+    }
+    return 0;
+
+fail:
+    bitmaps_free(bitmaps, nb_bitmaps);
+    g_free(dir);
+    return ret;
+}
+
+/* Reads the bitmap table of @bm, converted to CPU byte order */
+static int bitmap_table_load(BlockDriverState *bs, const Qcow2Bitmap *bm,
+                             uint64_t **ptable, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *table;
+    uint32_t i;
+    int ret;
+
+    table = g_try_new0(uint64_t, MAX(bm->table_size, 1));
+    if (table == NULL) {
+        error_setg(errp, "Could not allocate the table of bitmap '%s'",
+                   bm->name);
+        return -ENOMEM;
+    }
+
+    if (bm->table_size) {
+        ret = bdrv_pread(bs->file->bs, bm->table_offset, table,
+                         bm->table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            error_setg_errno(errp, -ret,
+                             "Could not read the table of bitmap '%s'",
+                             bm->name);
+            goto fail;
+        }
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        uint64_t offset;
+
+        be64_to_cpus(&table[i]);
+        offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        if ((table[i] & BME_TABLE_ENTRY_RESERVED_MASK) ||
+            (offset && (table[i] & BME_TABLE_ENTRY_FLAG_ALL_ONES)) ||
+            offset_into_cluster(s, offset)) {
+            error_setg(errp, "Bitmap '%s' has an invalid table entry",
+                       bm->name);
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    *ptable = table;
+    return 0;
+
+fail:
+    g_free(table);
+    return ret;
+}
+
+/* Frees the data clusters referenced by a bitmap table in CPU byte order */
+static void bitmap_free_data_clusters(BlockDriverState *bs,
+                                      const uint64_t *table,
+                                      uint32_t table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t i;
+
+    for (i = 0; i < table_size; i++) {
+        uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (offset) {
+            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+}
+
+/* Checks whether this implementation can use the on-disk bitmap @bm */
+static int bitmap_check_supported(BlockDriverState *bs, const Qcow2Bitmap *bm,
+                                  Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (bm->type != BT_DIRTY_TRACKING_BITMAP ||
+        (bm->flags & BME_RESERVED_FLAGS) || bm->extra_data_size) {
+        error_setg(errp, "Bitmap '%s' uses unsupported features", bm->name);
+        return -ENOTSUP;
+    }
+    if (bm->granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        bm->granularity_bits > BME_MAX_GRANULARITY_BITS) {
+        error_setg(errp, "Bitmap '%s' has an unsupported granularity",
+                   bm->name);
+        return -ENOTSUP;
+    }
+    if ((uint64_t)bm->table_size * s->cluster_size > BME_MAX_PHYS_SIZE) {
+        error_setg(errp, "Bitmap '%s' is too large", bm->name);
+        return -EFBIG;
+    }
+    if (bm->table_size != bitmap_data_clusters(s, bs->total_sectors,
+                                               bm->granularity_bits)) {
+        error_setg(errp, "Bitmap '%s' does not match the image size",
+                   bm->name);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int bitmap_load_data(BlockDriverState *bs, const uint64_t *table,
+                            uint32_t table_size, BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+    uint64_t sectors_per_cluster =
+        bitmap_sectors_per_cluster(s, granularity_bits);
+    uint64_t nb_sectors = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t sector, count;
+    uint8_t *buf;
+    uint32_t i;
+    int ret = 0;
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0, sector = 0; i < table_size; i++, sector += count) {
+        uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        count = MIN(nb_sectors - sector, sectors_per_cluster);
+        if (offset) {
+            ret = bdrv_pread(bs->file->bs, offset, buf, s->cluster_size);
+            if (ret < 0) {
+                goto out;
+            }
+        } else if (table[i] & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+            /* Only the bits inside the image, the tail must stay clear */
+            uint64_t bits = DIV_ROUND_UP(count,
+                            1ULL << (granularity_bits - BDRV_SECTOR_BITS));
+
+            memset(buf, 0, s->cluster_size);
+            memset(buf, 0xff, bits / 8);
+            if (bits % 8) {
+                buf[bits / 8] = (1 << (bits % 8)) - 1;
+            }
+        } else {
+            /* The bitmap was created empty */
+            continue;
+        }
+        bdrv_dirty_bitmap_deserialize_part(bitmap, buf, sector, count, false);
+    }
+    ret = 0;
+
+out:
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+    g_free(buf);
+    return ret;
+}
+
+/*
+ * Writes the data of @bitmap to newly allocated clusters, skipping the ones
+ * that would be all zeroes, followed by its bitmap table.  A frozen bitmap is
+ * stored together with the writes recorded in its successor since then, which
+ * is what it ends up as whether the block job succeeds or not.  On success,
+ * the table is left in bm->table so that the clusters can be freed again.
+ */
+static int bitmap_store_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             Qcow2Bitmap *bm, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t sectors_per_cluster =
+        bitmap_sectors_per_cluster(s, bm->granularity_bits);
+    uint64_t nb_sectors = bdrv_dirty_bitmap_size(bitmap);
+    BdrvDirtyBitmap *successor = bdrv_dirty_bitmap_get_successor(bitmap);
+    uint64_t table_size, sector, count;
+    int64_t offset;
+    uint8_t *buf = NULL, *successor_buf = NULL;
+    uint32_t i;
+    int ret;
+
+    table_size = bitmap_data_clusters(s, nb_sectors, bm->granularity_bits);
+    if (table_size > BME_MAX_TABLE_SIZE) {
+        error_setg(errp, "Bitmap '%s' is too large", bm->name);
+        return -EFBIG;
+    }
+    bm->table_size = table_size;
+    bm->table = g_try_new0(uint64_t, MAX(table_size, 1));
+    if (bm->table == NULL) {
+        error_setg(errp, "Could not allocate the table of bitmap '%s'",
+                   bm->name);
+        return -ENOMEM;
+    }
+
+    buf = g_malloc(s->cluster_size);
+    if (successor) {
+        successor_buf = g_malloc(s->cluster_size);
+    }
+    for (i = 0, sector = 0; i < table_size; i++, sector += count) {
+        count = MIN(nb_sectors - sector, sectors_per_cluster);
+
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, sector, count);
+        if (successor) {
+            size_t j;
+
+            memset(successor_buf, 0, s->cluster_size);
+            bdrv_dirty_bitmap_serialize_part(successor, successor_buf,
+                                             sector, count);
+            for (j = 0; j < s->cluster_size; j++) {
+                buf[j] |= successor_buf[j];
+            }
+        }
+        if (buffer_is_zero(buf, s->cluster_size)) {
+            continue;
+        }
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            ret = offset;
+            goto fail;
+        }
+        bm->table[i] = offset;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = bdrv_pwrite(bs->file->bs, offset, buf, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    if (table_size) {
+        offset = qcow2_alloc_clusters(bs, table_size * sizeof(uint64_t));
+        if (offset < 0) {
+            ret = offset;
+            goto fail;
+        }
+        bm->table_offset = offset;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                            table_size * sizeof(uint64_t));
+        if (ret >= 0) {
+            for (i = 0; i < table_size; i++) {
+                cpu_to_be64s(&bm->table[i]);
+            }
+            ret = bdrv_pwrite(bs->file->bs, offset, bm->table,
+                              table_size * sizeof(uint64_t));
+            for (i = 0; i < table_size; i++) {
+                be64_to_cpus(&bm->table[i]);
+            }
+        }
+        if (ret < 0) {
+            qcow2_free_clusters(bs, bm->table_offset,
+                                table_size * sizeof(uint64_t),
+                                QCOW2_DISCARD_OTHER);
+            bm->table_offset = 0;
+            goto fail;
+        }
+    }
+
+    g_free(successor_buf);
+    g_free(buf);
+    return 0;
+
+fail:
+    error_setg_errno(errp, -ret, "Could not write bitmap '%s'", bm->name);
+    bitmap_free_data_clusters(bs, bm->table, table_size);
+    g_free(bm->table);
+    bm->table = NULL;
+    g_free(successor_buf);
+    g_free(buf);
+    return ret;
+}
+
+/*
+ * Frees the clusters of a bitmap directory and of the bitmaps it describes,
+ * except for those flagged in @keep
+ */
+static void bitmap_directory_free(BlockDriverState *bs, uint64_t dir_offset,
+                                  uint64_t dir_size, uint32_t nb_bitmaps,
+                                  const bool *keep)
+{
+    Qcow2Bitmap *bitmaps;
+    Error *local_err = NULL;
+    uint32_t i;
+    int ret;
+
+    ret = bitmap_directory_read(bs, dir_offset, dir_size, nb_bitmaps,
+                                &bitmaps, NULL, &local_err);
+    if (ret < 0) {
+        error_report("WARNING: Leaking the old bitmap directory: %s",
+                     error_get_pretty(local_err));
+        error_free(local_err);
+        return;
+    }
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+        uint64_t *table;
+
+        if (!bm->table_size || (keep && keep[i])) {
+            continue;
+        }
+        ret = bitmap_table_load(bs, bm, &table, &local_err);
+        if (ret < 0) {
+            error_report("WARNING: Leaking the clusters of bitmap '%s': %s",
+                         bm->name, error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
+            continue;
+        }
+        bitmap_free_data_clusters(bs, table, bm->table_size);
+        qcow2_free_clusters(bs, bm->table_offset,
+                            bm->table_size * sizeof(uint64_t),
+                            QCOW2_DISCARD_OTHER);
+        g_free(table);
+    }
+    qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+
+    bitmaps_free(bitmaps, nb_bitmaps);
+}
+
+/*
+ * Whether the entry @bm must be copied as is into a new bitmap directory.
+ * Bitmaps that this implementation cannot use are not loaded, but they are
+ * not ours to drop either, unless a persistent bitmap of the same name has
+ * replaced them.
+ */
+static bool bitmap_is_kept(BlockDriverState *bs, const Qcow2Bitmap *bm)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    if ((bm->flags & BME_FLAG_IN_USE) ||
+        bitmap_check_supported(bs, bm, NULL) == 0) {
+        return false;
+    }
+    bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+    return !bitmap || !bdrv_dirty_bitmap_get_persistence(bitmap);
+}
+
+/*
+ * Loads the bitmaps stored in the image as persistent BdrvDirtyBitmaps and
+ * flags them in_use in the image.  Bitmaps that were not stored correctly are
+ * dropped, and those that this implementation cannot use are skipped.  Must
+ * only be called for images opened read/write.
+ */
+int qcow2_load_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    BdrvDirtyBitmap **loaded;
+    bool *skipped;
+    uint32_t nb_loaded = 0, i;
+    uint8_t *dir;
+    Error *local_err = NULL;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = bitmap_directory_read(bs, s->bitmap_directory_offset,
+                                s->bitmap_directory_size, s->nb_bitmaps,
+                                &bitmaps, &dir, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    loaded = g_new0(BdrvDirtyBitmap *, s->nb_bitmaps);
+    skipped = g_new0(bool, s->nb_bitmaps);
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+        BdrvDirtyBitmap *bitmap;
+        uint64_t *table;
+
+        if (bm->flags & BME_FLAG_IN_USE) {
+            error_report("WARNING: Bitmap '%s' of node '%s' was not stored "
+                         "correctly and is dropped", bm->name,
+                         bdrv_get_node_name(bs));
+            continue;
+        }
+        if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+            /* Kept in memory across cache invalidation or a read-only
+             * reopen, and more recent */
+            continue;
+        }
+
+        if (bitmap_check_supported(bs, bm, &local_err) < 0) {
+            /* Left untouched in the image, see bitmap_is_kept() */
+            error_reportf_err(local_err, "WARNING: Skipping a bitmap of node "
+                              "'%s': ", bdrv_get_node_name(bs));
+            local_err = NULL;
+            skipped[i] = true;
+            continue;
+        }
+        ret = bitmap_table_load(bs, bm, &table, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        bitmap = bdrv_create_dirty_bitmap(bs, 1U << bm->granularity_bits,
+                                          bm->name, errp);
+        if (bitmap == NULL) {
+            g_free(table);
+            ret = -EINVAL;
+            goto fail;
+        }
+        ret = bitmap_load_data(bs, table, bm->table_size, bitmap);
+        g_free(table);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read bitmap '%s'",
+                             bm->name);
+            bdrv_release_dirty_bitmap(bs, bitmap);
+            goto fail;
+        }
+
+        bdrv_dirty_bitmap_set_persistence(bitmap, true);
+        if (!(bm->flags & BME_FLAG_AUTO)) {
+            bdrv_disable_dirty_bitmap(bitmap);
+        }
+        loaded[nb_loaded++] = bitmap;
+    }
+
+    /* From now on, only the copies in memory are up to date */
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2BitmapDirEntry *e =
+            (Qcow2BitmapDirEntry *)(dir + bitmaps[i].dir_entry_offset);
+
+        if (!skipped[i]) {
+            e->flags = cpu_to_be32(bitmaps[i].flags | BME_FLAG_IN_USE);
+        }
+    }
+    ret = qcow2_pre_write_overlap_check(bs, 0, s->bitmap_directory_offset,
+                                        s->bitmap_directory_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the bitmap directory");
+        goto fail;
+    }
+    ret = bdrv_pwrite_sync(bs->file->bs, s->bitmap_directory_offset, dir,
+                           s->bitmap_directory_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the bitmap directory");
+        goto fail;
+    }
+    ret = 0;
+
+fail:
+    if (ret < 0) {
+        for (i = 0; i < nb_loaded; i++) {
+            bdrv_release_dirty_bitmap(bs, loaded[i]);
+        }
+    }
+    g_free(skipped);
+    g_free(loaded);
+    g_free(dir);
+    bitmaps_free(bitmaps, s->nb_bitmaps);
+    return ret;
+}
+
+/*
+ * Writes all persistent BdrvDirtyBitmaps of @bs to the image, replacing the
+ * bitmaps stored there apart from those that bitmap_is_kept().  New clusters
+ * are used throughout, so the previous bitmaps stay intact until the header
+ * points to the new directory.
+ */
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2Bitmap *bitmaps = NULL, *old_bitmaps = NULL;
+    uint32_t nb_bitmaps = 0, nb_stored = 0, nb_kept = 0, i;
+    uint32_t old_nb_bitmaps = s->nb_bitmaps;
+    uint64_t old_dir_offset = s->bitmap_directory_offset;
+    uint64_t old_dir_size = s->bitmap_directory_size;
+    uint64_t old_autoclear_features = s->autoclear_features;
+    uint64_t dir_size = 0, pos;
+    int64_t dir_offset = 0;
+    uint8_t *dir = NULL, *old_dir = NULL;
+    bool *keep = NULL;
+    Error *local_err = NULL;
+    int ret;
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+    if (nb_bitmaps == 0 && s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    if (old_nb_bitmaps) {
+        ret = bitmap_directory_read(bs, old_dir_offset, old_dir_size,
+                                    old_nb_bitmaps, &old_bitmaps, &old_dir,
+                                    &local_err);
+        if (ret < 0) {
+            /* Nothing can be kept; bitmap_directory_free() reports it */
+            error_free(local_err);
+        } else {
+            keep = g_new0(bool, old_nb_bitmaps);
+            for (i = 0; i < old_nb_bitmaps; i++) {
+                Qcow2Bitmap *bm = &old_bitmaps[i];
+                Qcow2BitmapDirEntry *e =
+                    (Qcow2BitmapDirEntry *)(old_dir + bm->dir_entry_offset);
+
+                if (bitmap_is_kept(bs, bm)) {
+                    keep[i] = true;
+                    nb_kept++;
+                    dir_size += dir_entry_size(be16_to_cpu(e->name_size),
+                                               bm->extra_data_size);
+                }
+            }
+        }
+    }
+    if (nb_bitmaps + nb_kept > QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many persistent bitmaps");
+        ret = -EFBIG;
+        goto out;
+    }
+
+    bitmaps = g_new0(Qcow2Bitmap, nb_bitmaps);
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+        Qcow2Bitmap *bm = &bitmaps[nb_stored];
+        BdrvDirtyBitmap *successor = bdrv_dirty_bitmap_get_successor(bitmap);
+
+        if (!bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            continue;
+        }
+
+        bm->name = g_strdup(name);
+        bm->type = BT_DIRTY_TRACKING_BITMAP;
+        bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+        /* A frozen bitmap is disabled, but its successor tracks for it */
+        bm->flags = bdrv_dirty_bitmap_enabled(successor ? successor : bitmap)
+                    ? BME_FLAG_AUTO : 0;
+        ret = bitmap_store_data(bs, bitmap, bm, errp);
+        if (ret < 0) {
+            g_free(bm->name);
+            bm->name = NULL;
+            goto fail;
+        }
+        nb_stored++;
+        dir_size += dir_entry_size(strlen(name), 0);
+    }
+
+    if (nb_stored + nb_kept) {
+        if (dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+            error_setg(errp, "Bitmap directory too large");
+            ret = -EFBIG;
+            goto fail;
+        }
+
+        dir = g_malloc0(dir_size);
+        for (i = 0, pos = 0; i < nb_stored; i++) {
+            Qcow2BitmapDirEntry *e = (Qcow2BitmapDirEntry *)(dir + pos);
+            Qcow2Bitmap *bm = &bitmaps[i];
+            size_t name_size = strlen(bm->name);
+
+            e->bitmap_table_offset = cpu_to_be64(bm->table_offset);
+            e->bitmap_table_size = cpu_to_be32(bm->table_size);
+            e->flags = cpu_to_be32(bm->flags);
+            e->type = bm->type;
+            e->granularity_bits = bm->granularity_bits;
+            e->name_size = cpu_to_be16(name_size);
+            e->extra_data_size = 0;
+            memcpy(e + 1, bm->name, name_size);
+            pos += dir_entry_size(name_size, 0);
+        }
+        for (i = 0; i < old_nb_bitmaps && nb_kept; i++) {
+            Qcow2Bitmap *bm = &old_bitmaps[i];
+            Qcow2BitmapDirEntry *e =
+                (Qcow2BitmapDirEntry *)(old_dir + bm->dir_entry_offset);
+            uint64_t entry_size = dir_entry_size(be16_to_cpu(e->name_size),
+                                                 bm->extra_data_size);
+
+            if (keep[i]) {
+                memcpy(dir + pos, e, entry_size);
+                pos += entry_size;
+            }
+        }
+
+        dir_offset = qcow2_alloc_clusters(bs, dir_size);
+        if (dir_offset < 0) {
+            ret = dir_offset;
+            dir_offset = 0;
+            error_setg_errno(errp, -ret, "Could not allocate the bitmap "
+                             "directory");
+            goto fail;
+        }
+        ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write the bitmap "
+                             "directory");
+            goto fail;
+        }
+        ret = bdrv_pwrite(bs->file->bs, dir_offset, dir, dir_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write the bitmap "
+                             "directory");
+            goto fail;
+        }
+    }
+
+    /* The new clusters must be accounted for before the header points to
+     * them */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush the refcount cache");
+        goto fail;
+    }
+
+    s->nb_bitmaps = nb_stored + nb_kept;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    if (s->nb_bitmaps) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->nb_bitmaps = old_nb_bitmaps;
+        s->bitmap_directory_offset = old_dir_offset;
+        s->bitmap_directory_size = old_dir_size;
+        s->autoclear_features = old_autoclear_features;
+        error_setg_errno(errp, -ret, "Could not update the qcow2 header");
+        goto fail;
+    }
+
+    if (old_nb_bitmaps) {
+        bitmap_directory_free(bs, old_dir_offset, old_dir_size,
+                              old_nb_bitmaps, keep);
+    }
+    ret = 0;
+    goto out;
+
+fail:
+    for (i = 0; i < nb_stored; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+
+        bitmap_free_data_clusters(bs, bm->table, bm->table_size);
+        if (bm->table_size) {
+            qcow2_free_clusters(bs, bm->table_offset,
+                                bm->table_size * sizeof(uint64_t),
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    if (dir_offset) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+
+out:
+    g_free(keep);
+    g_free(old_dir);
+    bitmaps_free(old_bitmaps, old_nb_bitmaps);
+    g_free(dir);
+    bitmaps_free(bitmaps, nb_bitmaps);
+    return ret;
+}
+
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                      uint32_t granularity, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    int granularity_bits = ctz32(granularity);
+    uint32_t nb_bitmaps = 0;
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Persistent bitmaps require compat=1.1 or later");
+        return false;
+    }
+    if (bs->read_only) {
+        error_setg(errp, "Cannot store bitmaps in a read-only image");
+        return false;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many persistent bitmaps");
+        return false;
+    }
+
+    if (strlen(name) > BME_MAX_NAME_SIZE) {
+        error_setg(errp, "Bitmap name is longer than %d bytes",
+                   BME_MAX_NAME_SIZE);
+        return false;
+    }
+    if (granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        granularity_bits > BME_MAX_GRANULARITY_BITS) {
+        error_setg(errp, "Granularity must be between %u and %u bytes",
+                   1U << BME_MIN_GRANULARITY_BITS,
+                   1U << BME_MAX_GRANULARITY_BITS);
+        return false;
+    }
+    if (bitmap_data_clusters(s, bs->total_sectors, granularity_bits) *
+        s->cluster_size > BME_MAX_PHYS_SIZE) {
+        error_setg(errp, "Granularity is too small for the size of the image");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Accounts for the bitmap directory, the bitmap tables and the bitmap data
+ * in the refcount table built by qemu-img check.
+ */
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    Error *local_err = NULL;
+    uint32_t i, j;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                   refcount_table_size,
+                                   s->bitmap_directory_offset,
+                                   s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bitmap_directory_read(bs, s->bitmap_directory_offset,
+                                s->bitmap_directory_size, s->nb_bitmaps,
+                                &bitmaps, NULL, &local_err);
+    if (ret < 0) {
+        fprintf(stderr, "ERROR %s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        res->corruptions++;
+        return 0;
+    }
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+        uint64_t *table;
+
+        if (!bm->table_size) {
+            continue;
+        }
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                       refcount_table_size, bm->table_offset,
+                                       bm->table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = bitmap_table_load(bs, bm, &table, &local_err);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR %s\n", error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
+            res->corruptions++;
+            continue;
+        }
+
+        for (j = 0; j < bm->table_size; j++) {
+            uint64_t offset = table[j] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (!offset) {
+                continue;
+            }
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, offset,
+                                           s->cluster_size);
+            if (ret < 0) {
+                g_free(table);
+                goto out;
+            }
+        }
+        g_free(table);
+    }
+    ret = 0;
+
+out:
+    bitmaps_free(bitmaps, s->nb_bitmaps);
+    return ret;
+}
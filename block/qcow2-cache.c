@@ -39,43 +39,101 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    int      hash_next;     /* next entry in the same hash bucket, or -1 */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_entry;   /* only while ref == 0 */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Entries with a non-zero offset, chained by hash_next */
+    int                    *hash_buckets;
+    unsigned int            hash_mask;
+
+    /* Unreferenced entries, least recently used first */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru_list;
+
+    uint64_t                hits;
+    uint64_t                misses;
+
+    /* Incremented whenever a table is written back or the cache is emptied */
+    uint64_t                generation;
 };
 
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
                     Qcow2Cache *c, int table)
 {
-    BDRVQcow2State *s = bs->opaque;
-    return (uint8_t *) c->table_array + (size_t) table * s->cluster_size;
+    return (uint8_t *) c->table_array + (size_t) table * c->table_size;
 }
 
 static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
                   Qcow2Cache *c, void *table)
 {
-    BDRVQcow2State *s = bs->opaque;
     ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
-    int idx = table_offset / s->cluster_size;
-    assert(idx >= 0 && idx < c->size && table_offset % s->cluster_size == 0);
+    int idx = table_offset / c->table_size;
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
     return idx;
 }
 
+static inline unsigned int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset / c->table_size) & c->hash_mask;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->hash_buckets[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next)
+    {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Changes the offset of an entry, keeping the hash table up to date */
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, uint64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    int *p;
+
+    if (t->offset) {
+        p = &c->hash_buckets[qcow2_cache_hash(c, t->offset)];
+        while (*p != i) {
+            assert(*p >= 0);
+            p = &c->entries[*p].hash_next;
+        }
+        *p = t->hash_next;
+        t->hash_next = -1;
+    }
+
+    t->offset = offset;
+
+    if (offset) {
+        p = &c->hash_buckets[qcow2_cache_hash(c, offset)];
+        t->hash_next = *p;
+        *p = i;
+    }
+}
+
 static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
                                       int i, int num_tables)
 {
 #if QEMU_MADV_DONTNEED != QEMU_MADV_INVALID
-    BDRVQcow2State *s = bs->opaque;
     void *t = qcow2_cache_get_table_addr(bs, c, i);
     int align = getpagesize();
-    size_t mem_size = (size_t) s->cluster_size * num_tables;
+    size_t mem_size = (size_t) c->table_size * num_tables;
     size_t offset = QEMU_ALIGN_UP((uintptr_t) t, align) - (uintptr_t) t;
     size_t length = QEMU_ALIGN_DOWN(mem_size - offset, align);
     if (length > 0) {
@@ -104,8 +162,13 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            Qcow2CachedTable *t = &c->entries[i];
+
+            qcow2_cache_set_offset(c, i, 0);
+            t->lru_counter = 0;
+            /* Empty entries are the first to be reused */
+            QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
+            QTAILQ_INSERT_HEAD(&c->lru_list, t, lru_entry);
             i++;
             to_clean++;
         }
@@ -118,22 +181,48 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
     c->cache_clean_lru_counter = c->lru_counter;
 }
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+/*
+ * Creates a cache of @num_tables tables of @table_size bytes each. The table
+ * size must be a power of two no larger than the cluster size.
+ */
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    size_t num_buckets;
+    int i;
+
+    assert(is_power_of_2(table_size) && table_size >= BDRV_SECTOR_SIZE &&
+           table_size <= s->cluster_size);
+
+    num_buckets = pow2ceil(num_tables);
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->table_size = table_size;
+    c->hash_mask = num_buckets - 1;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->hash_buckets = g_try_new(int, num_buckets);
     c->table_array = qemu_try_blockalign(bs->file->bs,
-                                         (size_t) num_tables * s->cluster_size);
+                                         (size_t) num_tables * table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->hash_buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->hash_buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    for (i = 0; i < num_buckets; i++) {
+        c->hash_buckets[i] = -1;
+    }
+
+    QTAILQ_INIT(&c->lru_list);
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     return c;
@@ -148,12 +237,19 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->hash_buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -196,13 +292,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -215,8 +311,10 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
+    c->generation++;
+
     ret = bdrv_pwrite(bs->file->bs, c->entries[i].offset,
-                      qcow2_cache_get_table_addr(bs, c, i), s->cluster_size);
+                      qcow2_cache_get_table_addr(bs, c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -226,7 +324,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     return 0;
 }
 
-int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+/* Writes all dirty tables back, without flushing the image file */
+int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c)
 {
     BDRVQcow2State *s = bs->opaque;
     int result = 0;
@@ -242,8 +341,15 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
         }
     }
 
+    return result;
+}
+
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int result = qcow2_cache_write(bs, c);
+
     if (result == 0) {
-        ret = bdrv_flush(bs->file->bs);
+        int ret = bdrv_flush(bs->file->bs);
         if (ret < 0) {
             result = ret;
         }
@@ -289,15 +395,18 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
         return ret;
     }
 
+    QTAILQ_INIT(&c->lru_list);
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
+        qcow2_cache_set_offset(c, i, 0);
         c->entries[i].lru_counter = 0;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     qcow2_cache_table_release(bs, c, 0, c->size);
 
     c->lru_counter = 0;
+    c->generation++;
 
     return 0;
 }
@@ -306,39 +415,30 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
+    }
+    c->misses++;
 
-    if (min_lru_index == -1) {
+    t = QTAILQ_FIRST(&c->lru_list);
+    if (t == NULL) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    i = t - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -349,7 +449,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -357,17 +457,19 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
         ret = bdrv_pread(bs->file->bs, offset,
                          qcow2_cache_get_table_addr(bs, c, i),
-                         s->cluster_size);
+                         c->table_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, i, offset);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru_list, &c->entries[i], lru_entry);
+    }
     *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -376,6 +478,43 @@ found:
     return 0;
 }
 
+bool qcow2_cache_is_cached(Qcow2Cache *c, uint64_t offset)
+{
+    return qcow2_cache_lookup(c, offset) >= 0;
+}
+
+uint64_t qcow2_cache_get_generation(Qcow2Cache *c)
+{
+    return c->generation;
+}
+
+/*
+ * Adds a copy of the table at @offset that the caller read from the image file
+ * without going through the cache. Nothing is added if the table got cached
+ * in the meantime, or if any table was written back since @generation was
+ * taken: the copy may be older than what is on disk now.
+ */
+int qcow2_cache_add(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+                    const void *table, uint64_t generation)
+{
+    void *entry;
+    int ret;
+
+    if (c->generation != generation || qcow2_cache_is_cached(c, offset)) {
+        return 0;
+    }
+
+    ret = qcow2_cache_do_get(bs, c, offset, &entry, false);
+    if (ret < 0) {
+        return ret;
+    }
+
+    memcpy(entry, table, c->table_size);
+    qcow2_cache_put(bs, c, &entry);
+
+    return 0;
+}
+
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
@@ -397,6 +536,7 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -23,7 +23,6 @@
  */
 
 #include "qemu/osdep.h"
-#include <zlib.h>
 
 #include "qapi/error.h"
 #include "qemu-common.h"
@@ -139,27 +138,95 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     return ret;
 }
 
+/* Byte offset of the slice that covers @offset in its L2 table */
+static inline int l2_slice_start(BDRVQcow2State *s, uint64_t offset)
+{
+    return sizeof(uint64_t) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+}
+
 /*
  * l2_load
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * Loads the slice of the L2 table at l2_offset that contains the guest
+ * offset into memory. If the slice is in the cache, the cache is used;
+ * otherwise it is loaded from the image file.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Returns 0 on success, -errno if the read from the image file failed.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+                   uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcow2State *s = bs->opaque;
+    int start_of_slice = l2_slice_start(s, offset);
     int ret;
 
-    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
+                          (void **) l2_slice);
 
     return ret;
 }
 
+/*
+ * qcow2_prefetch_l2_slice
+ *
+ * Brings the L2 slice that covers @offset into the cache, dropping s->lock
+ * while it is read from the image file so that requests that are served from
+ * other slices are not held up by the read. Called with s->lock held, before
+ * the caller has looked at any metadata for its request.
+ *
+ * This is only an optimization: if the slice cannot be read or the metadata
+ * changed in the meantime, the regular lookup will load it again.
+ */
+void coroutine_fn qcow2_prefetch_l2_slice(BlockDriverState *bs,
+                                          uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    size_t slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    uint64_t l1_index, l2_offset, slice_offset, generation;
+    void *buf;
+    int ret;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size) {
+        return;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return;
+    }
+
+    slice_offset = l2_offset + l2_slice_start(s, offset);
+    if (qcow2_cache_is_cached(s->l2_table_cache, slice_offset)) {
+        return;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, slice_size2);
+    if (buf == NULL) {
+        return;
+    }
+
+    generation = qcow2_cache_get_generation(s->l2_table_cache);
+
+    qemu_co_mutex_unlock(&s->lock);
+    BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    ret = bdrv_pread(bs->file->bs, slice_offset, buf, slice_size2);
+    qemu_co_mutex_lock(&s->lock);
+
+    trace_qcow2_prefetch_l2_slice(qemu_coroutine_self(), slice_offset, ret);
+
+    /* The L2 table may have been replaced while we were reading it */
+    if (ret >= 0 && l1_index < s->l1_size &&
+        (s->l1_table[l1_index] & L1E_OFFSET_MASK) == l2_offset)
+    {
+        qcow2_cache_add(bs, s->l2_table_cache, slice_offset, buf, generation);
+    }
+
+    qemu_vfree(buf);
+}
+
 /*
  * Writes one sector of the L1 table to the disk (can't update single entries
  * and we really don't want bdrv_pread to perform a read-modify-write)
@@ -196,6 +263,19 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
     return 0;
 }
 
+/* Returns the allocation of the L2 table for @l1_index in flight, if any */
+static Qcow2L2Alloc *l2_alloc_in_flight(BDRVQcow2State *s, uint64_t l1_index)
+{
+    Qcow2L2Alloc *alloc;
+
+    QLIST_FOREACH(alloc, &s->l2_allocs, next) {
+        if (alloc->l1_index == l1_index) {
+            return alloc;
+        }
+    }
+    return NULL;
+}
+
 /*
  * l2_allocate
  *
@@ -204,16 +284,29 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * In coroutine context, s->lock is dropped while the new table is written
+ * and flushed, so that requests to other L2 tables are not held up. Requests
+ * for the same table wait in get_cluster_table() until the L1 entry points
+ * to it. *unlocked tells whether that happened; if so, the caller must not
+ * rely on anything it looked up before.
+ *
+ * The new table is left in the cache; callers load the slice they need with
+ * l2_load().
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index, bool *unlocked)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t old_l2_offset;
+    uint64_t *l2_slice = NULL;
     uint64_t *l2_table = NULL;
+    size_t slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    int n_slices = s->cluster_size / slice_size2;
+    Qcow2L2Alloc alloc = { .l1_index = l1_index };
     int64_t l2_offset;
-    int ret;
+    int ret, slice;
 
+    *unlocked = false;
     old_l2_offset = s->l1_table[l1_index];
 
     trace_qcow2_l2_allocate(bs, l1_index);
@@ -226,51 +319,77 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    /* The refcount of the new table must be on disk before the L1 entry
+     * points to it; the flush below takes care of that */
+    ret = qcow2_cache_write(bs, s->refcount_block_cache);
     if (ret < 0) {
         goto fail;
     }
 
-    /* allocate a new entry in the l2 cache */
-
-    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
+    l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (l2_table == NULL) {
+        ret = -ENOMEM;
         goto fail;
     }
 
-    l2_table = *table;
-
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->cluster_size);
     } else {
-        uint64_t* old_table;
-
-        /* if there was an old l2 table, read it from the disk */
+        /* if there was an old l2 table, copy it slice by slice */
         BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
-        if (ret < 0) {
-            goto fail;
+        for (slice = 0; slice < n_slices; slice++) {
+            ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                  (old_l2_offset & L1E_OFFSET_MASK) +
+                                  slice * slice_size2, (void **) &l2_slice);
+            if (ret < 0) {
+                goto fail;
+            }
+            memcpy(l2_table + slice * s->l2_slice_size, l2_slice,
+                   slice_size2);
+            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
         }
+    }
 
-        memcpy(l2_table, old_table, s->cluster_size);
-
-        qcow2_cache_put(bs, s->l2_table_cache, (void **) &old_table);
+    ret = qcow2_pre_write_overlap_check(bs, 0, l2_offset, s->cluster_size);
+    if (ret < 0) {
+        goto fail;
     }
 
     /* write the l2 table to the file */
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
     trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (qemu_in_coroutine()) {
+        qemu_co_queue_init(&alloc.waiters);
+        QLIST_INSERT_HEAD(&s->l2_allocs, &alloc, next);
+        qemu_co_mutex_unlock(&s->lock);
+        *unlocked = true;
+    }
+    ret = bdrv_pwrite(bs->file->bs, l2_offset, l2_table, s->cluster_size);
+    if (ret >= 0) {
+        ret = bdrv_flush(bs->file->bs);
+    }
+    if (*unlocked) {
+        qemu_co_mutex_lock(&s->lock);
+    }
     if (ret < 0) {
         goto fail;
     }
 
+    /* the cache may still hold slices of a table that used this cluster */
+    for (slice = 0; slice < n_slices; slice++) {
+        trace_qcow2_l2_allocate_get_empty(bs, l1_index);
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice * slice_size2,
+                                    (void **) &l2_slice);
+        if (ret < 0) {
+            goto fail;
+        }
+        memcpy(l2_slice, l2_table + slice * s->l2_slice_size, slice_size2);
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+    }
+
     /* update the L1 entry */
     trace_qcow2_l2_allocate_write_l1(bs, l1_index);
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
@@ -279,20 +398,27 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
-    return 0;
+    ret = 0;
+    goto out;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    if (l2_table != NULL) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
+    if (l2_slice != NULL) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
         qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
                             QCOW2_DISCARD_ALWAYS);
     }
+
+out:
+    if (*unlocked) {
+        QLIST_REMOVE(&alloc, next);
+        qemu_co_queue_restart_all(&alloc.waiters);
+    }
+    qemu_vfree(l2_table);
     return ret;
 }
 
@@ -491,10 +617,12 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     l1_bits = s->l2_bits + s->cluster_bits;
 
     /* compute how many bytes there are between the offset and
-     * the end of the l1 entry
+     * the end of the L2 slice that contains it
      */
 
-    nb_available = (1ULL << l1_bits) - (offset & ((1ULL << l1_bits) - 1));
+    nb_available = ((uint64_t) (s->l2_slice_size -
+                                offset_to_l2_slice_index(s, offset))
+                    << s->cluster_bits) - offset_into_cluster(s, offset);
 
     /* compute the number of available sectors */
 
@@ -528,16 +656,16 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         return -EIO;
     }
 
-    /* load the l2 table in memory */
+    /* load the l2 table slice in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
     if (ret < 0) {
         return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
     *cluster_offset = be64_to_cpu(l2_table[l2_index]);
 
     /* nb_needed <= INT_MAX, thus nb_clusters <= INT_MAX, too */
@@ -607,12 +735,15 @@ fail:
  * get_cluster_table
  *
  * for a given disk offset, load (and allocate if needed)
- * the l2 table.
+ * the slice of the l2 table that contains it.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the l2 table slice and the cluster index in that slice are
+ * given to the caller.
  *
- * Returns 0 on success, -errno in failure case
+ * Returns 0 on success, -errno in failure case. -EAGAIN means that s->lock
+ * was dropped while the table was allocated, by this request or another one;
+ * anything the caller looked up before may have changed, so it must start
+ * over.
  */
 static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
                              uint64_t **new_l2_table,
@@ -622,6 +753,8 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
     unsigned int l2_index;
     uint64_t l1_index, l2_offset;
     uint64_t *l2_table = NULL;
+    Qcow2L2Alloc *alloc;
+    bool unlocked;
     int ret;
 
     /* seek to the l2 offset in the l1 table */
@@ -645,15 +778,18 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
     /* seek the l2 table of the given l2 offset */
 
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
-        if (ret < 0) {
-            return ret;
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
+        /* Another request is already allocating the table */
+        alloc = l2_alloc_in_flight(s, l1_index);
+        if (alloc) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&alloc->waiters);
+            qemu_co_mutex_lock(&s->lock);
+            return -EAGAIN;
         }
-    } else {
+
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index, &unlocked);
         if (ret < 0) {
             return ret;
         }
@@ -663,11 +799,25 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
             qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
                                 QCOW2_DISCARD_OTHER);
         }
+
+        if (unlocked) {
+            return -EAGAIN;
+        }
+
+        /* Get the offset of the newly-allocated l2 table */
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+        assert(offset_into_cluster(s, l2_offset) == 0);
+    }
+
+    /* load the l2 table slice in memory */
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
+    if (ret < 0) {
+        return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
     *new_l2_table = l2_table;
     *new_l2_index = l2_index;
@@ -698,7 +848,9 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
     int64_t cluster_offset;
     int nb_csectors;
 
-    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    do {
+        ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    } while (ret == -EAGAIN);
     if (ret < 0) {
         return 0;
     }
@@ -767,7 +919,7 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcow2State *s = bs->opaque;
-    int i, j = 0, l2_index, ret;
+    int i, j = 0, n, l2_index, ret;
     uint64_t *old_cluster, *l2_table;
     uint64_t cluster_offset = m->alloc_offset;
 
@@ -806,7 +958,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
 
-    assert(l2_index + m->nb_clusters <= s->l2_size);
+    assert(l2_index + m->nb_clusters <= s->l2_slice_size);
     for (i = 0; i < m->nb_clusters; i++) {
         /* if two concurrent writes happen to the same unallocated cluster
 	 * each write allocates separate cluster and writes data concurrently.
@@ -826,15 +978,27 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 
     /*
      * If this was a COW, we need to decrease the refcount of the old cluster.
+     * Runs of contiguous uncompressed clusters are freed with a single
+     * refcount update.
      *
      * Don't discard clusters that reach a refcount of 0 (e.g. compressed
      * clusters), the next write will reuse them anyway.
      */
-    if (j != 0) {
-        for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
-                                    QCOW2_DISCARD_NEVER);
+    for (i = 0; i < j; i += n) {
+        uint64_t entry = be64_to_cpu(old_cluster[i]);
+
+        n = 1;
+        if (qcow2_get_cluster_type(entry) != QCOW2_CLUSTER_COMPRESSED) {
+            while (i + n < j &&
+                   qcow2_get_cluster_type(be64_to_cpu(old_cluster[i + n])) !=
+                       QCOW2_CLUSTER_COMPRESSED &&
+                   (be64_to_cpu(old_cluster[i + n]) & L2E_OFFSET_MASK) ==
+                       (entry & L2E_OFFSET_MASK) + n * s->cluster_size)
+            {
+                n++;
+            }
         }
+        qcow2_free_any_clusters(bs, entry, n, QCOW2_DISCARD_NEVER);
     }
 
     ret = 0;
@@ -962,6 +1126,9 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
  *          the requested offset. *bytes may have decreased and describes
  *          the length of the area that can be written to.
  *
+ *  -EAGAIN: if s->lock was dropped to allocate an L2 table, or to wait for
+ *          another request that allocates it. Nothing was done.
+ *
  *  -errno: in error cases
  */
 static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
@@ -982,14 +1149,14 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                                 == offset_into_cluster(s, *host_offset));
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     /* Find L2 entry for the first involved cluster */
@@ -1118,6 +1285,9 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
  *          *host_offset is updated to contain the host offset of the first
  *          newly allocated cluster.
  *
+ *  -EAGAIN: if s->lock was dropped to allocate an L2 table, or to wait for
+ *          another request that allocates it. Nothing was done.
+ *
  *  -errno: in error cases
  */
 static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
@@ -1137,14 +1307,14 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     assert(*bytes > 0);
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     /* Find L2 entry for the first involved cluster */
@@ -1351,7 +1521,9 @@ again:
          * 2. Count contiguous COPIED clusters.
          */
         ret = handle_copied(bs, start, &cluster_offset, &cur_bytes, m);
-        if (ret < 0) {
+        if (ret == -EAGAIN) {
+            goto unlocked;
+        } else if (ret < 0) {
             return ret;
         } else if (ret) {
             continue;
@@ -1364,7 +1536,9 @@ again:
          *    considering any cluster_offset of steps 1c or 2.
          */
         ret = handle_alloc(bs, start, &cluster_offset, &cur_bytes, m);
-        if (ret < 0) {
+        if (ret == -EAGAIN) {
+            goto unlocked;
+        } else if (ret < 0) {
             return ret;
         } else if (ret) {
             continue;
@@ -1372,6 +1546,16 @@ again:
             assert(cur_bytes == 0);
             break;
         }
+
+unlocked:
+        /* s->lock was dropped while an L2 table was allocated. The clusters
+         * gathered so far are still ours, so return them and let the caller
+         * come back for the rest; if there are none, start over. */
+        if (start == offset) {
+            assert(*m == NULL);
+            goto again;
+        }
+        break;
     }
 
     *num -= remaining >> BDRV_SECTOR_BITS;
@@ -1381,57 +1565,76 @@ again:
     return 0;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
-{
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
-}
-
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+/*
+ * Read @nb_sectors sectors starting at @index_in_cluster from the compressed
+ * cluster described by the L2 entry @cluster_offset into @qiov.
+ *
+ * Called with s->lock held.  The lock is dropped while the compressed data is
+ * read and inflated in a worker thread, so that several compressed clusters
+ * can be in flight at once.  The last decompressed cluster is kept in
+ * s->cluster_cache; it is only updated if no write happened in the meantime,
+ * as the host cluster may have been freed and reused by then.
+ */
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          int index_in_cluster, int nb_sectors,
+                                          QEMUIOVector *qiov)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
+    uint64_t coffset, gen;
+    uint8_t *in_buf = NULL, *out_buf = NULL;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file->bs, coffset >> 9, s->cluster_data,
-                        nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
+    if (s->cluster_cache_offset == coffset) {
+        qemu_iovec_from_buf(qiov, 0,
+                            s->cluster_cache + index_in_cluster * 512,
+                            nb_sectors * 512);
+        return 0;
+    }
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+
+    in_buf = qemu_try_blockalign(bs->file->bs, nb_csectors * 512);
+    out_buf = g_try_malloc(s->cluster_size);
+    if (in_buf == NULL || out_buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    gen = s->cluster_cache_gen;
+    qemu_co_mutex_unlock(&s->lock);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_read(bs->file->bs, coffset >> 9, in_buf, nb_csectors);
+    if (ret >= 0) {
+        ret = qcow2_co_decompress(bs, out_buf, s->cluster_size,
+                                  in_buf + sector_offset, csize);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, out_buf + index_in_cluster * 512,
+                        nb_sectors * 512);
+
+    if (s->cluster_cache_gen == gen) {
+        uint8_t *old_cache = s->cluster_cache;
+
+        s->cluster_cache = out_buf;
         s->cluster_cache_offset = coffset;
+        out_buf = old_cache;
     }
-    return 0;
+
+    ret = 0;
+out:
+    qemu_vfree(in_buf);
+    g_free(out_buf);
+    return ret;
 }
 
 /*
@@ -1449,13 +1652,15 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     int ret;
     int i;
 
-    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    do {
+        ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    } while (ret == -EAGAIN);
     if (ret < 0) {
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 table slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
@@ -1569,13 +1774,15 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     int ret;
     int i;
 
-    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    do {
+        ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    } while (ret == -EAGAIN);
     if (ret < 0) {
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 table slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
@@ -1648,22 +1855,23 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
 {
     BDRVQcow2State *s = bs->opaque;
     bool is_active_l1 = (l1_table == s->l1_table);
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
+    size_t slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    int n_slices = s->cluster_size / slice_size2;
     int ret;
-    int i, j;
+    int i, j, slice;
 
     if (!is_active_l1) {
         /* inactive L2 tables require a buffer to be stored in when loading
          * them from disk */
-        l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
-        if (l2_table == NULL) {
+        l2_slice = qemu_try_blockalign(bs->file->bs, slice_size2);
+        if (l2_slice == NULL) {
             return -ENOMEM;
         }
     }
 
     for (i = 0; i < l1_size; i++) {
         uint64_t l2_offset = l1_table[i] & L1E_OFFSET_MASK;
-        bool l2_dirty = false;
         uint64_t l2_refcount;
 
         if (!l2_offset) {
@@ -1683,124 +1891,137 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             goto fail;
         }
 
-        if (is_active_l1) {
-            /* get active L2 tables from cache */
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                    (void **)&l2_table);
-        } else {
-            /* load inactive L2 tables from disk */
-            ret = bdrv_read(bs->file->bs, l2_offset / BDRV_SECTOR_SIZE,
-                            (void *)l2_table, s->cluster_sectors);
-        }
-        if (ret < 0) {
-            goto fail;
-        }
-
         ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
                                  &l2_refcount);
         if (ret < 0) {
             goto fail;
         }
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            int64_t offset = l2_entry & L2E_OFFSET_MASK;
-            int cluster_type = qcow2_get_cluster_type(l2_entry);
-            bool preallocated = offset != 0;
+        for (slice = 0; slice < n_slices; slice++) {
+            uint64_t slice_offset = l2_offset + slice * slice_size2;
+            bool l2_dirty = false;
 
-            if (cluster_type != QCOW2_CLUSTER_ZERO) {
-                continue;
+            if (is_active_l1) {
+                /* get active L2 tables from cache */
+                ret = qcow2_cache_get(bs, s->l2_table_cache, slice_offset,
+                                      (void **)&l2_slice);
+            } else {
+                /* load inactive L2 tables from disk */
+                ret = bdrv_read(bs->file->bs, slice_offset / BDRV_SECTOR_SIZE,
+                                (void *)l2_slice,
+                                slice_size2 / BDRV_SECTOR_SIZE);
+            }
+            if (ret < 0) {
+                goto fail;
             }
 
-            if (!preallocated) {
-                if (!bs->backing) {
-                    /* not backed; therefore we can simply deallocate the
-                     * cluster */
-                    l2_table[j] = 0;
-                    l2_dirty = true;
+            for (j = 0; j < s->l2_slice_size; j++) {
+                uint64_t l2_entry = be64_to_cpu(l2_slice[j]);
+                int64_t offset = l2_entry & L2E_OFFSET_MASK;
+                int cluster_type = qcow2_get_cluster_type(l2_entry);
+                bool preallocated = offset != 0;
+
+                if (cluster_type != QCOW2_CLUSTER_ZERO) {
                     continue;
                 }
 
-                offset = qcow2_alloc_clusters(bs, s->cluster_size);
-                if (offset < 0) {
-                    ret = offset;
-                    goto fail;
-                }
+                if (!preallocated) {
+                    if (!bs->backing) {
+                        /* not backed; therefore we can simply deallocate the
+                         * cluster */
+                        l2_slice[j] = 0;
+                        l2_dirty = true;
+                        continue;
+                    }
 
-                if (l2_refcount > 1) {
-                    /* For shared L2 tables, set the refcount accordingly (it is
-                     * already 1 and needs to be l2_refcount) */
-                    ret = qcow2_update_cluster_refcount(bs,
-                            offset >> s->cluster_bits,
-                            refcount_diff(1, l2_refcount), false,
-                            QCOW2_DISCARD_OTHER);
-                    if (ret < 0) {
-                        qcow2_free_clusters(bs, offset, s->cluster_size,
-                                            QCOW2_DISCARD_OTHER);
+                    offset = qcow2_alloc_clusters(bs, s->cluster_size);
+                    if (offset < 0) {
+                        ret = offset;
                         goto fail;
                     }
+
+                    if (l2_refcount > 1) {
+                        /* For shared L2 tables, set the refcount accordingly
+                         * (it is already 1 and needs to be l2_refcount) */
+                        ret = qcow2_update_cluster_refcount(bs,
+                                offset >> s->cluster_bits,
+                                refcount_diff(1, l2_refcount), false,
+                                QCOW2_DISCARD_OTHER);
+                        if (ret < 0) {
+                            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                                QCOW2_DISCARD_OTHER);
+                            goto fail;
+                        }
+                    }
                 }
-            }
 
-            if (offset_into_cluster(s, offset)) {
-                qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset "
-                                        "%#" PRIx64 " unaligned (L2 offset: %#"
-                                        PRIx64 ", L2 index: %#x)", offset,
-                                        l2_offset, j);
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                if (offset_into_cluster(s, offset)) {
+                    qcow2_signal_corruption(bs, true, -1, -1,
+                                            "Data cluster offset %#" PRIx64
+                                            " unaligned (L2 offset: %#"
+                                            PRIx64 ", L2 index: %#x)", offset,
+                                            l2_offset,
+                                            slice * s->l2_slice_size + j);
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    ret = -EIO;
+                    goto fail;
                 }
-                ret = -EIO;
-                goto fail;
-            }
 
-            ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                                    s->cluster_size);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            ret = bdrv_write_zeroes(bs->file->bs, offset / BDRV_SECTOR_SIZE,
-                                    s->cluster_sectors, 0);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = bdrv_write_zeroes(bs->file->bs,
+                                        offset / BDRV_SECTOR_SIZE,
+                                        s->cluster_sectors, 0);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            if (l2_refcount == 1) {
-                l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
-            } else {
-                l2_table[j] = cpu_to_be64(offset);
+                if (l2_refcount == 1) {
+                    l2_slice[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+                } else {
+                    l2_slice[j] = cpu_to_be64(offset);
+                }
+                l2_dirty = true;
             }
-            l2_dirty = true;
-        }
 
-        if (is_active_l1) {
-            if (l2_dirty) {
-                qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-                qcow2_cache_depends_on_flush(s->l2_table_cache);
-            }
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
-        } else {
-            if (l2_dirty) {
-                ret = qcow2_pre_write_overlap_check(bs,
-                        QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2, l2_offset,
-                        s->cluster_size);
-                if (ret < 0) {
-                    goto fail;
+            if (is_active_l1) {
+                if (l2_dirty) {
+                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                 l2_slice);
+                    qcow2_cache_depends_on_flush(s->l2_table_cache);
                 }
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+            } else {
+                if (l2_dirty) {
+                    ret = qcow2_pre_write_overlap_check(bs,
+                            QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2,
+                            slice_offset, slice_size2);
+                    if (ret < 0) {
+                        goto fail;
+                    }
 
-                ret = bdrv_write(bs->file->bs, l2_offset / BDRV_SECTOR_SIZE,
-                                 (void *)l2_table, s->cluster_sectors);
-                if (ret < 0) {
-                    goto fail;
+                    ret = bdrv_write(bs->file->bs,
+                                     slice_offset / BDRV_SECTOR_SIZE,
+                                     (void *)l2_slice,
+                                     slice_size2 / BDRV_SECTOR_SIZE);
+                    if (ret < 0) {
+                        goto fail;
+                    }
                 }
             }
         }
@@ -1814,11 +2035,11 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     ret = 0;
 
 fail:
-    if (l2_table) {
+    if (l2_slice) {
         if (!is_active_l1) {
-            qemu_vfree(l2_table);
+            qemu_vfree(l2_slice);
         } else {
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
         }
     }
     return ret;
@@ -33,6 +33,8 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                             int64_t offset, int64_t length, uint64_t addend,
                             bool decrease, enum qcow2_discard_type type);
+static void free_cluster_map_update(BDRVQcow2State *s, uint64_t cluster_index,
+                                    bool is_free);
 
 static uint64_t get_refcount_ro0(const void *refcount_array, uint64_t index);
 static uint64_t get_refcount_ro1(const void *refcount_array, uint64_t index);
@@ -119,6 +121,7 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+    qcow2_free_cluster_map_reset(bs);
     g_free(s->refcount_table);
 }
 
@@ -754,6 +757,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
+        free_cluster_map_update(s, cluster_index, refcount == 0);
         s->set_refcount(refcount_block, block_index, refcount);
 
         if (refcount == 0 && s->discard_passthrough[type]) {
@@ -818,6 +822,144 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 
 
 
+/*
+ * Builds s->free_cluster_map from the refcount blocks. The map covers all
+ * clusters up to the last allocated refcount block, all clusters behind it
+ * have a refcount of 0.
+ */
+static int free_cluster_map_build(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t i, j, first, run_start, nb_refblocks = 0;
+    void *refcount_block;
+    HBitmap *map;
+    int ret;
+
+    for (i = 0; i < s->refcount_table_size; i++) {
+        if (s->refcount_table[i] & REFT_OFFSET_MASK) {
+            nb_refblocks = i + 1;
+        }
+    }
+
+    map = hbitmap_alloc(nb_refblocks << s->refcount_block_bits, 0);
+
+    for (i = 0; i < nb_refblocks; i++) {
+        uint64_t refblock_offset = s->refcount_table[i] & REFT_OFFSET_MASK;
+
+        first = i << s->refcount_block_bits;
+        if (!refblock_offset) {
+            hbitmap_set(map, first, s->refcount_block_size);
+            continue;
+        }
+
+        if (offset_into_cluster(s, refblock_offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#"
+                                    PRIx64 " unaligned (reftable index: %#"
+                                    PRIx64 ")", refblock_offset, i);
+            ret = -EIO;
+            goto fail;
+        }
+
+        ret = load_refcount_block(bs, refblock_offset, &refcount_block);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* Set runs of free clusters at once */
+        run_start = s->refcount_block_size;
+        for (j = 0; j < s->refcount_block_size; j++) {
+            if (s->get_refcount(refcount_block, j) == 0) {
+                if (run_start == s->refcount_block_size) {
+                    run_start = j;
+                }
+            } else if (run_start != s->refcount_block_size) {
+                hbitmap_set(map, first + run_start, j - run_start);
+                run_start = s->refcount_block_size;
+            }
+        }
+        if (run_start != s->refcount_block_size) {
+            hbitmap_set(map, first + run_start,
+                        s->refcount_block_size - run_start);
+        }
+
+        qcow2_cache_put(bs, s->refcount_block_cache, &refcount_block);
+    }
+
+    s->free_cluster_map = map;
+    s->free_cluster_map_size = nb_refblocks << s->refcount_block_bits;
+    return 0;
+
+fail:
+    hbitmap_free(map);
+    return ret;
+}
+
+/*
+ * Records in s->free_cluster_map whether the refcount of a cluster has become
+ * zero or non-zero. Refcounts that are set without going through
+ * update_refcount() (self-describing refcount blocks) may leave a cluster
+ * marked as free; the allocation checks the refcount and corrects the map.
+ */
+static void free_cluster_map_update(BDRVQcow2State *s, uint64_t cluster_index,
+                                    bool is_free)
+{
+    if (!s->free_cluster_map) {
+        return;
+    }
+
+    if (cluster_index >= s->free_cluster_map_size) {
+        uint64_t old_size = s->free_cluster_map_size;
+        uint64_t new_size = ROUND_UP(cluster_index + 1,
+                                     s->refcount_block_size);
+
+        if (!is_free) {
+            /* Nothing to record, clusters behind the map count as free */
+            return;
+        }
+        hbitmap_truncate(s->free_cluster_map, new_size);
+        hbitmap_set(s->free_cluster_map, old_size, new_size - old_size);
+        s->free_cluster_map_size = new_size;
+        return;
+    }
+
+    if (is_free) {
+        hbitmap_set(s->free_cluster_map, cluster_index, 1);
+    } else {
+        hbitmap_reset(s->free_cluster_map, cluster_index, 1);
+    }
+}
+
+/* Returns the first cluster index >= @start that may be free */
+static uint64_t free_cluster_map_next(BDRVQcow2State *s, uint64_t start)
+{
+    HBitmapIter hbi;
+    int64_t next;
+
+    if (start >= s->free_cluster_map_size) {
+        return start;
+    }
+
+    hbitmap_iter_init(&hbi, s->free_cluster_map, start);
+    next = hbitmap_iter_next(&hbi);
+
+    return next < 0 ? s->free_cluster_map_size : next;
+}
+
+/*
+ * Drops s->free_cluster_map, for when the refcount structures are replaced
+ * as a whole. It is rebuilt on the next allocation.
+ */
+void qcow2_free_cluster_map_reset(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->free_cluster_map) {
+        hbitmap_free(s->free_cluster_map);
+        s->free_cluster_map = NULL;
+        s->free_cluster_map_size = 0;
+    }
+}
+
 /* return < 0 if error */
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
 {
@@ -830,15 +972,31 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
         qcow2_process_discards(bs, 0);
     }
 
+    if (!s->free_cluster_map) {
+        ret = free_cluster_map_build(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     nb_clusters = size_to_clusters(s, size);
 retry:
+    /* Skip clusters known to be in use without looking at their refcount */
+    s->free_cluster_index = free_cluster_map_next(s, s->free_cluster_index);
     for(i = 0; i < nb_clusters; i++) {
         uint64_t next_cluster_index = s->free_cluster_index++;
+
+        if (next_cluster_index < s->free_cluster_map_size &&
+            !hbitmap_get(s->free_cluster_map, next_cluster_index)) {
+            goto retry;
+        }
+
         ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
 
         if (ret < 0) {
             return ret;
         } else if (refcount != 0) {
+            free_cluster_map_update(s, next_cluster_index, false);
             goto retry;
         }
     }
@@ -1052,7 +1210,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, refcount;
     bool l1_allocated = false;
     int64_t old_offset, old_l2_offset;
-    int i, j, l1_modified = 0, nb_csectors;
+    size_t slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    int n_slices = s->cluster_size / slice_size2;
+    int i, j, slice, l1_modified = 0, nb_csectors;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
@@ -1101,93 +1261,98 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                      l2_offset + slice * slice_size2,
+                                      (void **) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
-
-                switch (qcow2_get_cluster_type(offset)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
+                for (j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
+
+                    offset = be64_to_cpu(l2_table[j]);
+                    old_offset = offset;
+                    offset &= ~QCOW_OFLAG_COPIED;
+
+                    switch (qcow2_get_cluster_type(offset)) {
+                        case QCOW2_CLUSTER_COMPRESSED:
+                            nb_csectors = ((offset >> s->csize_shift) &
+                                           s->csize_mask) + 1;
+                            if (addend != 0) {
+                                ret = update_refcount(bs,
+                                    (offset & s->cluster_offset_mask) & ~511,
+                                    nb_csectors * 512, abs(addend), addend < 0,
+                                    QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                            }
+                            /* compressed clusters are never modified */
+                            refcount = 2;
+                            break;
+
+                        case QCOW2_CLUSTER_NORMAL:
+                        case QCOW2_CLUSTER_ZERO:
+                            if (offset_into_cluster(s,
+                                                    offset & L2E_OFFSET_MASK)) {
+                                qcow2_signal_corruption(bs, true, -1, -1,
+                                    "Data cluster offset %#llx unaligned "
+                                    "(L2 offset: %#" PRIx64 ", L2 index: %#x)",
+                                    offset & L2E_OFFSET_MASK, l2_offset,
+                                    slice * s->l2_slice_size + j);
+                                ret = -EIO;
                                 goto fail;
                             }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO:
-                        if (offset_into_cluster(s, offset & L2E_OFFSET_MASK)) {
-                            qcow2_signal_corruption(bs, true, -1, -1, "Data "
-                                                    "cluster offset %#llx "
-                                                    "unaligned (L2 offset: %#"
-                                                    PRIx64 ", L2 index: %#x)",
-                                                    offset & L2E_OFFSET_MASK,
-                                                    l2_offset, j);
-                            ret = -EIO;
-                            goto fail;
-                        }
 
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (!cluster_index) {
-                            /* unallocated */
-                            refcount = 0;
-                            break;
-                        }
-                        if (addend != 0) {
-                            ret = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, abs(addend), addend < 0,
-                                    QCOW2_DISCARD_SNAPSHOT);
+                            cluster_index = (offset & L2E_OFFSET_MASK) >>
+                                            s->cluster_bits;
+                            if (!cluster_index) {
+                                /* unallocated */
+                                refcount = 0;
+                                break;
+                            }
+                            if (addend != 0) {
+                                ret = qcow2_update_cluster_refcount(bs,
+                                        cluster_index, abs(addend), addend < 0,
+                                        QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                            }
+
+                            ret = qcow2_get_refcount(bs, cluster_index,
+                                                     &refcount);
                             if (ret < 0) {
                                 goto fail;
                             }
-                        }
-
-                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                        if (ret < 0) {
-                            goto fail;
-                        }
-                        break;
+                            break;
 
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
+                        case QCOW2_CLUSTER_UNALLOCATED:
+                            refcount = 0;
+                            break;
 
-                    default:
-                        abort();
-                }
+                        default:
+                            abort();
+                    }
 
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                    if (refcount == 1) {
+                        offset |= QCOW_OFLAG_COPIED;
+                    }
+                    if (offset != old_offset) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        l2_table[j] = cpu_to_be64(offset);
+                        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                     l2_table);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
-                                                 l2_table);
                 }
-            }
 
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            }
 
             if (addend != 0) {
                 ret = qcow2_update_cluster_refcount(bs, l2_offset >>
@@ -1315,11 +1480,10 @@ static int realloc_refcount_array(BDRVQcow2State *s, void **array,
  *
  * Modifies the number of errors in res.
  */
-static int inc_refcounts(BlockDriverState *bs,
-                         BdrvCheckResult *res,
-                         void **refcount_table,
-                         int64_t *refcount_table_size,
-                         int64_t offset, int64_t size)
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t start, last, cluster_offset, k, refcount;
@@ -1412,8 +1576,9 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_entry & ~511, nb_csectors * 512);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size,
+                                           l2_entry & ~511, nb_csectors * 512);
             if (ret < 0) {
                 goto fail;
             }
@@ -1451,8 +1616,9 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, offset,
+                                           s->cluster_size);
             if (ret < 0) {
                 goto fail;
             }
@@ -1504,8 +1670,9 @@ static int check_refcounts_l1(BlockDriverState *bs,
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                        l1_table_offset, l1_size2);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                   refcount_table_size, l1_table_offset,
+                                   l1_size2);
     if (ret < 0) {
         goto fail;
     }
@@ -1534,8 +1701,9 @@ static int check_refcounts_l1(BlockDriverState *bs,
         if (l2_offset) {
             /* Mark L2 table as used */
             l2_offset &= L1E_OFFSET_MASK;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, l2_offset,
+                                           s->cluster_size);
             if (ret < 0) {
                 goto fail;
             }
@@ -1750,14 +1918,15 @@ static int check_refblocks(BlockDriverState *bs, BdrvCheckResult *res,
                 }
 
                 res->corruptions_fixed++;
-                ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                                    offset, s->cluster_size);
+                ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                               nb_clusters, offset,
+                                               s->cluster_size);
                 if (ret < 0) {
                     return ret;
                 }
                 /* No need to check whether the refcount is now greater than 1:
                  * This area was just allocated and zeroed, so it can only be
-                 * exactly 1 after inc_refcounts() */
+                 * exactly 1 after qcow2_inc_refcounts_imrt() */
                 continue;
 
 resize_fail:
@@ -1772,8 +1941,9 @@ resize_fail:
         }
 
         if (offset != 0) {
-            ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                                offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           nb_clusters, offset,
+                                           s->cluster_size);
             if (ret < 0) {
                 return ret;
             }
@@ -1813,8 +1983,8 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     /* header */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        0, s->cluster_size);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters, 0,
+                                   s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -1835,16 +2005,22 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             return ret;
         }
     }
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        s->snapshots_offset, s->snapshots_size);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   s->snapshots_offset, s->snapshots_size);
     if (ret < 0) {
         return ret;
     }
 
     /* refcount data */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        s->refcount_table_offset,
-                        s->refcount_table_size * sizeof(uint64_t));
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   s->refcount_table_offset,
+                                   s->refcount_table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* persistent dirty bitmaps */
+    ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
         return ret;
     }
@@ -2178,6 +2354,7 @@ write_refblocks:
     s->refcount_table = on_disk_reftable;
     s->refcount_table_offset = reftable_offset;
     s->refcount_table_size = reftable_size;
+    qcow2_free_cluster_map_reset(bs);
 
     return 0;
 
@@ -2309,6 +2486,11 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 fail:
     g_free(refcount_table);
 
+    /* Repairs may have rewritten refcount blocks directly */
+    if (fix) {
+        qcow2_free_cluster_map_reset(bs);
+    }
+
     return ret;
 }
 
@@ -2878,6 +3060,7 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
     /* Now update the rest of the in-memory information */
     old_reftable = s->refcount_table;
     s->refcount_table = new_reftable;
+    qcow2_free_cluster_map_reset(bs);
 
     s->refcount_bits = 1 << refcount_order;
     s->refcount_max = UINT64_C(1) << (s->refcount_bits - 1);
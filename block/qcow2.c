@@ -25,7 +25,6 @@
 #include "block/block_int.h"
 #include "sysemu/block-backend.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
@@ -62,6 +61,14 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
+
+typedef struct {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} QEMU_PACKED Qcow2BitmapHeaderExt;
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -89,6 +96,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 {
     BDRVQcow2State *s = bs->opaque;
     QCowExtension ext;
+    Qcow2BitmapHeaderExt bitmaps_ext;
     uint64_t offset;
     int ret;
 
@@ -161,6 +169,61 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: bitmaps_ext: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                /* Written by a program that did not update the bitmaps; the
+                 * extension is dropped with the next header update */
+                error_report("WARNING: bitmaps_ext: autoclear flag is not "
+                             "set, all bitmaps are considered inconsistent");
+                break;
+            }
+
+            ret = bdrv_pread(bs->file->bs, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: bitmaps_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be32_to_cpus(&bitmaps_ext.reserved32);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.reserved32 != 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Reserved field is not zero");
+                return -EINVAL;
+            }
+            if (bitmaps_ext.nb_bitmaps == 0 ||
+                bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS) {
+                error_setg(errp, "ERROR: bitmaps_ext: Invalid number of "
+                           "bitmaps: %" PRIu32, bitmaps_ext.nb_bitmaps);
+                return -EINVAL;
+            }
+            if (bitmaps_ext.bitmap_directory_size == 0 ||
+                bitmaps_ext.bitmap_directory_size >
+                QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+                error_setg(errp, "ERROR: bitmaps_ext: Invalid bitmap "
+                           "directory size");
+                return -EINVAL;
+            }
+            if (offset_into_cluster(s, bitmaps_ext.bitmap_directory_offset)) {
+                error_setg(errp, "ERROR: bitmaps_ext: Invalid bitmap "
+                           "directory offset");
+                return -EINVAL;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_size = bitmaps_ext.bitmap_directory_size;
+            s->bitmap_directory_offset = bitmaps_ext.bitmap_directory_offset;
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -455,6 +518,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
         {
             .name = QCOW2_OPT_CACHE_CLEAN_INTERVAL,
             .type = QEMU_OPT_NUMBER,
@@ -580,10 +648,13 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    int l2_slice_size;
     bool use_lazy_refcounts;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    /* The persistent bitmaps were stored for a reopen to read-only */
+    bool bitmaps_stored;
 } Qcow2ReopenState;
 
 static int qcow2_update_options_prepare(BlockDriverState *bs,
@@ -595,7 +666,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     QemuOpts *opts = NULL;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, refcount_cache_size, l2_cache_entry_size;
     int i;
     Error *local_err = NULL;
     int ret;
@@ -617,7 +688,22 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    /* L2 tables may be cached in slices smaller than a cluster, so that the
+     * same amount of memory covers more of the image with random I/O */
+    l2_cache_entry_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+                                            s->cluster_size);
+    if (l2_cache_entry_size < (1 << MIN_CLUSTER_BITS) ||
+        l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(l2_cache_entry_size)) {
+        error_setg(errp, "L2 cache entry size must be a power of two between "
+                   "%d and the cluster size (%d)",
+                   1 << MIN_CLUSTER_BITS, s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -655,8 +741,10 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -763,6 +851,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    s->l2_slice_size = r->l2_slice_size;
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
@@ -814,6 +903,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     QCowHeader header;
     Error *local_err = NULL;
     uint64_t ext_end;
+    uint64_t autoclear_mask;
     uint64_t l1_vm_state_index;
 
     ret = bdrv_pread(bs->file->bs, 0, &header, sizeof(header));
@@ -1077,15 +1167,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_try_blockalign(bs->file->bs, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
-        goto fail;
-    }
-
     s->cluster_cache_offset = -1;
     s->flags = flags;
 
@@ -1096,6 +1177,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     QLIST_INIT(&s->cluster_allocs);
+    QLIST_INIT(&s->l2_allocs);
     QTAILQ_INIT(&s->discards);
 
     /* read qcow2 extensions */
@@ -1135,9 +1217,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    /* Clear unknown autoclear feature bits, and the bitmaps bit if there is
+     * no bitmaps extension to go with it */
+    autoclear_mask = QCOW2_AUTOCLEAR_MASK;
+    if (s->nb_bitmaps == 0) {
+        autoclear_mask &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) &&
+        (s->autoclear_features & ~autoclear_mask)) {
+        s->autoclear_features &= autoclear_mask;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -1147,6 +1235,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->compress_wait_queue);
 
     /* Repair image if dirty */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE)) && !bs->read_only &&
@@ -1160,6 +1249,16 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    /* Persistent dirty bitmaps are only tracked while the image is writable;
+     * they are stored again by qcow2_inactivate() or by a reopen to
+     * read-only */
+    if (!(flags & BDRV_O_INACTIVE) && !bs->read_only) {
+        ret = qcow2_load_persistent_dirty_bitmaps(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1184,7 +1283,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     return ret;
 }
 
@@ -1230,6 +1328,19 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
     return 0;
 }
 
+/* The image stays writable, so the bitmaps stored by a failed reopen to
+ * read-only must be flagged in_use again */
+static void qcow2_reopen_bitmaps_abort(BlockDriverState *bs,
+                                       Qcow2ReopenState *r)
+{
+    Error *local_err = NULL;
+
+    if (r->bitmaps_stored &&
+        qcow2_load_persistent_dirty_bitmaps(bs, &local_err) < 0) {
+        error_report_err(local_err);
+    }
+}
+
 static int qcow2_reopen_prepare(BDRVReopenState *state,
                                 BlockReopenQueue *queue, Error **errp)
 {
@@ -1247,6 +1358,16 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
 
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        /* Nothing can update the bitmaps in the image once it is read-only,
+         * so they are stored now rather than on close */
+        if (!state->bs->read_only) {
+            ret = qcow2_store_persistent_dirty_bitmaps(state->bs, errp);
+            if (ret < 0) {
+                goto fail;
+            }
+            r->bitmaps_stored = true;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -1261,6 +1382,7 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     return 0;
 
 fail:
+    qcow2_reopen_bitmaps_abort(state->bs, r);
     qcow2_update_options_abort(state->bs, r);
     g_free(r);
     return ret;
@@ -1274,10 +1396,19 @@ static void qcow2_reopen_commit(BDRVReopenState *state)
 
 static void qcow2_reopen_abort(BDRVReopenState *state)
 {
+    qcow2_reopen_bitmaps_abort(state->bs, state->opaque);
     qcow2_update_options_abort(state->bs, state->opaque);
     g_free(state->opaque);
 }
 
+static int qcow2_reopen_bitmaps_rw(BlockDriverState *bs, Error **errp)
+{
+    if (bs->open_flags & BDRV_O_INACTIVE) {
+        return 0;
+    }
+    return qcow2_load_persistent_dirty_bitmaps(bs, errp);
+}
+
 static void qcow2_join_options(QDict *options, QDict *old_options)
 {
     bool has_new_overlap_template =
@@ -1397,6 +1528,7 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                 QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors);
         }
 
+        qcow2_prefetch_l2_slice(bs, sector_num << 9);
         ret = qcow2_get_cluster_offset(bs, sector_num << 9,
             &cur_nr_sectors, &cluster_offset);
         if (ret < 0) {
@@ -1446,15 +1578,12 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_co_read_compressed(bs, cluster_offset,
+                                           index_in_cluster, cur_nr_sectors,
+                                           &hd_qiov);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1554,6 +1683,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
+    s->cluster_cache_gen++;
 
     qemu_co_mutex_lock(&s->lock);
 
@@ -1571,6 +1701,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                 QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors - index_in_cluster;
         }
 
+        qcow2_prefetch_l2_slice(bs, sector_num << 9);
         ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
             &cur_nr_sectors, &cluster_offset, &l2meta);
         if (ret < 0) {
@@ -1685,8 +1816,17 @@ fail:
 static int qcow2_inactivate(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+    Error *local_err = NULL;
     int ret, result = 0;
 
+    if (!bs->read_only) {
+        ret = qcow2_store_persistent_dirty_bitmaps(bs, &local_err);
+        if (ret < 0) {
+            result = ret;
+            error_report_err(local_err);
+        }
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -1733,7 +1873,6 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->image_backing_format);
 
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1904,6 +2043,25 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Bitmaps extension */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                cpu_to_be64(s->bitmap_directory_offset)
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     if (s->qcow_version >= 3) {
         Qcow2Feature features[] = {
@@ -1922,6 +2080,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
                 .name = "lazy refcounts",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+                .name = "bitmaps",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -2487,13 +2650,14 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int
+qcow2_co_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                          const uint8_t *buf, int nb_sectors)
 {
     BDRVQcow2State *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
-    uint8_t *out_buf;
+    ssize_t out_len;
+    int ret;
+    uint8_t *pad_buf = NULL, *out_buf;
     uint64_t cluster_offset;
 
     if (nb_sectors == 0) {
@@ -2504,77 +2668,69 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
     }
 
     if (nb_sectors != s->cluster_sectors) {
-        ret = -EINVAL;
-
         /* Zero-pad last write if image size is not cluster aligned */
-        if (sector_num + nb_sectors == bs->total_sectors &&
-            nb_sectors < s->cluster_sectors) {
-            uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
-            memset(pad_buf, 0, s->cluster_size);
-            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
-            qemu_vfree(pad_buf);
+        if (sector_num + nb_sectors != bs->total_sectors ||
+            nb_sectors > s->cluster_sectors) {
+            return -EINVAL;
         }
-        return ret;
+        pad_buf = qemu_blockalign(bs, s->cluster_size);
+        memset(pad_buf, 0, s->cluster_size);
+        memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
+        buf = pad_buf;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    out_buf = g_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
+    /* Compression runs in a worker thread without s->lock, so several
+     * clusters can be compressed at once and complete in any order */
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    if (out_len == -ENOSPC) {
+        /* could not compress: write normal cluster */
+        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+        if (ret < 0) {
+            goto fail;
+        }
+        goto success;
+    } else if (out_len < 0) {
         ret = -EINVAL;
         goto fail;
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    qemu_co_mutex_lock(&s->lock);
+    s->cluster_cache_offset = -1; /* disable compressed cache */
+    s->cluster_cache_gen++;
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, out_len);
+    if (!cluster_offset) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = -EIO;
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
+    cluster_offset &= s->cluster_offset_mask;
 
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto fail;
+    }
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file->bs, cluster_offset, out_buf, out_len);
 
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file->bs, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    /* The L2 entry was visible before the data hit the disk, so a compressed
+     * read in flight may have picked up stale contents for this cluster */
+    s->cluster_cache_offset = -1;
+    s->cluster_cache_gen++;
+    if (ret < 0) {
+        goto fail;
     }
 
+success:
     ret = 0;
 fail:
+    qemu_vfree(pad_buf);
     g_free(out_buf);
     return ret;
 }
@@ -2602,6 +2758,19 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail;
     }
 
+    /* The stored bitmaps go away with everything else; the persistent bitmaps
+     * in memory are written out again on close */
+    if (s->nb_bitmaps) {
+        s->nb_bitmaps = 0;
+        s->bitmap_directory_offset = 0;
+        s->bitmap_directory_size = 0;
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     /* Refcounts will be broken utterly */
     ret = qcow2_mark_dirty(bs);
     if (ret < 0) {
@@ -2670,6 +2839,7 @@ static int make_completely_empty(BlockDriverState *bs)
     g_free(s->refcount_table);
     s->refcount_table = new_reftable;
     new_reftable = NULL;
+    qcow2_free_cluster_map_reset(bs);
 
     /* Now the in-memory refcount information again corresponds to the on-disk
      * information (reftable is empty and no refblocks (the refblock cache is
@@ -2836,6 +3006,26 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(const BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BlockStatsSpecificQCow2 *qcow2 = g_new0(BlockStatsSpecificQCow2, 1);
+
+    qcow2_cache_get_stats(s->l2_table_cache, &qcow2->l2_cache_hits,
+                          &qcow2->l2_cache_misses);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          &qcow2->refcount_cache_hits,
+                          &qcow2->refcount_cache_misses);
+
+    *stats = (BlockStatsSpecific){
+        .type  = BLOCK_STATS_SPECIFIC_KIND_QCOW2,
+        .u.qcow2.data = qcow2,
+    };
+
+    return stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2917,6 +3107,11 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->nb_bitmaps) {
+        error_report("compat=0.10 does not support persistent bitmaps");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -3336,7 +3531,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
     .bdrv_make_empty        = qcow2_make_empty,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
@@ -3346,6 +3541,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -3357,6 +3553,9 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
     .bdrv_inactivate            = qcow2_inactivate,
 
+    .bdrv_can_store_new_dirty_bitmap = qcow2_can_store_new_dirty_bitmap,
+    .bdrv_reopen_bitmaps_rw = qcow2_reopen_bitmaps_rw,
+
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
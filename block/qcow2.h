@@ -27,6 +27,7 @@
 
 #include "crypto/cipher.h"
 #include "qemu/coroutine.h"
+#include "qemu/hbitmap.h"
 
 //#define DEBUG_ALLOC
 //#define DEBUG_ALLOC2
@@ -38,6 +39,7 @@
 #define QCOW_CRYPT_AES  1
 
 #define QCOW_MAX_CRYPT_CLUSTERS 32
+
 #define QCOW_MAX_SNAPSHOTS 65536
 
 /* 8 MB refcount table is enough for 2 PB images at 64k cluster size
@@ -52,6 +54,11 @@
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
 
+/* Bitmaps extension limits, see docs/specs/qcow2.txt; as for snapshots, allow
+ * for an average of 1k per bitmap directory entry */
+#define QCOW2_MAX_BITMAPS 65535
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -63,7 +70,7 @@
 #define MAX_CLUSTER_BITS 21
 
 /* Must be at least 2 to cover COW */
-#define MIN_L2_CACHE_SIZE 2 /* clusters */
+#define MIN_L2_CACHE_SIZE 2 /* cache entries */
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
@@ -96,6 +103,7 @@
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
 
 typedef struct QCowHeader {
@@ -195,6 +203,14 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_BITMAPS       = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK          = QCOW2_AUTOCLEAR_BITMAPS,
+};
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -228,6 +244,7 @@ typedef struct BDRVQcow2State {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size; /* number of L2 entries per cache entry */
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -244,18 +261,27 @@ typedef struct BDRVQcow2State {
     unsigned cache_clean_interval;
 
     uint8_t *cluster_cache;
-    uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
+    /* Bumped whenever clusters may be reused, see qcow2_co_read_compressed */
+    uint64_t cluster_cache_gen;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
+    QLIST_HEAD(Qcow2L2Allocs, Qcow2L2Alloc) l2_allocs;
 
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
+    /* Clusters that may have a refcount of 0, built on first allocation;
+     * everything from free_cluster_map_size onwards may be free as well */
+    HBitmap *free_cluster_map;
+    uint64_t free_cluster_map_size;
 
     CoMutex lock;
 
+    CoQueue compress_wait_queue;
+    int nb_compress_threads;
+
     QCryptoCipher *cipher; /* current cipher, NULL if no key yet */
     uint32_t crypt_method_header;
     uint64_t snapshots_offset;
@@ -263,6 +289,11 @@ typedef struct BDRVQcow2State {
     unsigned int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    /* Bitmaps extension; only valid with QCOW2_AUTOCLEAR_BITMAPS set */
+    uint32_t nb_bitmaps;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -351,6 +382,20 @@ typedef struct QCowL2Meta
     QLIST_ENTRY(QCowL2Meta) next_in_flight;
 } QCowL2Meta;
 
+/**
+ * Describes an L2 table that is being written to a new cluster while s->lock
+ * is dropped. Its L1 entry is only updated when the table is on disk.
+ */
+typedef struct Qcow2L2Alloc {
+    /** Index of the L1 entry that will point to the new table */
+    uint64_t l1_index;
+
+    /** Requests that need the table and wait for it to be allocated */
+    CoQueue waiters;
+
+    QLIST_ENTRY(Qcow2L2Alloc) next;
+} Qcow2L2Alloc;
+
 enum {
     QCOW2_CLUSTER_UNALLOCATED,
     QCOW2_CLUSTER_NORMAL,
@@ -429,6 +474,11 @@ static inline int offset_to_l2_index(BDRVQcow2State *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -498,6 +548,7 @@ void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+void qcow2_free_cluster_map_reset(BlockDriverState *bs);
 
 int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
                        uint64_t *refcount);
@@ -519,6 +570,10 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
 
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size);
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix);
 
@@ -538,11 +593,16 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          int index_in_cluster, int nb_sectors,
+                                          QEMUIOVector *qiov);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *out_buf, const uint8_t *in_buf,
                           int nb_sectors, bool enc, Error **errp);
 
+void coroutine_fn qcow2_prefetch_l2_slice(BlockDriverState *bs,
+                                          uint64_t offset);
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
@@ -576,12 +636,32 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size);
+int qcow2_load_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                      uint32_t granularity, Error **errp);
+
+/* qcow2-threads.c functions */
+ssize_t coroutine_fn
+qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                  const void *src, size_t src_size);
+ssize_t coroutine_fn
+qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                    const void *src, size_t src_size);
+
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
 
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
      void *table);
+int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
@@ -595,5 +675,9 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+bool qcow2_cache_is_cached(Qcow2Cache *c, uint64_t offset);
+uint64_t qcow2_cache_get_generation(Qcow2Cache *c);
+int qcow2_cache_add(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+                    const void *table, uint64_t generation);
 
 #endif
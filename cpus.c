@@ -41,6 +41,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
+#include "sysemu/numa.h"
 #include "qapi-event.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
@@ -617,6 +618,27 @@ int cpu_throttle_get_percentage(void)
     return atomic_read(&throttle_percentage);
 }
 
+/* Only the softmmu notdirty write path knows which vCPU dirtied a page */
+bool cpu_dirty_rate_available(void)
+{
+    return tcg_enabled();
+}
+
+void cpu_update_dirty_rates(int64_t period_ms)
+{
+    CPUState *cpu;
+    uint64_t pages;
+
+    if (period_ms <= 0) {
+        return;
+    }
+    CPU_FOREACH(cpu) {
+        pages = atomic_read(&cpu->dirty_pages);
+        cpu->dirty_rate = (pages - cpu->dirty_pages_prev) * 1000 / period_ms;
+        cpu->dirty_pages_prev = pages;
+    }
+}
+
 void cpu_ticks_init(void)
 {
     seqlock_init(&timers_state.vm_clock_seqlock, NULL);
@@ -1631,6 +1653,10 @@ CpuInfoList *qmp_query_cpus(Error **errp)
         info->value->halted = cpu->halted;
         info->value->qom_path = object_get_canonical_path(OBJECT(cpu));
         info->value->thread_id = cpu->thread_id;
+        if (cpu->numa_bound) {
+            info->value->has_host_nodes = true;
+            info->value->host_nodes = numa_get_host_nodes(cpu->numa_node);
+        }
 #if defined(TARGET_I386)
         info->value->arch = CPU_INFO_ARCH_X86;
         info->value->u.x86.pc = env->eip + env->segs[R_CS].base;
@@ -1663,6 +1689,26 @@ CpuInfoList *qmp_query_cpus(Error **errp)
     return head;
 }
 
+VcpuDirtyRateList *qmp_query_vcpu_dirty_rate(Error **errp)
+{
+    VcpuDirtyRateList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyRateList *info = g_malloc0(sizeof(*info));
+
+        info->value = g_malloc0(sizeof(*info->value));
+        info->value->cpu_index = cpu->cpu_index;
+        info->value->has_dirty_rate = cpu_dirty_rate_available();
+        info->value->dirty_rate = cpu->dirty_rate;
+
+        *tail = info;
+        tail = &info->next;
+    }
+
+    return head;
+}
+
 void qmp_memsave(int64_t addr, int64_t size, const char *filename,
                  bool has_cpu, int64_t cpu_index, Error **errp)
 {
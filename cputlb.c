@@ -398,6 +398,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     /* refill the tlb */
     env->iotlb[mmu_idx][index].addr = iotlb - vaddr;
     env->iotlb[mmu_idx][index].attrs = attrs;
+    env->iotlb[mmu_idx][index].mr = iotlb_to_region(cpu, iotlb - vaddr, attrs);
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -1014,10 +1014,21 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
     while (page < end) {
         unsigned long idx = page / DIRTY_MEMORY_BLOCK_SIZE;
         unsigned long offset = page % DIRTY_MEMORY_BLOCK_SIZE;
-        unsigned long num = MIN(end - page, DIRTY_MEMORY_BLOCK_SIZE - offset);
+        unsigned long *block = atomic_rcu_read(&blocks->blocks[idx]);
+        unsigned long num;
 
-        dirty |= bitmap_test_and_clear_atomic(blocks->blocks[idx],
-                                              offset, num);
+        if (!block) {
+            /* Never dirtied, skip to the next block */
+            page += DIRTY_MEMORY_BLOCK_SIZE - offset;
+            continue;
+        }
+
+        num = MIN(end - page, DIRTY_MEMORY_SUMMARY_SIZE -
+                              offset % DIRTY_MEMORY_SUMMARY_SIZE);
+        if (dirty_memory_summary_test_and_clear(block, offset,
+                                                offset + num)) {
+            dirty |= bitmap_test_and_clear_atomic(block, offset, num);
+        }
         page += num;
     }
 
@@ -1531,6 +1542,33 @@ int qemu_ram_resize(ram_addr_t base, ram_addr_t newsize, Error **errp)
     return 0;
 }
 
+/* Protects installation of new dirty memory blocks */
+static QemuMutex dirty_memory_lock;
+
+/* Allocate block @idx of dirty memory client @client, or return the one that
+ * a concurrent caller installed.  Blocks are installed in the current
+ * DirtyMemoryBlocks array, which the caller's RCU-protected copy may no longer
+ * be.
+ */
+unsigned long *dirty_memory_block_alloc(unsigned client, unsigned long idx)
+{
+    DirtyMemoryBlocks *blocks;
+    unsigned long *block;
+
+    qemu_mutex_lock(&dirty_memory_lock);
+    blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
+    block = blocks->blocks[idx];
+    if (!block) {
+        block = g_new0(unsigned long,
+                       BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE) +
+                       BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE /
+                                     DIRTY_MEMORY_SUMMARY_SIZE));
+        atomic_rcu_set(&blocks->blocks[idx], block);
+    }
+    qemu_mutex_unlock(&dirty_memory_lock);
+    return block;
+}
+
 /* Called with ram_list.mutex held */
 static void dirty_memory_extend(ram_addr_t old_ram_size,
                                 ram_addr_t new_ram_size)
@@ -1546,6 +1584,7 @@ static void dirty_memory_extend(ram_addr_t old_ram_size,
         return;
     }
 
+    qemu_mutex_lock(&dirty_memory_lock);
     for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
         DirtyMemoryBlocks *old_blocks;
         DirtyMemoryBlocks *new_blocks;
@@ -1560,8 +1599,9 @@ static void dirty_memory_extend(ram_addr_t old_ram_size,
                    old_num_blocks * sizeof(old_blocks->blocks[0]));
         }
 
+        /* Allocated by dirty_memory_block_alloc() on first use */
         for (j = old_num_blocks; j < new_num_blocks; j++) {
-            new_blocks->blocks[j] = bitmap_new(DIRTY_MEMORY_BLOCK_SIZE);
+            new_blocks->blocks[j] = NULL;
         }
 
         atomic_rcu_set(&ram_list.dirty_memory[i], new_blocks);
@@ -1570,6 +1610,47 @@ static void dirty_memory_extend(ram_addr_t old_ram_size,
             g_free_rcu(old_blocks, rcu);
         }
     }
+    qemu_mutex_unlock(&dirty_memory_lock);
+}
+
+/* Mark the range of a new RAMBlock dirty for all clients.  Blocks of the
+ * clients in @alloc_mask are allocated as usual; for the others only blocks
+ * that already exist are touched, since they may still hold bits of a
+ * RAMBlock that used the same ram_addr range before.  Blocks that were never
+ * allocated stay clean: migration marks new RAM in its own bitmap and display
+ * devices redraw on their first update anyway.
+ */
+static void ram_block_set_dirty(ram_addr_t start, ram_addr_t length,
+                                uint8_t alloc_mask)
+{
+    unsigned long end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    unsigned long first = start >> TARGET_PAGE_BITS;
+    int i;
+
+    rcu_read_lock();
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        DirtyMemoryBlocks *blocks = atomic_rcu_read(&ram_list.dirty_memory[i]);
+        unsigned long page = first;
+
+        while (page < end) {
+            unsigned long idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+            unsigned long offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+            unsigned long next = MIN(end, page - offset +
+                                          DIRTY_MEMORY_BLOCK_SIZE);
+            unsigned long *block = atomic_rcu_read(&blocks->blocks[idx]);
+
+            if (!block && (alloc_mask & (1 << i))) {
+                block = dirty_memory_block_alloc(i, idx);
+            }
+            if (block) {
+                dirty_memory_block_set(block, offset, next - page);
+            }
+            page = next;
+        }
+    }
+    rcu_read_unlock();
+
+    xen_modified_memory(start, length);
 }
 
 static void ram_block_add(RAMBlock *new_block, Error **errp)
@@ -1637,9 +1718,11 @@ static void ram_block_add(RAMBlock *new_block, Error **errp)
     ram_list.version++;
     qemu_mutex_unlock_ramlist();
 
-    cpu_physical_memory_set_dirty_range(new_block->offset,
-                                        new_block->used_length,
-                                        DIRTY_CLIENTS_ALL);
+    /* TCG only takes the fast write path for pages whose DIRTY_MEMORY_CODE
+     * bit is set, and nothing sets it for pages that never held code.
+     */
+    ram_block_set_dirty(new_block->offset, new_block->used_length,
+                        tcg_enabled() ? 1 << DIRTY_MEMORY_CODE : 0);
 
     if (new_block->host) {
         qemu_ram_setup_dump(new_block->host, new_block->max_length);
@@ -1834,6 +1917,24 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/* Apply the madvise() settings that ram_block_add() gives new guest RAM to
+ * @length bytes at @offset of @block, after they were replaced by a new
+ * mapping.
+ */
+void qemu_ram_block_advise(RAMBlock *block, ram_addr_t offset,
+                           ram_addr_t length)
+{
+    void *addr = ramblock_ptr(block, offset);
+
+    memory_try_enable_merging(addr, length);
+    qemu_ram_setup_dump(addr, length);
+    qemu_madvise(addr, length, QEMU_MADV_HUGEPAGE);
+    qemu_madvise(addr, length, QEMU_MADV_DONTFORK);
+    if (kvm_enabled()) {
+        kvm_setup_guest_memory(addr, length);
+    }
+}
 #endif /* !_WIN32 */
 
 int qemu_get_ram_fd(ram_addr_t addr)
@@ -2054,6 +2155,11 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     default:
         abort();
     }
+    /* Account the page to the vCPU that dirtied it, for auto-converge */
+    if (current_cpu &&
+        !cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION)) {
+        atomic_inc(&current_cpu->dirty_pages);
+    }
     /* Set both VGA and migration bits for simplicity and to remove
      * the notdirty callback faster.
      */
@@ -2411,8 +2517,20 @@ static void tcg_commit(MemoryListener *listener)
     tlb_flush(cpuas->cpu, 1);
 }
 
+/* Enough for a single page, like the global bounce buffer used to be */
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE TARGET_PAGE_SIZE
+
 void address_space_init_dispatch(AddressSpace *as)
 {
+    qemu_mutex_init(&as->bounce_lock);
+    QLIST_INIT(&as->bounce_buffers);
+    QLIST_INIT(&as->map_client_list);
+    as->bounce_buffer_size = 0;
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_peak = 0;
+    as->bounce_buffer_maps = 0;
+    as->bounce_buffer_failures = 0;
+
     as->dispatch = NULL;
     as->dispatch_listener = (MemoryListener) {
         .begin = mem_begin,
@@ -2433,6 +2551,10 @@ void address_space_destroy_dispatch(AddressSpace *as)
 {
     AddressSpaceDispatch *d = as->dispatch;
 
+    assert(QLIST_EMPTY(&as->bounce_buffers));
+    assert(QLIST_EMPTY(&as->map_client_list));
+    qemu_mutex_destroy(&as->bounce_lock);
+
     atomic_rcu_set(&as->dispatch, NULL);
     if (d) {
         call_rcu(d, address_space_dispatch_free, rcu);
@@ -2843,82 +2965,144 @@ void cpu_flush_icache_range(hwaddr start, int len)
                                            start, NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+struct BounceBuffer {
     MemoryRegion *mr;
-    void *buffer;
     hwaddr addr;
-    hwaddr len;
-    bool in_use;
-} BounceBuffer;
-
-static BounceBuffer bounce;
+    size_t len;
+    QLIST_ENTRY(BounceBuffer) link;
+    void *buffer;
+};
 
-typedef struct MapClient {
+struct MapClient {
     QEMUBH *bh;
     QLIST_ENTRY(MapClient) link;
-} MapClient;
-
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
+};
 
-static void cpu_unregister_map_client_do(MapClient *client)
+static void address_space_unregister_map_client_do(MapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
     MapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        client = QLIST_FIRST(&as->map_client_list);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
     MapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->bounce_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_client_list, client, link);
+    /* Retry right away if there is still room in the bounce buffer pool */
+    if (as->bounce_buffer_size < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
+    }
+    qemu_mutex_unlock(&as->bounce_lock);
+}
+
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
+{
+    MapClient *client;
+
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(client, &as->map_client_list, link) {
+        if (client->bh == bh) {
+            address_space_unregister_map_client_do(client);
+            break;
+        }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
+}
+
+void cpu_register_map_client(QEMUBH *bh)
+{
+    address_space_register_map_client(&address_space_memory, bh);
+}
+
+void cpu_unregister_map_client(QEMUBH *bh)
+{
+    address_space_unregister_map_client(&address_space_memory, bh);
+}
+
+void address_space_set_max_bounce_buffer_size(AddressSpace *as, size_t size)
+{
+    qemu_mutex_lock(&as->bounce_lock);
+    as->max_bounce_buffer_size = size ? size : DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
 void cpu_exec_init_all(void)
 {
     qemu_mutex_init(&ram_list.mutex);
+    qemu_mutex_init(&dirty_memory_lock);
     io_mem_init();
     memory_map_init();
-    qemu_mutex_init(&map_client_list_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+/* Reserve up to @len bytes from the bounce buffer budget of @as and return
+ * a buffer of that size, or NULL if the budget is exhausted.
+ */
+static BounceBuffer *address_space_bounce_alloc(AddressSpace *as, hwaddr len)
+{
+    BounceBuffer *bounce;
+    size_t avail;
+
+    qemu_mutex_lock(&as->bounce_lock);
+    avail = as->max_bounce_buffer_size - MIN(as->bounce_buffer_size,
+                                             as->max_bounce_buffer_size);
+    len = MIN(len, avail);
+    if (!len) {
+        as->bounce_buffer_failures++;
+        qemu_mutex_unlock(&as->bounce_lock);
+        trace_address_space_map_bounce_full(as, as->bounce_buffer_size);
+        return NULL;
+    }
+
+    bounce = g_new(BounceBuffer, 1);
+    bounce->buffer = qemu_memalign(TARGET_PAGE_SIZE, len);
+    bounce->len = len;
+    QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+    as->bounce_buffer_size += len;
+    as->bounce_buffer_peak = MAX(as->bounce_buffer_peak,
+                                 as->bounce_buffer_size);
+    as->bounce_buffer_maps++;
+    qemu_mutex_unlock(&as->bounce_lock);
+    return bounce;
+}
+
+static BounceBuffer *address_space_bounce_find(AddressSpace *as, void *buffer)
 {
-    MapClient *client;
+    BounceBuffer *bounce;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
-        if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+        if (bounce->buffer == buffer) {
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
+    return bounce;
 }
 
-static void cpu_notify_map_clients(void)
+static void address_space_bounce_free(AddressSpace *as, BounceBuffer *bounce)
 {
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_REMOVE(bounce, link);
+    assert(as->bounce_buffer_size >= bounce->len);
+    as->bounce_buffer_size -= bounce->len;
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->bounce_lock);
+    qemu_vfree(bounce->buffer);
+    g_free(bounce);
 }
 
 bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_write)
@@ -2948,8 +3132,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -2972,26 +3156,25 @@ void *address_space_map(AddressSpace *as,
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
+        BounceBuffer *bounce = address_space_bounce_alloc(as, l);
+
+        if (!bounce) {
             rcu_read_unlock();
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        l = bounce->len;
+        bounce->addr = addr;
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
         if (!is_write) {
             address_space_read(as, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                               bounce->buffer, l);
         }
 
         rcu_read_unlock();
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
     base = xlat;
@@ -3027,7 +3210,12 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bounce = NULL;
+
+    if (atomic_read(&as->bounce_buffer_size)) {
+        bounce = address_space_bounce_find(as, buffer);
+    }
+    if (!bounce) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -3043,14 +3231,11 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
-    }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
+    }
+    memory_region_unref(bounce->mr);
+    address_space_bounce_free(as, bounce);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -231,6 +231,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
+        monitor_printf(mon, "xbzrle cache hit rate: %0.2f\n",
+                       info->xbzrle_cache->cache_hit_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
@@ -240,6 +242,46 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->x_cpu_throttle_percentage);
     }
 
+    if (info->has_device_downtime) {
+        DeviceDowntimeList *item;
+        DeviceDowntime *slowest = NULL;
+        uint64_t total = 0;
+        int n = 0;
+
+        for (item = info->device_downtime; item; item = item->next, n++) {
+            total += item->value->time;
+            if (!slowest || item->value->time > slowest->time) {
+                slowest = item->value;
+            }
+        }
+        monitor_printf(mon, "device downtime: %d sections, %" PRIu64
+                       " us in total, slowest %s/%" PRId64 " %" PRId64 " us\n",
+                       n, total, slowest->name, slowest->instance_id,
+                       slowest->time);
+    }
+
+    if (info->has_postcopy_faults) {
+        intList *item;
+        int i = 0;
+
+        monitor_printf(mon, "postcopy faults: %" PRIu64 " (%" PRIu64
+                       " pending)\n", info->postcopy_faults->requests,
+                       info->postcopy_faults->pending);
+        monitor_printf(mon, "postcopy fault latency: avg %" PRIu64
+                       " us, max %" PRIu64 " us\n",
+                       info->postcopy_faults->latency_avg,
+                       info->postcopy_faults->latency_max);
+        monitor_printf(mon, "postcopy fault latency histogram (us):");
+        for (item = info->postcopy_faults->histogram; item;
+             item = item->next, i++) {
+            if (item->value) {
+                monitor_printf(mon, " %" PRIu64 "+:%" PRId64,
+                               (uint64_t)1 << i, item->value);
+            }
+        }
+        monitor_printf(mon, "\n");
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -286,6 +328,12 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT],
             params->x_cpu_throttle_increment);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_BLOCK_QUEUE_DEPTH],
+            params->x_block_queue_depth);
         monitor_printf(mon, "\n");
     }
 
@@ -1242,6 +1290,8 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
     bool has_decompress_threads = false;
     bool has_x_cpu_throttle_initial = false;
     bool has_x_cpu_throttle_increment = false;
+    bool has_x_multifd_channels = false;
+    bool has_x_block_queue_depth = false;
     int i;
 
     for (i = 0; i < MIGRATION_PARAMETER__MAX; i++) {
@@ -1262,12 +1312,20 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT:
                 has_x_cpu_throttle_increment = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                break;
+            case MIGRATION_PARAMETER_X_BLOCK_QUEUE_DEPTH:
+                has_x_block_queue_depth = true;
+                break;
             }
             qmp_migrate_set_parameters(has_compress_level, value,
                                        has_compress_threads, value,
                                        has_decompress_threads, value,
                                        has_x_cpu_throttle_initial, value,
                                        has_x_cpu_throttle_increment, value,
+                                       has_x_multifd_channels, value,
+                                       has_x_block_queue_depth, value,
                                        &err);
             break;
         }
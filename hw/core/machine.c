@@ -242,6 +242,20 @@ static void machine_set_mem_merge(Object *obj, bool value, Error **errp)
     ms->mem_merge = value;
 }
 
+static bool machine_get_numa_affinity(Object *obj, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    return ms->numa_affinity;
+}
+
+static void machine_set_numa_affinity(Object *obj, bool value, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    ms->numa_affinity = value;
+}
+
 static bool machine_get_usb(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -454,6 +468,13 @@ static void machine_initfn(Object *obj)
     object_property_set_description(obj, "mem-merge",
                                     "Enable/disable memory merge support",
                                     NULL);
+    object_property_add_bool(obj, "numa-affinity",
+                             machine_get_numa_affinity,
+                             machine_set_numa_affinity, NULL);
+    object_property_set_description(obj, "numa-affinity",
+                                    "Pin vCPU and IOThread threads to the host "
+                                    "nodes backing their guest NUMA node",
+                                    NULL);
     object_property_add_bool(obj, "usb",
                              machine_get_usb,
                              machine_set_usb, NULL);
@@ -550,6 +571,11 @@ bool machine_mem_merge(MachineState *machine)
     return machine->mem_merge;
 }
 
+bool machine_numa_affinity(MachineState *machine)
+{
+    return machine->numa_affinity;
+}
+
 static const TypeInfo machine_info = {
     .name = TYPE_MACHINE,
     .parent = TYPE_OBJECT,
@@ -217,6 +217,8 @@ static const VMStateDescription vmstate_spapr_tce_table = {
     .pre_save = spapr_tce_table_pre_save,
     .pre_load = spapr_tce_table_pre_load,
     .post_load = spapr_tce_table_post_load,
+    /* The table is loaded into migtable, away from the live table */
+    .parallel = true,
     .fields      = (VMStateField []) {
         /* Sanity check */
         VMSTATE_UINT32_EQUAL(liobn, sPAPRTCETable),
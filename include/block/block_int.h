@@ -209,6 +209,19 @@ struct BlockDriver {
 
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors);
+
+    /* Checks whether a new persistent bitmap could be stored in the image;
+     * the driver stores its persistent bitmaps on close and inactivation */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+    /* Called after a reopen from read-only to read/write has been committed,
+     * so that the driver can load its persistent bitmaps and take ownership
+     * of them in the image */
+    int (*bdrv_reopen_bitmaps_rw)(BlockDriverState *bs, Error **errp);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -226,6 +239,7 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(const BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -126,6 +126,11 @@ QEMU_BUILD_BUG_ON(sizeof(CPUTLBEntry) != (1 << CPU_TLB_ENTRY_BITS));
 typedef struct CPUIOTLBEntry {
     hwaddr addr;
     MemTxAttrs attrs;
+    /* iotlb_to_region() of addr, resolved when the entry is filled.  It
+     * stays valid until the next TLB flush, which every change to the
+     * CPU's dispatch tree triggers.
+     */
+    MemoryRegion *mr;
 } CPUIOTLBEntry;
 
 #define CPU_COMMON_TLB \
@@ -174,6 +174,7 @@ struct MemoryRegion {
     bool flush_coalesced_mmio;
     bool global_locking;
     uint8_t dirty_log_mask;
+    uint8_t fast_access_sizes; /* Sizes dispatched straight to ops->read/write */
     RAMBlock *ram_block;
     Object *owner;
     const MemoryRegionIOMMUOps *iommu_ops;
@@ -201,6 +202,11 @@ struct MemoryRegion {
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
     NotifierList iommu_notify;
+
+    /* Topology change tracking, see memory_region_transaction_commit() */
+    uint64_t topology_gen;
+    uint64_t topology_checked_gen;
+    bool topology_changed;
 };
 
 /**
@@ -236,6 +242,9 @@ struct MemoryListener {
     QTAILQ_ENTRY(MemoryListener) link;
 };
 
+typedef struct BounceBuffer BounceBuffer;
+typedef struct MapClient MapClient;
+
 /**
  * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
@@ -255,6 +264,20 @@ struct AddressSpace {
     struct AddressSpaceDispatch *dispatch;
     struct AddressSpaceDispatch *next_dispatch;
     MemoryListener dispatch_listener;
+    bool update_pending;
+
+    /* Bounce buffers handed out by address_space_map(), protected by
+     * bounce_lock.  bounce_buffer_size is the number of bytes currently
+     * allocated and never exceeds max_bounce_buffer_size.
+     */
+    QemuMutex bounce_lock;
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    QLIST_HEAD(, MapClient) map_client_list;
+    size_t bounce_buffer_size;
+    size_t max_bounce_buffer_size;
+    size_t bounce_buffer_peak;
+    uint64_t bounce_buffer_maps;
+    uint64_t bounce_buffer_failures;
 
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
 };
@@ -1362,8 +1385,12 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
+ *
+ * Regions that are not directly accessible RAM are mapped through bounce
+ * buffers, which are allocated from a per-address space budget of
+ * max_bounce_buffer_size bytes.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -1387,6 +1414,36 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* address_space_register_map_client: request a notification when bounce
+ * buffers are released
+ *
+ * @bh is scheduled once, as soon as a bounce buffer of @as is freed (or
+ * immediately, if none is in use).
+ *
+ * @as: #AddressSpace whose address_space_map() failed
+ * @bh: bottom half to schedule
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: cancel a notification requested
+ * with address_space_register_map_client()
+ *
+ * @as: #AddressSpace passed to address_space_register_map_client()
+ * @bh: bottom half passed to address_space_register_map_client()
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_set_max_bounce_buffer_size: limit the bounce buffer pool
+ *
+ * Set the maximum number of bytes that address_space_map() may allocate
+ * for bounce buffers at any given time for @as.  Buffers that are already
+ * mapped are not affected.
+ *
+ * @as: #AddressSpace to be configured
+ * @size: new limit in bytes, or 0 for the default of one target page
+ */
+void address_space_set_max_bounce_buffer_size(AddressSpace *as, size_t size);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
@@ -36,6 +36,8 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    /* File offset of this block's pages when migrating with mapped RAM */
+    uint64_t pages_offset;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -58,7 +60,7 @@ static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
  *       atomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
  *
  *   ram_addr_t idx = (addr >> TARGET_PAGE_BITS) / DIRTY_MEMORY_BLOCK_SIZE;
- *   unsigned long *block = blocks.blocks[idx];
+ *   unsigned long *block = atomic_rcu_read(&blocks->blocks[idx]);
  *   ...access block bitmap...
  *
  *   rcu_read_unlock();
@@ -73,13 +75,100 @@ static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
  * memory is being grown.  When no threads are using the old DirtyMemoryBlocks
  * anymore it is freed by RCU (but the underlying blocks stay because they are
  * pointed to from the new DirtyMemoryBlocks).
+ *
+ * Blocks are allocated lazily, the first time one of their pages is marked
+ * dirty; a NULL block has no dirty pages.  Use dirty_memory_block() to get
+ * a block for writing.
+ *
+ * Each block bitmap is followed by a summary bitmap with one bit for every
+ * DIRTY_MEMORY_SUMMARY_SIZE pages.  Writers set the summary bit after the
+ * page bits, and readers clear it before they collect the page bits, so a
+ * clear summary bit means that the whole range can be skipped.
  */
 #define DIRTY_MEMORY_BLOCK_SIZE ((ram_addr_t)256 * 1024 * 8)
+#define DIRTY_MEMORY_SUMMARY_SIZE ((ram_addr_t)64 * BITS_PER_LONG)
 typedef struct {
     struct rcu_head rcu;
     unsigned long *blocks[];
 } DirtyMemoryBlocks;
 
+unsigned long *dirty_memory_block_alloc(unsigned client, unsigned long idx);
+
+static inline unsigned long *dirty_memory_summary(unsigned long *block)
+{
+    return block + BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE);
+}
+
+/* Return block @idx of @client for writing, allocating it if needed */
+static inline unsigned long *dirty_memory_block(DirtyMemoryBlocks *blocks,
+                                                unsigned client,
+                                                unsigned long idx)
+{
+    unsigned long *block = atomic_rcu_read(&blocks->blocks[idx]);
+
+    if (unlikely(!block)) {
+        block = dirty_memory_block_alloc(client, idx);
+    }
+    return block;
+}
+
+static inline void dirty_memory_summary_set(unsigned long *block,
+                                            unsigned long offset,
+                                            unsigned long num)
+{
+    unsigned long *summary = dirty_memory_summary(block);
+    unsigned long first = offset / DIRTY_MEMORY_SUMMARY_SIZE;
+    unsigned long last = (offset + num - 1) / DIRTY_MEMORY_SUMMARY_SIZE;
+
+    /* The page bits were set with a full barrier, so the summary bit can
+     * be tested without an atomic operation.
+     */
+    if (first == last && test_bit(first, summary)) {
+        return;
+    }
+    bitmap_set_atomic(summary, first, last - first + 1);
+}
+
+/* Mark pages [offset, offset + num) of a block as dirty */
+static inline void dirty_memory_block_set(unsigned long *block,
+                                          unsigned long offset,
+                                          unsigned long num)
+{
+    bitmap_set_atomic(block, offset, num);
+    dirty_memory_summary_set(block, offset, num);
+}
+
+/* OR @bits into word @word of a block */
+static inline void dirty_memory_block_or(unsigned long *block,
+                                         unsigned long word,
+                                         unsigned long bits)
+{
+    atomic_or(&block[word], bits);
+    dirty_memory_summary_set(block, word * BITS_PER_LONG, BITS_PER_LONG);
+}
+
+/* Clear the summary bit covering page @offset of a block if the range
+ * [offset, end) covers it completely.  Returns false if the summary bit
+ * is clear, meaning no page in its range is dirty.
+ */
+static inline bool dirty_memory_summary_test_and_clear(unsigned long *block,
+                                                       unsigned long offset,
+                                                       unsigned long end)
+{
+    unsigned long *summary = dirty_memory_summary(block);
+    unsigned long s = offset / DIRTY_MEMORY_SUMMARY_SIZE;
+
+    if (!test_bit(s, summary)) {
+        return false;
+    }
+    if (offset % DIRTY_MEMORY_SUMMARY_SIZE == 0 &&
+        end - offset >= DIRTY_MEMORY_SUMMARY_SIZE) {
+        /* Full barrier, pairs with dirty_memory_summary_set() */
+        atomic_and(&summary[BIT_WORD(s)], ~BIT_MASK(s));
+    }
+    return true;
+}
+
 typedef struct RAMList {
     QemuMutex mutex;
     RAMBlock *mru_block;
@@ -111,6 +200,8 @@ void *qemu_get_ram_block_host_ptr(ram_addr_t addr);
 void qemu_ram_free(RAMBlock *block);
 
 int qemu_ram_resize(ram_addr_t base, ram_addr_t newsize, Error **errp);
+void qemu_ram_block_advise(RAMBlock *block, ram_addr_t offset,
+                           ram_addr_t length);
 
 #define DIRTY_CLIENTS_ALL     ((1 << DIRTY_MEMORY_NUM) - 1)
 #define DIRTY_CLIENTS_NOCODE  (DIRTY_CLIENTS_ALL & ~(1 << DIRTY_MEMORY_CODE))
@@ -139,8 +230,9 @@ static inline bool cpu_physical_memory_get_dirty(ram_addr_t start,
     while (page < end) {
         unsigned long next = MIN(end, base + DIRTY_MEMORY_BLOCK_SIZE);
         unsigned long num = next - base;
-        unsigned long found = find_next_bit(blocks->blocks[idx], num, offset);
-        if (found < num) {
+        unsigned long *block = atomic_rcu_read(&blocks->blocks[idx]);
+
+        if (block && find_next_bit(block, num, offset) < num) {
             dirty = true;
             break;
         }
@@ -180,8 +272,9 @@ static inline bool cpu_physical_memory_all_dirty(ram_addr_t start,
     while (page < end) {
         unsigned long next = MIN(end, base + DIRTY_MEMORY_BLOCK_SIZE);
         unsigned long num = next - base;
-        unsigned long found = find_next_zero_bit(blocks->blocks[idx], num, offset);
-        if (found < num) {
+        unsigned long *block = atomic_rcu_read(&blocks->blocks[idx]);
+
+        if (!block || find_next_zero_bit(block, num, offset) < num) {
             dirty = false;
             break;
         }
@@ -249,7 +342,7 @@ static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
 
     blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
 
-    set_bit_atomic(offset, blocks->blocks[idx]);
+    dirty_memory_block_set(dirty_memory_block(blocks, client, idx), offset, 1);
 
     rcu_read_unlock();
 }
@@ -283,16 +376,22 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
         unsigned long next = MIN(end, base + DIRTY_MEMORY_BLOCK_SIZE);
 
         if (likely(mask & (1 << DIRTY_MEMORY_MIGRATION))) {
-            bitmap_set_atomic(blocks[DIRTY_MEMORY_MIGRATION]->blocks[idx],
-                              offset, next - page);
+            dirty_memory_block_set(
+                dirty_memory_block(blocks[DIRTY_MEMORY_MIGRATION],
+                                   DIRTY_MEMORY_MIGRATION, idx),
+                offset, next - page);
         }
         if (unlikely(mask & (1 << DIRTY_MEMORY_VGA))) {
-            bitmap_set_atomic(blocks[DIRTY_MEMORY_VGA]->blocks[idx],
-                              offset, next - page);
+            dirty_memory_block_set(
+                dirty_memory_block(blocks[DIRTY_MEMORY_VGA],
+                                   DIRTY_MEMORY_VGA, idx),
+                offset, next - page);
         }
         if (unlikely(mask & (1 << DIRTY_MEMORY_CODE))) {
-            bitmap_set_atomic(blocks[DIRTY_MEMORY_CODE]->blocks[idx],
-                              offset, next - page);
+            dirty_memory_block_set(
+                dirty_memory_block(blocks[DIRTY_MEMORY_CODE],
+                                   DIRTY_MEMORY_CODE, idx),
+                offset, next - page);
         }
 
         page = next;
@@ -322,7 +421,7 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
     /* start address is aligned at the start of a word? */
     if ((((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) &&
         (hpratio == 1)) {
-        unsigned long **blocks[DIRTY_MEMORY_NUM];
+        DirtyMemoryBlocks *blocks[DIRTY_MEMORY_NUM];
         unsigned long idx;
         unsigned long offset;
         long k;
@@ -335,17 +434,26 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
         rcu_read_lock();
 
         for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
-            blocks[i] = atomic_rcu_read(&ram_list.dirty_memory[i])->blocks;
+            blocks[i] = atomic_rcu_read(&ram_list.dirty_memory[i]);
         }
 
         for (k = 0; k < nr; k++) {
             if (bitmap[k]) {
                 unsigned long temp = leul_to_cpu(bitmap[k]);
 
-                atomic_or(&blocks[DIRTY_MEMORY_MIGRATION][idx][offset], temp);
-                atomic_or(&blocks[DIRTY_MEMORY_VGA][idx][offset], temp);
+                dirty_memory_block_or(
+                    dirty_memory_block(blocks[DIRTY_MEMORY_MIGRATION],
+                                       DIRTY_MEMORY_MIGRATION, idx),
+                    offset, temp);
+                dirty_memory_block_or(
+                    dirty_memory_block(blocks[DIRTY_MEMORY_VGA],
+                                       DIRTY_MEMORY_VGA, idx),
+                    offset, temp);
                 if (tcg_enabled()) {
-                    atomic_or(&blocks[DIRTY_MEMORY_CODE][idx][offset], temp);
+                    dirty_memory_block_or(
+                        dirty_memory_block(blocks[DIRTY_MEMORY_CODE],
+                                           DIRTY_MEMORY_CODE, idx),
+                        offset, temp);
                 }
             }
 
@@ -406,29 +514,46 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
 
     /* start address is aligned at the start of a word? */
     if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long * const *src;
+        unsigned long k;
+        unsigned long nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+        DirtyMemoryBlocks *blocks;
         unsigned long idx = (page * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
         unsigned long offset = BIT_WORD((page * BITS_PER_LONG) %
                                         DIRTY_MEMORY_BLOCK_SIZE);
+        const unsigned long summary_longs =
+            BITS_TO_LONGS(DIRTY_MEMORY_SUMMARY_SIZE);
 
         rcu_read_lock();
 
-        src = atomic_rcu_read(
-                &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
-
-        for (k = page; k < page + nr; k++) {
-            if (src[idx][offset]) {
-                unsigned long bits = atomic_xchg(&src[idx][offset], 0);
-                unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
-                new_dirty &= bits;
-                num_dirty += ctpopl(new_dirty);
+        blocks = atomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
+
+        k = page;
+        while (k < page + nr) {
+            unsigned long *block = atomic_rcu_read(&blocks->blocks[idx]);
+            /* Words left in this summary range and in the requested range */
+            unsigned long n = MIN(summary_longs - offset % summary_longs,
+                                  page + nr - k);
+            unsigned long i;
+
+            if (block &&
+                dirty_memory_summary_test_and_clear(
+                    block, offset * BITS_PER_LONG,
+                    (offset + n) * BITS_PER_LONG)) {
+                for (i = 0; i < n; i++) {
+                    if (block[offset + i]) {
+                        unsigned long bits = atomic_xchg(&block[offset + i], 0);
+                        unsigned long new_dirty;
+                        new_dirty = ~dest[k + i];
+                        dest[k + i] |= bits;
+                        new_dirty &= bits;
+                        num_dirty += ctpopl(new_dirty);
+                    }
+                }
             }
 
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+            k += n;
+            offset += n;
+            if (offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
                 offset = 0;
                 idx++;
             }
@@ -307,6 +307,9 @@ struct PCIDevice {
     MemoryRegion rom;
     uint32_t rom_bar;
 
+    /* Bounce buffer budget of bus_master_as */
+    uint64_t max_bounce_buffer_size;
+
     /* INTx routing notifier */
     PCIINTxRoutingNotifier intx_routing_notifier;
 
@@ -35,6 +35,7 @@
 #define QEMU_VM_VMDESCRIPTION        0x06
 #define QEMU_VM_CONFIGURATION        0x07
 #define QEMU_VM_COMMAND              0x08
+#define QEMU_VM_SECTION_SIZED        0x09
 #define QEMU_VM_SECTION_FOOTER       0x7e
 
 struct MigrationParams {
@@ -171,6 +172,26 @@ struct MigrationState
     QSIMPLEQ_HEAD(src_page_requests, MigrationSrcPageRequest) src_page_requests;
     /* The RAMBlock used in the last src_page_request */
     RAMBlock *last_req_rb;
+    /* Range of the last src_page_request, used to detect locality */
+    ram_addr_t last_req_start;
+    ram_addr_t last_req_len;
+    /*
+     * Pages queued around local requests; served after src_page_requests
+     * but before the background scan.  prefetch_lo/hi bound what has been
+     * queued since the last non-local request.
+     */
+    struct src_page_requests src_page_prefetch;
+    ram_addr_t prefetch_window;
+    ram_addr_t prefetch_lo;
+    ram_addr_t prefetch_hi;
+    /* Posted on page requests so they need not wait for the rate limit,
+     * but only while rate_limit_waiting is set
+     */
+    QemuSemaphore rate_limit_sem;
+    bool rate_limit_waiting;
+
+    /* URI passed to the migrate command, used to open multifd channels */
+    char *uri;
 };
 
 void migrate_set_state(int *state, int old_state, int new_state);
@@ -197,6 +218,10 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -242,6 +267,7 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+double xbzrle_mig_cache_hit_rate(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected);
@@ -268,11 +294,14 @@ void migrate_del_blocker(Error *reason);
 
 bool migrate_postcopy_ram(void);
 bool migrate_zero_blocks(void);
+bool migrate_block_zero_extents(void);
 
 bool migrate_auto_converge(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
+int xbzrle_encode_buffer_generic(uint8_t *old_buf, uint8_t *new_buf,
+                                 int slen, uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 
 int migrate_use_xbzrle(void);
@@ -285,6 +314,16 @@ int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
+bool migrate_use_mapped_ram(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+int migrate_block_queue_depth(void);
+bool migrate_use_zerocopy_send(void);
+bool migrate_use_parallel_device_state(void);
+bool migrate_use_background_snapshot(void);
+
+void multifd_load_start(int listen_fd, QEMUFile *f);
+void multifd_load_cleanup(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_message(MigrationIncomingState *mis,
@@ -326,6 +365,12 @@ void global_state_store_running(void);
 void flush_page_queue(MigrationState *ms);
 int ram_save_queue_pages(MigrationState *ms, const char *rbname,
                          ram_addr_t start, ram_addr_t len);
+bool ram_save_has_page_requests(MigrationState *ms);
+
+/* Write protection of guest RAM for background snapshots */
+bool ram_write_tracking_available(void);
+int ram_write_tracking_start(MigrationState *ms);
+void ram_write_tracking_stop(void);
 
 PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
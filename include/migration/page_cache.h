@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, indexed by a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -60,7 +60,10 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten.
+ * If the page is not cached yet, it replaces the page of its set that
+ * was least often found in the cache recently; pages cached or hit in
+ * the last two generations are never replaced.
  *
  * Returns -1 when the page isn't inserted into cache
  *
@@ -73,8 +76,8 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
 /**
- * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * cache_resize: resize the page cache, keeping its content. In case of
+ * size reduction the pages with the lowest priority will be freed
  *
  * Returns -1 on error new cache size on success
  *
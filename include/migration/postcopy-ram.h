@@ -96,4 +96,10 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host);
  */
 void *postcopy_get_tmp_page(MigrationIncomingState *mis);
 
+/*
+ * Latency of the page faults taken on the destination since postcopy was
+ * last entered, or NULL if there were none.
+ */
+PostcopyFaultInfo *postcopy_fault_info(void);
+
 #endif
@@ -92,6 +92,25 @@ typedef size_t (QEMURamSaveFunc)(QEMUFile *f, void *opaque,
  */
 typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
 
+/*
+ * Prepare the transport for writev_zerocopy.
+ * Returns 0 on success, -err if zero-copy sends are not available
+ */
+typedef int (QEMUFileEnableZerocopyFunc)(void *opaque);
+
+/*
+ * Returns a mark for the writev_zerocopy calls made so far, to be passed
+ * to QEMUFileWaitZerocopyFunc.
+ */
+typedef uint32_t (QEMUFileMarkZerocopyFunc)(void *opaque);
+
+/*
+ * Wait until the transport no longer references the buffers passed
+ * to writev_zerocopy before @mark was taken.
+ * Returns 0 on success, -err on error
+ */
+typedef int (QEMUFileWaitZerocopyFunc)(void *opaque, uint32_t mark);
+
 /*
  * Stop any read or write (depending on flags) on the underlying
  * transport on the QEMUFile.
@@ -112,6 +131,11 @@ typedef struct QEMUFileOps {
     QEMURamSaveFunc *save_page;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    /* Like writev_buffer, but the data may be read after it returns */
+    QEMUFileEnableZerocopyFunc *enable_zerocopy;
+    QEMUFileWritevBufferFunc *writev_zerocopy;
+    QEMUFileMarkZerocopyFunc *mark_zerocopy;
+    QEMUFileWaitZerocopyFunc *wait_zerocopy;
 } QEMUFileOps;
 
 struct QEMUSizedBuffer {
@@ -155,6 +179,7 @@ ssize_t qsb_write_at(QEMUSizedBuffer *qsb, const uint8_t *buf,
  * For use on files opened with qemu_bufopen
  */
 const QEMUSizedBuffer *qemu_buf_get(QEMUFile *f);
+void qemu_put_qsb(QEMUFile *f, const QEMUSizedBuffer *qsb);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
 {
@@ -182,6 +207,10 @@ int qemu_peek_byte(QEMUFile *f, int offset);
 int qemu_get_byte(QEMUFile *f);
 void qemu_file_skip(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_credit_transfer(QEMUFile *f, size_t size);
+int qemu_file_seek(QEMUFile *f, int64_t pos);
+int qemu_file_enable_zerocopy(QEMUFile *f);
+int qemu_file_flush_zerocopy(QEMUFile *f);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
 {
@@ -213,6 +213,15 @@ struct VMStateDescription {
     bool (*needed)(void *opaque);
     VMStateField *fields;
     const VMStateDescription **subsections;
+    /*
+     * The fields (and their get/put callbacks), the subsections and any
+     * nested descriptions only touch the device's own state, so with the
+     * x-parallel-device-state capability the section can be saved and
+     * loaded by a worker thread, concurrently with other such sections.
+     * pre_save, pre_load and post_load of this description still run in
+     * the migration thread, in stream order, with the iothread lock held.
+     */
+    bool parallel;
 };
 
 extern const VMStateDescription vmstate_dummy;
@@ -934,8 +943,12 @@ void loadvm_free_handlers(MigrationIncomingState *mis);
 
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id);
+int vmstate_load_state_fields(QEMUFile *f, const VMStateDescription *vmsd,
+                              void *opaque, int version_id);
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque, QJSON *vmdesc);
+void vmstate_save_state_fields(QEMUFile *f, const VMStateDescription *vmsd,
+                               void *opaque, QJSON *vmdesc);
 
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque);
 
@@ -101,6 +101,30 @@ static inline void rcu_read_unlock(void)
 
 extern void synchronize_rcu(void);
 
+/*
+ * Like synchronize_rcu(), but poll for readers instead of sleeping right
+ * away.  Burns CPU in exchange for lower latency; meant for updaters that
+ * block something latency sensitive, such as a vCPU.
+ */
+extern void synchronize_rcu_expedited(void);
+
+typedef struct RcuStats {
+    uint64_t grace_periods;         /* grace periods run */
+    uint64_t expedited;             /* ...of which expedited */
+    uint64_t shared;                /* synchronize_rcu calls that piggybacked
+                                     * on a concurrent grace period */
+    uint64_t gp_total_ns;           /* time spent in grace periods */
+    uint64_t gp_max_ns;             /* longest grace period */
+    uint64_t batches;               /* call_rcu batches processed */
+    uint64_t callbacks;             /* call_rcu callbacks processed */
+    uint64_t batch_max;             /* largest batch */
+    uint64_t batch_latency_max_ns;  /* longest time from the first callback
+                                     * of a batch to the end of its grace
+                                     * period */
+} RcuStats;
+
+extern void rcu_get_stats(RcuStats *stats);
+
 /*
  * Reader thread registration.
  */
@@ -117,6 +141,7 @@ struct rcu_head {
 };
 
 extern void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
+extern void call_rcu1_expedited(struct rcu_head *head, RCUCBFunc *func);
 
 /* The operands of the minus operator must have the same type,
  * which must be the one that we specify in the cast.
@@ -130,6 +155,19 @@ extern void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
       }),                                                                \
       (RCUCBFunc *)(func))
 
+/* Like call_rcu(), but the callback is not held back for batching and
+ * its grace period is expedited.  Meant for objects that keep others
+ * alive, such as FlatViews and the MemoryRegions they reference.
+ */
+#define call_rcu_expedited(head, func, field)                            \
+    call_rcu1_expedited(({                                               \
+         char __attribute__((unused))                                    \
+            offset_must_be_zero[-offsetof(typeof(*(head)), field)],      \
+            func_type_invalid = (func) - (void (*)(typeof(head)))(func); \
+         &(head)->field;                                                 \
+      }),                                                                \
+      (RCUCBFunc *)(func))
+
 #define g_free_rcu(obj, field) \
     call_rcu1(({                                                         \
         char __attribute__((unused))                                     \
@@ -23,6 +23,7 @@ void json_end_array(QJSON *json);
 void json_start_array(QJSON *json, const char *name);
 void json_end_object(QJSON *json);
 void json_start_object(QJSON *json, const char *name);
+void json_append_members(QJSON *json, QJSON *from);
 const char *qjson_get_str(QJSON *json);
 void qjson_finish(QJSON *json);
 
@@ -228,6 +228,7 @@ struct kvm_run;
  * @nr_cores: Number of cores within this CPU package.
  * @nr_threads: Number of threads within this CPU.
  * @numa_node: NUMA node this CPU is belonging to.
+ * @numa_bound: The CPU thread was pinned to the host nodes of @numa_node.
  * @host_tid: Host thread ID.
  * @running: #true if CPU is currently running (usermode).
  * @created: Indicates whether the CPU thread has been successfully created.
@@ -275,6 +276,7 @@ struct CPUState {
     int nr_cores;
     int nr_threads;
     int numa_node;
+    bool numa_bound;
 
     struct QemuThread *thread;
 #ifdef _WIN32
@@ -346,6 +348,13 @@ struct CPUState {
      */
     bool throttle_thread_scheduled;
 
+    /* Guest pages this vCPU dirtied for migration, see cpu_update_dirty_rates
+     * (TCG only)
+     */
+    uint64_t dirty_pages;
+    uint64_t dirty_pages_prev;
+    uint64_t dirty_rate;
+
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
        (absolute value) offset as small as possible.  This reduces code
@@ -671,6 +680,23 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_dirty_rate_available:
+ *
+ * Returns: %true if guest memory writes are attributed to the vCPU that
+ * made them, so that cpu_update_dirty_rates gives meaningful results.
+ */
+bool cpu_dirty_rate_available(void);
+
+/**
+ * cpu_update_dirty_rates:
+ * @period_ms: Time since the previous call.
+ *
+ * Computes the CPUState::dirty_rate of every vCPU, in pages per second,
+ * from the pages it dirtied since the previous call.
+ */
+void cpu_update_dirty_rates(int64_t period_ms);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
@@ -28,6 +28,8 @@ typedef struct {
     QemuCond init_done_cond;    /* is thread initialization done? */
     bool stopping;
     int thread_id;
+    int64_t numa_node;          /* guest node to follow, -1 for none */
+    bool numa_bound;            /* pinned to the host nodes of numa_node */
 } IOThread;
 
 #define IOTHREAD(obj) \
@@ -35,5 +37,6 @@ typedef struct {
 
 char *iothread_get_id(IOThread *iothread);
 AioContext *iothread_get_aio_context(IOThread *iothread);
+void iothread_bind_numa_node(IOThread *iothread);
 
 #endif /* IOTHREAD_H */
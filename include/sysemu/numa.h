@@ -32,4 +32,34 @@ void numa_set_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 void numa_unset_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 uint32_t numa_get_node(ram_addr_t addr, Error **errp);
 
+/**
+ * numa_bind_thread:
+ * @thread_id: host thread ID, as returned by qemu_get_thread_id()
+ * @node: guest NUMA node
+ * @errp: returns an error if the thread could not be bound
+ *
+ * Restrict the thread to the host CPUs of the host nodes that back
+ * the memory of guest node @node (its memdev's host-nodes).
+ *
+ * Returns: 0 on success, negative errno on failure.
+ */
+int numa_bind_thread(int thread_id, int node, Error **errp);
+
+/**
+ * numa_affinity_enabled:
+ *
+ * Returns: true once machine init is done if the machine's numa-affinity
+ * option asks for vCPU and IOThread threads to follow guest node memory.
+ */
+bool numa_affinity_enabled(void);
+
+/**
+ * numa_get_host_nodes:
+ * @node: guest NUMA node
+ *
+ * Returns: the host nodes backing guest node @node, or NULL if it is
+ * not bound.  The caller frees the list.
+ */
+uint16List *numa_get_host_nodes(int node);
+
 #endif
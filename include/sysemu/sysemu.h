@@ -103,6 +103,8 @@ enum qemu_vm_cmd {
 };
 
 #define MAX_VM_CMD_PACKAGED_SIZE (1ul << 24)
+/* Largest device state sent in a QEMU_VM_SECTION_SIZED section */
+#define MAX_VM_SECTION_SIZED_SIZE (1ul << 30)
 
 bool qemu_savevm_state_blocked(Error **errp);
 void qemu_savevm_state_begin(QEMUFile *f,
@@ -112,6 +114,8 @@ int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy);
 void qemu_savevm_state_cleanup(void);
 void qemu_savevm_state_complete_postcopy(QEMUFile *f);
 void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only);
+void qemu_savevm_state_complete_devices(QEMUFile *f);
+DeviceDowntimeList *qemu_savevm_device_downtime(void);
 void qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size,
                                uint64_t *res_non_postcopiable,
                                uint64_t *res_postcopiable);
@@ -20,6 +20,9 @@
 #include "qmp-commands.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "sysemu/numa.h"
 
 typedef ObjectClass IOThreadClass;
 
@@ -54,6 +57,13 @@ static void *iothread_run(void *opaque)
     return NULL;
 }
 
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->numa_node = -1;
+}
+
 static void iothread_instance_finalize(Object *obj)
 {
     IOThread *iothread = IOTHREAD(obj);
@@ -103,12 +113,57 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                        &iothread->init_done_lock);
     }
     qemu_mutex_unlock(&iothread->init_done_lock);
+
+    /* Only does something for object-add; at startup this happens
+     * from numa_post_machine_init().
+     */
+    iothread_bind_numa_node(iothread);
+}
+
+static void iothread_get_numa_node(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    visit_type_int(v, name, &iothread->numa_node, errp);
+}
+
+static void iothread_set_numa_node(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int64_t value;
+
+    if (iothread->ctx) {
+        error_setg(errp, "cannot change numa-node of a running iothread");
+        return;
+    }
+
+    visit_type_int(v, name, &value, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (value < -1 || value >= MAX_NODES) {
+        error_setg(errp, "numa-node must be between -1 and %d",
+                   MAX_NODES - 1);
+        return;
+    }
+    iothread->numa_node = value;
 }
 
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
     ucc->complete = iothread_complete;
+
+    object_class_property_add(klass, "numa-node", "int",
+                              iothread_get_numa_node,
+                              iothread_set_numa_node,
+                              NULL, NULL, &error_abort);
 }
 
 static const TypeInfo iothread_info = {
@@ -116,6 +171,7 @@ static const TypeInfo iothread_info = {
     .parent = TYPE_OBJECT,
     .class_init = iothread_class_init,
     .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
     .instance_finalize = iothread_instance_finalize,
     .interfaces = (InterfaceInfo[]) {
         {TYPE_USER_CREATABLE},
@@ -140,6 +196,27 @@ AioContext *iothread_get_aio_context(IOThread *iothread)
     return iothread->ctx;
 }
 
+/* Pin the thread to the host nodes of its guest node, if asked to */
+void iothread_bind_numa_node(IOThread *iothread)
+{
+    Error *local_err = NULL;
+
+    if (!numa_affinity_enabled() || iothread->numa_node < 0 ||
+        iothread->numa_bound || !iothread->ctx) {
+        return;
+    }
+
+    if (numa_bind_thread(iothread->thread_id, iothread->numa_node,
+                         &local_err) < 0) {
+        char *id = iothread_get_id(iothread);
+
+        error_reportf_err(local_err, "numa-affinity: iothread %s: ", id);
+        g_free(id);
+        return;
+    }
+    iothread->numa_bound = true;
+}
+
 static int query_one_iothread(Object *object, void *opaque)
 {
     IOThreadInfoList ***prev = opaque;
@@ -155,6 +232,10 @@ static int query_one_iothread(Object *object, void *opaque)
     info = g_new0(IOThreadInfo, 1);
     info->id = iothread_get_id(iothread);
     info->thread_id = iothread->thread_id;
+    if (iothread->numa_bound) {
+        info->has_host_nodes = true;
+        info->host_nodes = numa_get_host_nodes(iothread->numa_node);
+    }
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
@@ -21,8 +21,10 @@
 #include "qapi/visitor.h"
 #include "qemu/bitops.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 #include "trace.h"
+#include "trace/control.h"
 
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
@@ -35,7 +37,10 @@
 
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
+static bool memory_region_update_all_pending;
 static bool ioeventfd_update_pending;
+/* Regions touched by the current transaction have topology_gen set to this */
+static uint64_t memory_region_transaction_gen = 1;
 static bool global_dirty_log = false;
 
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
@@ -886,7 +891,7 @@ static void address_space_update_topology(AddressSpace *as)
 
     /* Writes are protected by the BQL.  */
     atomic_rcu_set(&as->current_map, new_view);
-    call_rcu(old_view, flatview_unref, rcu);
+    call_rcu_expedited(old_view, flatview_unref, rcu);
 
     /* Note that all the old MemoryRegions are still alive up to this
      * point.  This relieves most MemoryListeners from the need to
@@ -905,33 +910,147 @@ void memory_region_transaction_begin(void)
     ++memory_region_transaction_depth;
 }
 
+/* Record that @mr, and therefore every region containing it, renders
+ * differently at the end of the current transaction.
+ */
+static void memory_region_mark_changed(MemoryRegion *mr)
+{
+    for (; mr; mr = mr->container) {
+        mr->topology_gen = memory_region_transaction_gen;
+    }
+}
+
+static void memory_region_mark_update_pending(MemoryRegion *mr)
+{
+    memory_region_update_pending = true;
+    memory_region_mark_changed(mr);
+}
+
+static void memory_region_mark_ioeventfd_pending(MemoryRegion *mr)
+{
+    ioeventfd_update_pending = true;
+    memory_region_mark_changed(mr);
+}
+
+/* Check whether the tree below @mr includes a region that was marked in the
+ * current transaction.  Changes propagate upwards through the containers
+ * when they are marked, so only aliases need to be followed; the result is
+ * cached because the same alias target is often reachable many times.
+ */
+static bool memory_region_topology_changed(MemoryRegion *mr)
+{
+    MemoryRegion *subregion;
+    bool changed = false;
+
+    if (mr->topology_gen == memory_region_transaction_gen) {
+        return true;
+    }
+    if (mr->topology_checked_gen == memory_region_transaction_gen) {
+        return mr->topology_changed;
+    }
+
+    if (!mr->enabled) {
+        /* Nothing below a disabled region is rendered */
+    } else if (mr->alias) {
+        changed = memory_region_topology_changed(mr->alias);
+    } else {
+        QTAILQ_FOREACH(subregion, &mr->subregions, subregions_link) {
+            if (memory_region_topology_changed(subregion)) {
+                changed = true;
+                break;
+            }
+        }
+    }
+
+    mr->topology_checked_gen = memory_region_transaction_gen;
+    mr->topology_changed = changed;
+    return changed;
+}
+
+static bool address_space_needs_update(AddressSpace *as)
+{
+    return memory_region_update_all_pending
+        || as->update_pending
+        || !as->root
+        || memory_region_topology_changed(as->root);
+}
+
+/* Listeners tied to an address space only hear about it when it changes */
+static bool memory_listener_update_pending(MemoryListener *listener)
+{
+    return !listener->address_space_filter
+        || listener->address_space_filter->update_pending;
+}
+
+static void memory_listener_call_pending(bool begin)
+{
+    MemoryListener *listener;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (!memory_listener_update_pending(listener)) {
+            continue;
+        }
+        if (begin && listener->begin) {
+            listener->begin(listener);
+        } else if (!begin && listener->commit) {
+            listener->commit(listener);
+        }
+    }
+}
+
 static void memory_region_clear_pending(void)
 {
     memory_region_update_pending = false;
+    memory_region_update_all_pending = false;
     ioeventfd_update_pending = false;
+    memory_region_transaction_gen++;
 }
 
 void memory_region_transaction_commit(void)
 {
     AddressSpace *as;
+    unsigned nr_updated = 0, nr_total = 0;
+    int64_t start;
 
     assert(memory_region_transaction_depth);
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
+        if (!memory_region_update_pending && !ioeventfd_update_pending) {
+            memory_region_clear_pending();
+            return;
+        }
+
+        start = get_clock();
+        QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+            as->update_pending = address_space_needs_update(as);
+            nr_updated += as->update_pending;
+            nr_total++;
+        }
+
         if (memory_region_update_pending) {
-            MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
+            memory_listener_call_pending(true);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                if (as->update_pending) {
+                    address_space_update_topology(as);
+                }
             }
 
-            MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
-        } else if (ioeventfd_update_pending) {
+            memory_listener_call_pending(false);
+        } else {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_ioeventfds(as);
+                if (as->update_pending) {
+                    address_space_update_ioeventfds(as);
+                }
             }
         }
+
+        QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+            as->update_pending = false;
+        }
         memory_region_clear_pending();
+        trace_memory_region_transaction_commit(nr_updated, nr_total,
+                                               get_clock() - start);
    }
 }
 
@@ -1180,6 +1299,36 @@ bool memory_region_access_valid(MemoryRegion *mr,
     return true;
 }
 
+/* Work out which access sizes can bypass access_with_adjusted_size() and
+ * go straight to the ->read/->write callbacks: the region must implement
+ * them natively, must not restrict accesses through valid.accepts, and
+ * the size must be both valid and implemented.  Callers still check
+ * memory_region_access_valid() first.
+ */
+static void memory_region_update_fast_access(MemoryRegion *mr)
+{
+    const MemoryRegionOps *ops = mr->ops;
+    unsigned min = MAX(ops->impl.min_access_size ?: 1,
+                       ops->valid.min_access_size ?: 1);
+    unsigned max = MIN(ops->impl.max_access_size ?: 4,
+                       ops->valid.max_access_size ?: 4);
+    unsigned size;
+
+    mr->fast_access_sizes = 0;
+    if (!ops->read || !ops->write || ops->valid.accepts) {
+        return;
+    }
+    for (size = min; size <= max; size <<= 1) {
+        mr->fast_access_sizes |= size;
+    }
+}
+
+static inline bool memory_region_fast_access(MemoryRegion *mr, hwaddr addr,
+                                             unsigned size)
+{
+    return (mr->fast_access_sizes & size) && !(addr & (size - 1));
+}
+
 static MemTxResult memory_region_dispatch_read1(MemoryRegion *mr,
                                                 hwaddr addr,
                                                 uint64_t *pval,
@@ -1220,6 +1369,14 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
         return MEMTX_DECODE_ERROR;
     }
 
+    if (memory_region_fast_access(mr, addr, size)
+        && !trace_event_get_state(TRACE_MEMORY_REGION_OPS_READ)) {
+        *pval = mr->ops->read(mr->opaque, addr, size)
+                & (-1ULL >> (64 - size * 8));
+        adjust_endianness(mr, pval, size);
+        return MEMTX_OK;
+    }
+
     r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
     adjust_endianness(mr, pval, size);
     return r;
@@ -1269,6 +1426,13 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
         return MEMTX_OK;
     }
 
+    if (memory_region_fast_access(mr, addr, size)
+        && !trace_event_get_state(TRACE_MEMORY_REGION_OPS_WRITE)) {
+        mr->ops->write(mr->opaque, addr, data & (-1ULL >> (64 - size * 8)),
+                       size);
+        return MEMTX_OK;
+    }
+
     if (mr->ops->write) {
         return access_with_adjusted_size(addr, &data, size,
                                          mr->ops->impl.min_access_size,
@@ -1300,6 +1464,7 @@ void memory_region_init_io(MemoryRegion *mr,
     mr->ops = ops ? ops : &unassigned_mem_ops;
     mr->opaque = opaque;
     mr->terminates = true;
+    memory_region_update_fast_access(mr);
 }
 
 void memory_region_init_ram(MemoryRegion *mr,
@@ -1400,6 +1565,7 @@ void memory_region_init_rom_device(MemoryRegion *mr,
     mr->opaque = opaque;
     mr->terminates = true;
     mr->rom_device = true;
+    memory_region_update_fast_access(mr);
     mr->destructor = memory_region_destructor_rom_device;
     mr->ram_block = qemu_ram_alloc(size, mr, errp);
 }
@@ -1568,7 +1734,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_mark_update_pending(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1619,7 +1787,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_mark_update_pending(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1629,7 +1799,9 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_mark_update_pending(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1830,7 +2002,9 @@ void memory_region_add_eventfd(MemoryRegion *mr,
     memmove(&mr->ioeventfds[i+1], &mr->ioeventfds[i],
             sizeof(*mr->ioeventfds) * (mr->ioeventfd_nb-1 - i));
     mr->ioeventfds[i] = mrfd;
-    ioeventfd_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_mark_ioeventfd_pending(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1865,7 +2039,9 @@ void memory_region_del_eventfd(MemoryRegion *mr,
     --mr->ioeventfd_nb;
     mr->ioeventfds = g_realloc(mr->ioeventfds,
                                   sizeof(*mr->ioeventfds)*mr->ioeventfd_nb + 1);
-    ioeventfd_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_mark_ioeventfd_pending(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1907,7 +2083,9 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_mark_update_pending(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1948,7 +2126,9 @@ void memory_region_del_subregion(MemoryRegion *mr,
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_mark_update_pending(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1959,7 +2139,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_mark_update_pending(mr);
     memory_region_transaction_commit();
 }
 
@@ -1975,7 +2155,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
-    memory_region_update_pending = true;
+    memory_region_mark_update_pending(mr);
     memory_region_transaction_commit();
 }
 
@@ -2012,7 +2192,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_mark_update_pending(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2136,6 +2318,7 @@ void memory_global_dirty_log_start(void)
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
     memory_region_update_pending = true;
+    memory_region_update_all_pending = true;
     memory_region_transaction_commit();
 }
 
@@ -2146,6 +2329,7 @@ void memory_global_dirty_log_stop(void)
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
     memory_region_update_pending = true;
+    memory_region_update_all_pending = true;
     memory_region_transaction_commit();
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
@@ -2237,7 +2421,10 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_init_dispatch(as);
-    memory_region_update_pending |= root->enabled;
+    if (root->enabled) {
+        memory_region_update_pending = true;
+        as->update_pending = true;
+    }
     memory_region_transaction_commit();
 }
 
@@ -2419,6 +2606,13 @@ void mtree_info(fprintf_function mon_printf, void *f)
 
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         mon_printf(f, "address-space: %s\n", as->name);
+        if (as->bounce_buffer_maps) {
+            mon_printf(f, "  bounce buffers: %zu/%zu bytes in use, peak %zu, "
+                       "%" PRIu64 " maps, %" PRIu64 " failed\n",
+                       as->bounce_buffer_size, as->max_bounce_buffer_size,
+                       as->bounce_buffer_peak, as->bounce_buffer_maps,
+                       as->bounce_buffer_failures);
+        }
         mtree_print_mr(mon_printf, f, as->root, 1, 0, &ml_head);
         mon_printf(f, "\n");
     }
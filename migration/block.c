@@ -35,9 +35,13 @@
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
 #define BLK_MIG_FLAG_ZERO_BLOCK         0x08
+#define BLK_MIG_FLAG_ZERO_EXTENT        0x10
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
+/* Largest run of zero sectors sent as a single record */
+#define MAX_ZERO_EXTENT_SECTORS (1 << (30 - BDRV_SECTOR_BITS))
+
 #define MAX_INFLIGHT_IO 512
 
 //#define DEBUG_BLK_MIGRATION
@@ -70,6 +74,7 @@ typedef struct BlkMigDevState {
 
     /* Protected by block migration lock.  */
     int64_t completed_sectors;
+    int submitted;
 
     /* During migration this is protected by iothread lock / AioContext.
      * Allocation and free happen during setup and cleanup respectively.
@@ -78,7 +83,7 @@ typedef struct BlkMigDevState {
 } BlkMigDevState;
 
 typedef struct BlkMigBlock {
-    /* Only used by migration thread.  */
+    /* Only used by migration thread.  NULL for a zero extent.  */
     uint8_t *buf;
     BlkMigDevState *bmds;
     int64_t sector;
@@ -99,6 +104,8 @@ typedef struct BlkMigState {
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     int64_t total_sector_sum;
     bool zero_blocks;
+    bool zero_extents;
+    int queue_depth;
 
     /* Protected by lock.  */
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
@@ -112,6 +119,8 @@ typedef struct BlkMigState {
 
     /* Lock must be taken _inside_ the iothread lock and any AioContexts.  */
     QemuMutex lock;
+    /* Signalled when a read completes.  */
+    QemuCond read_cond;
 } BlkMigState;
 
 static BlkMigState block_mig_state;
@@ -135,8 +144,11 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
     int len;
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
-    if (block_mig_state.zero_blocks &&
-        buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+    if (!blk->buf) {
+        /* Only sent with x-block-zero-extents, older targets reject it */
+        flags = BLK_MIG_FLAG_ZERO_EXTENT;
+    } else if (block_mig_state.zero_blocks &&
+               buffer_is_zero(blk->buf, BLOCK_SIZE)) {
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
@@ -149,6 +161,11 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
     qemu_put_byte(f, len);
     qemu_put_buffer(f, (uint8_t *)bdrv_get_device_name(blk->bmds->bs), len);
 
+    if (flags & BLK_MIG_FLAG_ZERO_EXTENT) {
+        qemu_put_be32(f, blk->nr_sectors);
+        return;
+    }
+
     /* if a block is zero we need to flush here since the network
      * bandwidth is now a lot higher than the storage device bandwidth.
      * thus if we queue zero blocks we slow down the migration */
@@ -256,63 +273,81 @@ static void blk_mig_read_cb(void *opaque, int ret)
     QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
     bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
 
+    blk->bmds->submitted--;
     block_mig_state.submitted--;
     block_mig_state.read_done++;
     assert(block_mig_state.submitted >= 0);
+    qemu_cond_signal(&block_mig_state.read_cond);
     blk_mig_unlock();
 }
 
 /* Called with no lock taken.  */
 
-static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
+static void blk_mig_wait_read(void)
 {
-    int64_t total_sectors = bmds->total_sectors;
-    int64_t cur_sector = bmds->cur_sector;
-    BlockDriverState *bs = bmds->bs;
-    BlkMigBlock *blk;
-    int nr_sectors;
-
-    if (bmds->shared_base) {
-        qemu_mutex_lock_iothread();
-        aio_context_acquire(bdrv_get_aio_context(bs));
-        while (cur_sector < total_sectors &&
-               !bdrv_is_allocated(bs, cur_sector, MAX_IS_ALLOCATED_SEARCH,
-                                  &nr_sectors)) {
-            cur_sector += nr_sectors;
-        }
-        aio_context_release(bdrv_get_aio_context(bs));
-        qemu_mutex_unlock_iothread();
-    }
-
-    if (cur_sector >= total_sectors) {
-        bmds->cur_sector = bmds->completed_sectors = total_sectors;
-        return 1;
+    blk_mig_lock();
+    if (QSIMPLEQ_EMPTY(&block_mig_state.blk_list) &&
+        block_mig_state.submitted) {
+        qemu_cond_wait(&block_mig_state.read_cond, &block_mig_state.lock);
     }
+    blk_mig_unlock();
+}
 
-    bmds->completed_sectors = cur_sector;
-
-    cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
-
-    /* we are going to transfer a full block even if it is not allocated */
-    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+/* Called with iothread lock and AioContext taken.
+ *
+ * Returns the number of sectors from @sector_num on that read as zero,
+ * in whole chunks unless the run reaches the end of the device.
+ */
 
-    if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-        nr_sectors = total_sectors - cur_sector;
+static int64_t bulk_zero_sectors(BlkMigDevState *bmds, int64_t sector_num)
+{
+    int64_t end = MIN(bmds->total_sectors,
+                      sector_num + MAX_ZERO_EXTENT_SECTORS);
+    int64_t cur = sector_num;
+    BlockDriverState *file;
+    int64_t status;
+    int n;
+
+    while (cur < end) {
+        /* With a shared base only this layer is sent, otherwise the
+         * whole chain is flattened into it.
+         */
+        if (bmds->shared_base) {
+            status = bdrv_get_block_status(bmds->bs, cur, end - cur, &n,
+                                           &file);
+        } else {
+            status = bdrv_get_block_status_above(bmds->bs, NULL, cur,
+                                                 end - cur, &n, &file);
+        }
+        if (status < 0 || !(status & BDRV_BLOCK_ZERO) || n == 0) {
+            break;
+        }
+        cur += n;
     }
 
-    blk = g_new(BlkMigBlock, 1);
-    blk->buf = g_malloc(BLOCK_SIZE);
-    blk->bmds = bmds;
-    blk->sector = cur_sector;
-    blk->nr_sectors = nr_sectors;
+    if (cur < bmds->total_sectors) {
+        cur &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+    }
+    return MAX(cur - sector_num, 0);
+}
 
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+/* Called with no lock taken.
+ *
+ * Queues reads for the next chunks of the device until it has
+ * queue_depth of them in flight, and with x-block-zero-extents, zero
+ * extents for the runs of zeroes in between.  Returns 1 once the whole
+ * device has been queued.
+ */
 
-    blk_mig_lock();
-    block_mig_state.submitted++;
-    blk_mig_unlock();
+static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
+{
+    int64_t total_sectors = bmds->total_sectors;
+    int64_t cur_sector = bmds->cur_sector;
+    BlockDriverState *bs = bmds->bs;
+    BlkMigBlock *blk;
+    int64_t zero_sectors;
+    int nr_sectors;
+    bool full;
 
     /* We do not know if bs is under the main thread (and thus does
      * not acquire the AioContext when doing AIO) or rather under
@@ -323,16 +358,102 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
      * without the need to acquire the AioContext.
      */
     qemu_mutex_lock_iothread();
-    aio_context_acquire(bdrv_get_aio_context(bmds->bs));
-    blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
-                                nr_sectors, blk_mig_read_cb, blk);
+    aio_context_acquire(bdrv_get_aio_context(bs));
+
+    while (cur_sector < total_sectors) {
+        blk_mig_lock();
+        full = bmds->submitted >= block_mig_state.queue_depth;
+        blk_mig_unlock();
+        if (full) {
+            break;
+        }
+
+        if (bmds->shared_base) {
+            while (cur_sector < total_sectors &&
+                   !bdrv_is_allocated(bs, cur_sector,
+                                      MAX_IS_ALLOCATED_SEARCH,
+                                      &nr_sectors)) {
+                cur_sector += nr_sectors;
+            }
+            if (cur_sector >= total_sectors) {
+                break;
+            }
+        }
+
+        blk_mig_lock();
+        bmds->completed_sectors = cur_sector;
+        blk_mig_unlock();
+
+        cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+
+        zero_sectors = 0;
+        if (block_mig_state.zero_extents) {
+            zero_sectors = bulk_zero_sectors(bmds, cur_sector);
+        }
+        if (zero_sectors) {
+            blk = g_new0(BlkMigBlock, 1);
+            blk->bmds = bmds;
+            blk->sector = cur_sector;
+            blk->nr_sectors = zero_sectors;
+
+            bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector,
+                                    zero_sectors);
+
+            blk_mig_lock();
+            QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+            block_mig_state.read_done++;
+            blk_mig_unlock();
+
+            cur_sector += zero_sectors;
+            continue;
+        }
+
+        /* we are going to transfer a full block even if it is not
+         * allocated
+         */
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+
+        if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+            nr_sectors = total_sectors - cur_sector;
+        }
+
+        blk = g_new(BlkMigBlock, 1);
+        blk->buf = g_malloc(BLOCK_SIZE);
+        blk->bmds = bmds;
+        blk->sector = cur_sector;
+        blk->nr_sectors = nr_sectors;
+
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
 
-    bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector, nr_sectors);
-    aio_context_release(bdrv_get_aio_context(bmds->bs));
+        /* The dirty phase must not read the chunk again before this
+         * read is sent, or the older data would overwrite the newer.
+         */
+        blk_mig_lock();
+        block_mig_state.submitted++;
+        bmds->submitted++;
+        bmds_set_aio_inflight(bmds, cur_sector, nr_sectors, 1);
+        blk_mig_unlock();
+
+        blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+
+        bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector, nr_sectors);
+        cur_sector += nr_sectors;
+    }
+
+    aio_context_release(bdrv_get_aio_context(bs));
     qemu_mutex_unlock_iothread();
 
-    bmds->cur_sector = cur_sector + nr_sectors;
-    return (bmds->cur_sector >= total_sectors);
+    bmds->cur_sector = cur_sector;
+    if (cur_sector >= total_sectors) {
+        blk_mig_lock();
+        bmds->cur_sector = bmds->completed_sectors = total_sectors;
+        blk_mig_unlock();
+        return 1;
+    }
+    return 0;
 }
 
 /* Called with iothread lock taken.  */
@@ -391,6 +512,8 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
     block_mig_state.zero_blocks = migrate_zero_blocks();
+    block_mig_state.zero_extents = migrate_block_zero_extents();
+    block_mig_state.queue_depth = migrate_block_queue_depth();
 
     for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
         if (bdrv_is_read_only(bs)) {
@@ -426,27 +549,35 @@ static void init_blk_migration(QEMUFile *f)
     }
 }
 
-/* Called with no lock taken.  */
+/* Called with no lock taken.
+ *
+ * Moves the bulk phase of every device forward, so that all of them are
+ * read in parallel.  Returns 0 once all devices are done; *queued is false
+ * if no device had room in its queue.
+ */
 
-static int blk_mig_save_bulked_block(QEMUFile *f)
+static int blk_mig_save_bulked_block(QEMUFile *f, bool *queued)
 {
     int64_t completed_sector_sum = 0;
     BlkMigDevState *bmds;
+    int64_t prev_sector;
     int progress;
     int ret = 0;
 
+    *queued = false;
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
         if (bmds->bulk_completed == 0) {
+            prev_sector = bmds->cur_sector;
             if (mig_save_device_bulk(f, bmds) == 1) {
                 /* completed bulk section for this device */
                 bmds->bulk_completed = 1;
             }
-            completed_sector_sum += bmds->completed_sectors;
+            if (bmds->cur_sector != prev_sector) {
+                *queued = true;
+            }
             ret = 1;
-            break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
         }
+        completed_sector_sum += bmds->completed_sectors;
     }
 
     if (block_mig_state.total_sector_sum != 0) {
@@ -516,6 +647,7 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
 
                 blk_mig_lock();
                 block_mig_state.submitted++;
+                bmds->submitted++;
                 bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
                 blk_mig_unlock();
             } else {
@@ -713,10 +845,17 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
            MAX_INFLIGHT_IO) {
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
+            bool queued;
+
             /* first finish the bulk phase */
-            if (blk_mig_save_bulked_block(f) == 0) {
+            if (blk_mig_save_bulked_block(f, &queued) == 0) {
                 /* finished saving bulk on all devices */
                 block_mig_state.bulk_completed = 1;
+            } else if (!queued) {
+                /* every queue is full, send what has been read so far */
+                blk_mig_wait_read();
+                blk_mig_lock();
+                break;
             }
             ret = 0;
         } else {
@@ -839,7 +978,7 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
         flags = addr & ~BDRV_SECTOR_MASK;
         addr >>= BDRV_SECTOR_BITS;
 
-        if (flags & BLK_MIG_FLAG_DEVICE_BLOCK) {
+        if (flags & (BLK_MIG_FLAG_DEVICE_BLOCK | BLK_MIG_FLAG_ZERO_EXTENT)) {
             /* get device name */
             len = qemu_get_byte(f);
             qemu_get_buffer(f, (uint8_t *)device_name, len);
@@ -874,13 +1013,22 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 }
             }
 
-            if (total_sectors - addr < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+            if (flags & BLK_MIG_FLAG_ZERO_EXTENT) {
+                nr_sectors = qemu_get_be32(f);
+                if (nr_sectors <= 0 || nr_sectors > MAX_ZERO_EXTENT_SECTORS ||
+                    addr + nr_sectors > total_sectors) {
+                    error_report("Invalid zero extent of %d sectors at %"
+                                 PRId64 " on %s", nr_sectors, addr,
+                                 device_name);
+                    return -EINVAL;
+                }
+            } else if (total_sectors - addr < BDRV_SECTORS_PER_DIRTY_CHUNK) {
                 nr_sectors = total_sectors - addr;
             } else {
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
 
-            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+            if (flags & (BLK_MIG_FLAG_ZERO_BLOCK | BLK_MIG_FLAG_ZERO_EXTENT)) {
                 ret = bdrv_write_zeroes(bs, addr, nr_sectors,
                                         BDRV_REQ_MAY_UNMAP);
             } else {
@@ -944,6 +1092,7 @@ void blk_mig_init(void)
     QSIMPLEQ_INIT(&block_mig_state.bmds_list);
     QSIMPLEQ_INIT(&block_mig_state.blk_list);
     qemu_mutex_init(&block_mig_state.lock);
+    qemu_cond_init(&block_mig_state.read_cond);
 
     register_savevm_live(NULL, "block", 0, 1, &savevm_block_handlers,
                          &block_mig_state);
@@ -0,0 +1,240 @@
+/*
+ * Guest memory dirty rate estimation
+ *
+ * Estimates how fast the guest dirties its memory without starting a
+ * migration: a random sample of the pages of every RAMBlock is hashed,
+ * hashed again after the measurement period, and the fraction of pages
+ * whose content changed is scaled to the size of the block.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "qemu/crc32c.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "exec/cpu-common.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+#define DIRTYRATE_PAGE_SIZE             4096
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES  512
+#define DIRTYRATE_MAX_SAMPLE_PAGES      4096
+#define DIRTYRATE_MAX_CALC_TIME         60
+
+typedef struct DirtyRateBlock {
+    char *idstr;
+    uint64_t length;
+    uint32_t nr_samples;
+    uint32_t nr_dirtied;
+    uint64_t *offsets;
+    uint32_t *hashes;
+} DirtyRateBlock;
+
+typedef struct DirtyRateState {
+    DirtyRateStatus status;
+    int64_t start_time;
+    int64_t calc_time;
+    int64_t sample_pages;
+    DirtyRateBlock *blocks;
+    int nr_blocks;
+} DirtyRateState;
+
+/* Protects dirtyrate; the measuring thread only drops it while sleeping */
+static QemuMutex dirtyrate_lock;
+static DirtyRateState dirtyrate = {
+    .status = DIRTY_RATE_STATUS_UNSTARTED,
+};
+
+static void __attribute__((constructor)) dirtyrate_init(void)
+{
+    qemu_mutex_init(&dirtyrate_lock);
+}
+
+static uint32_t dirtyrate_hash_page(void *host, uint64_t offset)
+{
+    return crc32c(0xffffffff, (uint8_t *)host + offset, DIRTYRATE_PAGE_SIZE);
+}
+
+static void dirtyrate_free_blocks(DirtyRateState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        g_free(s->blocks[i].idstr);
+        g_free(s->blocks[i].offsets);
+        g_free(s->blocks[i].hashes);
+    }
+    g_free(s->blocks);
+    s->blocks = NULL;
+    s->nr_blocks = 0;
+}
+
+/* Pick the sample of @block_name and hash it */
+static int dirtyrate_sample_block(const char *block_name, void *host_addr,
+                                  ram_addr_t offset, ram_addr_t length,
+                                  void *opaque)
+{
+    DirtyRateState *s = opaque;
+    uint64_t nr_pages = length / DIRTYRATE_PAGE_SIZE;
+    DirtyRateBlock *b;
+    uint32_t i;
+
+    if (!host_addr || !nr_pages) {
+        return 0;
+    }
+
+    s->blocks = g_renew(DirtyRateBlock, s->blocks, s->nr_blocks + 1);
+    b = &s->blocks[s->nr_blocks++];
+    b->idstr = g_strdup(block_name);
+    b->length = length;
+    b->nr_dirtied = 0;
+    /* sample-pages is per GiB; small blocks get at least one page */
+    b->nr_samples = MIN(nr_pages,
+                        DIV_ROUND_UP(length * s->sample_pages, 1ULL << 30));
+    b->offsets = g_new(uint64_t, b->nr_samples);
+    b->hashes = g_new(uint32_t, b->nr_samples);
+
+    for (i = 0; i < b->nr_samples; i++) {
+        b->offsets[i] = (uint64_t)g_random_int_range(0,
+                                    MIN(nr_pages, G_MAXINT32)) *
+                        DIRTYRATE_PAGE_SIZE;
+        b->hashes[i] = dirtyrate_hash_page(host_addr, b->offsets[i]);
+    }
+    return 0;
+}
+
+/* Hash the sample of @block_name again and count the pages that changed */
+static int dirtyrate_compare_block(const char *block_name, void *host_addr,
+                                   ram_addr_t offset, ram_addr_t length,
+                                   void *opaque)
+{
+    DirtyRateState *s = opaque;
+    DirtyRateBlock *b = NULL;
+    uint32_t i;
+    int j;
+
+    for (j = 0; j < s->nr_blocks; j++) {
+        if (!strcmp(s->blocks[j].idstr, block_name)) {
+            b = &s->blocks[j];
+            break;
+        }
+    }
+    /* Blocks added or resized in the meantime are not measured */
+    if (!b || !host_addr || b->length != length) {
+        return 0;
+    }
+
+    for (i = 0; i < b->nr_samples; i++) {
+        if (dirtyrate_hash_page(host_addr, b->offsets[i]) != b->hashes[i]) {
+            b->nr_dirtied++;
+        }
+    }
+    trace_dirtyrate_block(b->idstr, b->nr_samples, b->nr_dirtied);
+    return 0;
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    int64_t deadline;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&dirtyrate_lock);
+    qemu_ram_foreach_block(dirtyrate_sample_block, &dirtyrate);
+    deadline = dirtyrate.start_time + dirtyrate.calc_time * 1000;
+    qemu_mutex_unlock(&dirtyrate_lock);
+
+    while (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) < deadline) {
+        g_usleep((deadline - qemu_clock_get_ms(QEMU_CLOCK_REALTIME)) * 1000);
+    }
+
+    qemu_mutex_lock(&dirtyrate_lock);
+    qemu_ram_foreach_block(dirtyrate_compare_block, &dirtyrate);
+    dirtyrate.status = DIRTY_RATE_STATUS_MEASURED;
+    qemu_mutex_unlock(&dirtyrate_lock);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    QemuThread thread;
+
+    if (calc_time < 1 || calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, "calc-time must be between 1 and %d seconds",
+                   DIRTYRATE_MAX_CALC_TIME);
+        return;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < 1 || sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, "sample-pages must be between 1 and %d",
+                   DIRTYRATE_MAX_SAMPLE_PAGES);
+        return;
+    }
+
+    qemu_mutex_lock(&dirtyrate_lock);
+    if (dirtyrate.status == DIRTY_RATE_STATUS_MEASURING) {
+        qemu_mutex_unlock(&dirtyrate_lock);
+        error_setg(errp, "a dirty rate measurement is already in progress");
+        return;
+    }
+    dirtyrate_free_blocks(&dirtyrate);
+    dirtyrate.status = DIRTY_RATE_STATUS_MEASURING;
+    dirtyrate.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    dirtyrate.calc_time = calc_time;
+    dirtyrate.sample_pages = sample_pages;
+    qemu_mutex_unlock(&dirtyrate_lock);
+
+    qemu_thread_create(&thread, "dirtyrate", dirtyrate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    RAMBlockDirtyRateList **tail = &info->ramblocks;
+    double total = 0;
+    int i;
+
+    qemu_mutex_lock(&dirtyrate_lock);
+    info->status = dirtyrate.status;
+    info->start_time = dirtyrate.start_time / 1000;
+    info->calc_time = dirtyrate.calc_time;
+    info->sample_pages = dirtyrate.sample_pages;
+
+    if (dirtyrate.status == DIRTY_RATE_STATUS_MEASURED) {
+        for (i = 0; i < dirtyrate.nr_blocks; i++) {
+            DirtyRateBlock *b = &dirtyrate.blocks[i];
+            RAMBlockDirtyRateList *entry = g_new0(RAMBlockDirtyRateList, 1);
+            double rate;
+
+            /* MB/s, assuming the sample is representative of the block */
+            rate = (double)b->nr_dirtied / b->nr_samples * b->length /
+                   (1024 * 1024) / dirtyrate.calc_time;
+            total += rate;
+
+            entry->value = g_new0(RAMBlockDirtyRate, 1);
+            entry->value->id = g_strdup(b->idstr);
+            entry->value->size = b->length;
+            entry->value->sampled_pages = b->nr_samples;
+            entry->value->dirtied_pages = b->nr_dirtied;
+            entry->value->dirty_rate = rate;
+            *tail = entry;
+            tail = &entry->next;
+        }
+        info->has_ramblocks = true;
+        info->has_dirty_rate = true;
+        info->dirty_rate = total;
+    }
+    qemu_mutex_unlock(&dirtyrate_lock);
+
+    return info;
+}
@@ -0,0 +1,83 @@
+/*
+ * QEMU live migration to and from a regular file
+ *
+ * Unlike exec:cat or fd:, the file: transport gives the migration
+ * stream a seekable backing store, which lets the RAM code write each
+ * page at a fixed offset (see the x-mapped-ram capability) and lets
+ * the destination map guest RAM straight from the file.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "block/block.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    int fd;
+
+    DPRINTF("Attempting to start an outgoing migration to %s\n", path);
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    s->to_dst_file = qemu_fdopen(fd, "wb");
+    if (s->to_dst_file == NULL) {
+        error_setg(errp, "failed to open a migration stream on '%s'", path);
+        qemu_close(fd);
+        return;
+    }
+
+    migrate_fd_connect(s);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    int fd;
+    QEMUFile *f;
+
+    DPRINTF("Attempting to start an incoming migration from %s\n", path);
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    f = qemu_fdopen(fd, "rb");
+    if (f == NULL) {
+        error_setg(errp, "failed to open a migration stream on '%s'", path);
+        qemu_close(fd);
+        return;
+    }
+
+    qemu_set_fd_handler(fd, file_accept_incoming_migration, NULL, f);
+}
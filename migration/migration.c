@@ -52,6 +52,10 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT 10
+/* Default number of extra RAM channels for multifd */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+/* Default number of bulk phase reads in flight per block device */
+#define DEFAULT_MIGRATE_BLOCK_QUEUE_DEPTH 16
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -91,10 +95,15 @@ MigrationState *migrate_get_current(void)
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL,
         .parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT,
+        .parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_X_BLOCK_QUEUE_DEPTH] =
+                DEFAULT_MIGRATE_BLOCK_QUEUE_DEPTH,
     };
 
     if (!once) {
         qemu_mutex_init(&current_migration.src_page_req_mutex);
+        qemu_sem_init(&current_migration.rate_limit_sem, 0);
         once = true;
     }
     return &current_migration;
@@ -317,6 +326,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
 #endif
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -406,6 +417,7 @@ static void process_incoming_migration_co(void *opaque)
 
     qemu_fclose(f);
     free_xbzrle_decoded_buf();
+    multifd_load_cleanup();
 
     if (ret < 0) {
         migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
@@ -525,6 +537,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
     params->x_cpu_throttle_increment =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    params->x_multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+    params->x_block_queue_depth =
+            s->parameters[MIGRATION_PARAMETER_X_BLOCK_QUEUE_DEPTH];
 
     return params;
 }
@@ -557,6 +573,7 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
+        info->xbzrle_cache->cache_hit_rate = xbzrle_mig_cache_hit_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
@@ -655,6 +672,8 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->total_time = s->total_time;
         info->has_downtime = true;
         info->downtime = s->downtime;
+        info->device_downtime = qemu_savevm_device_downtime();
+        info->has_device_downtime = info->device_downtime != NULL;
         info->has_setup_time = true;
         info->setup_time = s->setup_time;
 
@@ -679,6 +698,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     }
     info->status = s->state;
 
+    /* Filled in on the destination of a postcopy migration */
+    info->postcopy_faults = postcopy_fault_info();
+    info->has_postcopy_faults = info->postcopy_faults != NULL;
+
     return info;
 }
 
@@ -710,6 +733,61 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_mapped_ram()) {
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_xbzrle()) {
+            /* Mapped RAM stores each page once at a fixed file offset;
+             * delta encoding, compression and postcopy all rely on
+             * pages travelling inline in the stream.
+             */
+            error_report("Mapped RAM is not compatible with postcopy, "
+                         "compression or xbzrle");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM] =
+                false;
+        }
+    }
+
+    if (migrate_use_multifd()) {
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_xbzrle() || migrate_use_mapped_ram()) {
+            /* Multifd channels carry plain pages only, and postcopy
+             * needs pages to arrive in the order they were requested.
+             */
+            error_report("Multifd is not compatible with postcopy, "
+                         "compression, xbzrle or mapped RAM");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+        }
+    }
+
+    if (migrate_use_zerocopy_send() && migrate_use_xbzrle()) {
+        /* XBZRLE sends pages from its cache, which is rewritten while
+         * the kernel may still be reading from it.
+         */
+        error_report("Zero-copy send is not compatible with xbzrle");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZEROCOPY_SEND] = false;
+    }
+
+    if (migrate_use_background_snapshot()) {
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_xbzrle() || migrate_use_mapped_ram() ||
+            migrate_use_multifd() || migrate_use_zerocopy_send()) {
+            /* Each page is sent once, and has to be copied into the
+             * stream by the migration thread itself before the guest
+             * is allowed to write to it again.
+             */
+            error_report("Background snapshot is not compatible with "
+                         "postcopy, compression, xbzrle, mapped RAM, "
+                         "multifd or zero-copy send");
+            s->enabled_capabilities[
+                MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT] = false;
+        } else if (!ram_write_tracking_available()) {
+            error_report("Background snapshot needs userfaultfd write "
+                         "protection support from the host kernel");
+            s->enabled_capabilities[
+                MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT] = false;
+        }
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -721,7 +799,11 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 bool has_x_cpu_throttle_initial,
                                 int64_t x_cpu_throttle_initial,
                                 bool has_x_cpu_throttle_increment,
-                                int64_t x_cpu_throttle_increment, Error **errp)
+                                int64_t x_cpu_throttle_increment,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_x_block_queue_depth,
+                                int64_t x_block_queue_depth, Error **errp)
 {
     MigrationState *s = migrate_get_current();
 
@@ -744,6 +826,20 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "is invalid, it should be in the range of 1 to 255");
         return;
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_block_queue_depth &&
+            (x_block_queue_depth < 1 || x_block_queue_depth > 256)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_block_queue_depth",
+                   "is invalid, it should be in the range of 1 to 256");
+        return;
+    }
     if (has_x_cpu_throttle_initial &&
             (x_cpu_throttle_initial < 1 || x_cpu_throttle_initial > 99)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
@@ -776,6 +872,14 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                                                     x_cpu_throttle_increment;
     }
+    if (has_x_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                                                    x_multifd_channels;
+    }
+    if (has_x_block_queue_depth) {
+        s->parameters[MIGRATION_PARAMETER_X_BLOCK_QUEUE_DEPTH] =
+                                                    x_block_queue_depth;
+    }
 }
 
 void qmp_migrate_start_postcopy(Error **errp)
@@ -948,10 +1052,16 @@ MigrationState *migrate_init(const MigrationParams *params)
     s->postcopy_after_devices = false;
     s->migration_thread_running = false;
     s->last_req_rb = NULL;
+    s->last_req_start = 0;
+    s->last_req_len = 0;
+    s->prefetch_window = 0;
+    s->prefetch_lo = 0;
+    s->prefetch_hi = 0;
 
     migrate_set_state(&s->state, MIGRATION_STATUS_NONE, MIGRATION_STATUS_SETUP);
 
     QSIMPLEQ_INIT(&s->src_page_requests);
+    QSIMPLEQ_INIT(&s->src_page_prefetch);
 
     s->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     return s;
@@ -980,6 +1090,11 @@ void qmp_migrate_incoming(const char *uri, Error **errp)
     }
     if (!once) {
         error_setg(errp, "The incoming migration has already been started");
+        return;
+    }
+    if (migrate_use_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "mapped RAM needs a file: migration URI");
+        return;
     }
 
     qemu_start_incoming_migration(uri, &local_err);
@@ -1032,7 +1147,31 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multifd() &&
+        !strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "multifd needs a tcp: or unix: migration URI");
+        return;
+    }
+
+    if (migrate_use_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "mapped RAM needs a file: migration URI");
+        return;
+    }
+
+    if (migrate_use_zerocopy_send() && !strstart(uri, "tcp:", NULL)) {
+        error_setg(errp, "zero-copy send needs a tcp: migration URI");
+        return;
+    }
+
+    if (migrate_use_background_snapshot() && params.blk) {
+        error_setg(errp, "background snapshot does not support block "
+                   "migration");
+        return;
+    }
+
     s = migrate_init(&params);
+    g_free(s->uri);
+    s->uri = g_strdup(uri);
 
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
@@ -1047,6 +1186,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
@@ -1155,6 +1296,15 @@ bool migrate_zero_blocks(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
 }
 
+bool migrate_block_zero_extents(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_BLOCK_ZERO_EXTENTS];
+}
+
 bool migrate_use_compression(void)
 {
     MigrationState *s;
@@ -1191,6 +1341,69 @@ int migrate_decompress_threads(void)
     return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
 }
 
+bool migrate_use_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM];
+}
+
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+bool migrate_use_zerocopy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZEROCOPY_SEND];
+}
+
+bool migrate_use_parallel_device_state(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_PARALLEL_DEVICE_STATE];
+}
+
+bool migrate_use_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+}
+
+int migrate_block_queue_depth(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_BLOCK_QUEUE_DEPTH];
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -1637,6 +1850,26 @@ fail:
                       MIGRATION_STATUS_FAILED);
 }
 
+/*
+ * Sleep for up to @ms milliseconds for the rate limit, unless a page
+ * request comes in.  rate_limit_sem is only posted while
+ * rate_limit_waiting is set, so requests that arrive while we are busy
+ * sending do not cut later sleeps short.
+ */
+static void migration_rate_limit_wait(MigrationState *s, int64_t ms)
+{
+    bool woken = false;
+
+    atomic_mb_set(&s->rate_limit_waiting, true);
+    if (!ram_save_has_page_requests(s)) {
+        woken = qemu_sem_timedwait(&s->rate_limit_sem, ms) == 0;
+    }
+    if (!woken && !atomic_xchg(&s->rate_limit_waiting, false)) {
+        /* A page request cleared the flag, take its post */
+        qemu_sem_wait(&s->rate_limit_sem);
+    }
+}
+
 /*
  * Master migration thread on the source VM.
  * It drives the migration and pumps the data down the outgoing channel.
@@ -1689,7 +1922,8 @@ static void *migration_thread(void *opaque)
         int64_t current_time;
         uint64_t pending_size;
 
-        if (!qemu_file_rate_limit(s->to_dst_file)) {
+        if (!qemu_file_rate_limit(s->to_dst_file) ||
+            ram_save_has_page_requests(s)) {
             uint64_t pend_post, pend_nonpost;
 
             qemu_savevm_state_pending(s->to_dst_file, max_size, &pend_nonpost,
@@ -1752,8 +1986,12 @@ static void *migration_thread(void *opaque)
             initial_bytes = qemu_ftell(s->to_dst_file);
         }
         if (qemu_file_rate_limit(s->to_dst_file)) {
-            /* usleep expects microseconds */
-            g_usleep((initial_time + BUFFER_DELAY - current_time)*1000);
+            /*
+             * Sleep until the end of the rate limiting window, but wake
+             * up early if the postcopy destination asks for a page.
+             */
+            migration_rate_limit_wait(s, initial_time + BUFFER_DELAY -
+                                         current_time);
         }
     }
 
@@ -1787,6 +2025,161 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+/*
+ * Background snapshot thread.  The guest is only paused while the device
+ * state is saved and guest RAM is write-protected; RAM is then streamed
+ * out with the guest running.  A page the guest writes to is saved ahead
+ * of the others and only then made writable again, so the stream holds
+ * RAM as it was when the guest was paused.
+ */
+static void *background_snapshot_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    int64_t initial_time, start_time, end_time;
+    int64_t initial_bytes = 0;
+    bool old_vm_running;
+    QEMUFile *fb;
+    int ret;
+
+    rcu_register_thread();
+
+    qemu_savevm_state_header(s->to_dst_file);
+    qemu_savevm_state_begin(s->to_dst_file, &s->params);
+
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+
+    trace_migration_thread_setup_complete();
+
+    /*
+     * The device state is taken at the snapshot point but has to follow
+     * RAM in the stream, so it is kept in a buffer until the end.
+     */
+    fb = qemu_bufopen("w", NULL);
+    if (!fb) {
+        error_report("Failed to create buffered file");
+    }
+
+    qemu_mutex_lock_iothread();
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    old_vm_running = runstate_is_running();
+    ret = fb ? global_state_store() : -1;
+    if (!ret) {
+        ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    }
+    if (ret >= 0) {
+        qemu_savevm_state_complete_devices(fb);
+        ret = qemu_file_get_error(fb);
+    }
+    if (ret >= 0) {
+        ret = ram_write_tracking_start(s);
+    }
+    if (ret >= 0) {
+        s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time;
+        trace_background_snapshot_resume(s->downtime);
+        if (old_vm_running) {
+            vm_start();
+        }
+    }
+    qemu_mutex_unlock_iothread();
+
+    initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    while (ret >= 0 && s->state == MIGRATION_STATUS_ACTIVE) {
+        int64_t current_time;
+
+        if (!qemu_file_rate_limit(s->to_dst_file) ||
+            ram_save_has_page_requests(s)) {
+            uint64_t pend_post, pend_nonpost;
+
+            /* Nothing gets dirtied again, so this only ever goes down */
+            qemu_savevm_state_pending(s->to_dst_file, 0, &pend_nonpost,
+                                      &pend_post);
+            if (!pend_nonpost && !pend_post) {
+                break;
+            }
+            qemu_savevm_state_iterate(s->to_dst_file, false);
+        }
+
+        ret = qemu_file_get_error(s->to_dst_file);
+        if (ret) {
+            trace_migration_thread_file_err();
+            break;
+        }
+        current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        if (current_time >= initial_time + BUFFER_DELAY) {
+            uint64_t transferred_bytes = qemu_ftell(s->to_dst_file) -
+                                         initial_bytes;
+            uint64_t time_spent = current_time - initial_time;
+
+            s->mbps = (((double) transferred_bytes * 8.0) /
+                    ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
+
+            qemu_file_reset_rate_limit(s->to_dst_file);
+            initial_time = current_time;
+            initial_bytes = qemu_ftell(s->to_dst_file);
+        }
+        if (qemu_file_rate_limit(s->to_dst_file)) {
+            /* Wake up early if the guest writes to a page */
+            migration_rate_limit_wait(s, initial_time + BUFFER_DELAY -
+                                         current_time);
+        }
+    }
+
+    if (ret >= 0 && s->state == MIGRATION_STATUS_ACTIVE) {
+        /*
+         * All of RAM has been saved and is writable again, so no vCPU can
+         * be holding the iothread lock while it waits on write tracking.
+         */
+        qemu_mutex_lock_iothread();
+        qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+        qemu_savevm_state_complete_precopy(s->to_dst_file, true);
+        qemu_put_qsb(s->to_dst_file, qemu_buf_get(fb));
+        qemu_fflush(s->to_dst_file);
+        qemu_mutex_unlock_iothread();
+        ret = qemu_file_get_error(s->to_dst_file);
+    }
+    if (fb) {
+        qemu_fclose(fb);
+    }
+
+    migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                      ret < 0 ? MIGRATION_STATUS_FAILED :
+                                MIGRATION_STATUS_COMPLETED);
+
+    trace_migration_thread_after_loop();
+    end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    /*
+     * A vCPU may be holding the iothread lock while it waits for a page
+     * we will now never save; drop the protection before taking the lock.
+     */
+    ram_write_tracking_stop();
+
+    qemu_mutex_lock_iothread();
+    qemu_savevm_state_cleanup();
+    if (s->state == MIGRATION_STATUS_COMPLETED) {
+        uint64_t transferred_bytes = qemu_ftell(s->to_dst_file);
+        s->total_time = end_time - s->total_time;
+        if (s->total_time) {
+            s->mbps = (((double) transferred_bytes * 8.0) /
+                       ((double) s->total_time)) / 1000;
+        }
+        if (runstate_check(RUN_STATE_FINISH_MIGRATE)) {
+            runstate_set(RUN_STATE_POSTMIGRATE);
+        }
+    } else if (old_vm_running && runstate_check(RUN_STATE_FINISH_MIGRATE)) {
+        vm_start();
+    }
+    qemu_bh_schedule(s->cleanup_bh);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s)
 {
     /* This is a best 1st approximation. ns to ms */
@@ -1814,8 +2207,13 @@ void migrate_fd_connect(MigrationState *s)
     }
 
     migrate_compress_threads_create();
-    qemu_thread_create(&s->thread, "migration", migration_thread, s,
-                       QEMU_THREAD_JOINABLE);
+    if (migrate_use_background_snapshot()) {
+        qemu_thread_create(&s->thread, "snapshot", background_snapshot_thread,
+                           s, QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(&s->thread, "migration", migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    }
     s->migration_thread_running = true;
 }
 
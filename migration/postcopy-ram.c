@@ -25,6 +25,8 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "qemu/atomic.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -62,6 +64,127 @@ struct PostcopyDiscardState {
 #include <sys/eventfd.h>
 #include <linux/userfaultfd.h>
 
+/*
+ * Histogram of the time between a userfault and the placement of the
+ * page that resolves it; bucket i counts latencies of [2^i, 2^(i+1)) us.
+ */
+#define POSTCOPY_FAULT_BUCKETS 20
+
+typedef struct PostcopyFaultStats {
+    QemuMutex lock;
+    /* Faulting host page -> time of the fault (ns), until it is placed */
+    GHashTable *pending;
+    /* Read without the lock to skip the lookup for pages nobody wants */
+    int nr_pending;
+    uint64_t requests;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t histogram[POSTCOPY_FAULT_BUCKETS];
+} PostcopyFaultStats;
+
+static PostcopyFaultStats fault_stats;
+
+static void __attribute__((constructor)) postcopy_fault_stats_init(void)
+{
+    qemu_mutex_init(&fault_stats.lock);
+}
+
+static void postcopy_fault_stats_reset(void)
+{
+    qemu_mutex_lock(&fault_stats.lock);
+    if (fault_stats.pending) {
+        g_hash_table_destroy(fault_stats.pending);
+    }
+    fault_stats.pending = g_hash_table_new_full(g_direct_hash,
+                                                g_direct_equal, NULL, g_free);
+    atomic_set(&fault_stats.nr_pending, 0);
+    fault_stats.requests = 0;
+    fault_stats.total_ns = 0;
+    fault_stats.max_ns = 0;
+    memset(fault_stats.histogram, 0, sizeof(fault_stats.histogram));
+    qemu_mutex_unlock(&fault_stats.lock);
+}
+
+/* Called from the fault thread when @host is requested from the source */
+static void postcopy_fault_start(void *host)
+{
+    int64_t *start;
+
+    qemu_mutex_lock(&fault_stats.lock);
+    /* Several vCPUs may fault on the same page, keep the first one */
+    if (!g_hash_table_contains(fault_stats.pending, host)) {
+        start = g_new(int64_t, 1);
+        *start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        g_hash_table_insert(fault_stats.pending, host, start);
+        atomic_inc(&fault_stats.nr_pending);
+    }
+    qemu_mutex_unlock(&fault_stats.lock);
+}
+
+/* Called once @host has been placed, waking up anything faulting on it */
+static void postcopy_fault_end(void *host)
+{
+    int64_t *start;
+    uint64_t latency_ns, latency_us;
+    int bucket;
+
+    if (!atomic_read(&fault_stats.nr_pending)) {
+        return;
+    }
+
+    qemu_mutex_lock(&fault_stats.lock);
+    start = g_hash_table_lookup(fault_stats.pending, host);
+    if (!start) {
+        qemu_mutex_unlock(&fault_stats.lock);
+        return;
+    }
+    latency_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - *start;
+    g_hash_table_remove(fault_stats.pending, host);
+    atomic_dec(&fault_stats.nr_pending);
+
+    latency_us = latency_ns / 1000;
+    bucket = latency_us ? 63 - clz64(latency_us) : 0;
+    fault_stats.histogram[MIN(bucket, POSTCOPY_FAULT_BUCKETS - 1)]++;
+    fault_stats.requests++;
+    fault_stats.total_ns += latency_ns;
+    fault_stats.max_ns = MAX(fault_stats.max_ns, latency_ns);
+    qemu_mutex_unlock(&fault_stats.lock);
+
+    trace_postcopy_fault_latency(host, latency_us);
+}
+
+PostcopyFaultInfo *postcopy_fault_info(void)
+{
+    PostcopyFaultInfo *info;
+    intList **tail;
+    int i;
+
+    qemu_mutex_lock(&fault_stats.lock);
+    if (!fault_stats.pending ||
+        (!fault_stats.requests && !fault_stats.nr_pending)) {
+        qemu_mutex_unlock(&fault_stats.lock);
+        return NULL;
+    }
+
+    info = g_new0(PostcopyFaultInfo, 1);
+    info->requests = fault_stats.requests;
+    info->pending = fault_stats.nr_pending;
+    info->latency_avg = fault_stats.requests ?
+                        fault_stats.total_ns / fault_stats.requests / 1000 : 0;
+    info->latency_max = fault_stats.max_ns / 1000;
+    tail = &info->histogram;
+    for (i = 0; i < POSTCOPY_FAULT_BUCKETS; i++) {
+        intList *entry = g_new0(intList, 1);
+
+        entry->value = fault_stats.histogram[i];
+        *tail = entry;
+        tail = &entry->next;
+    }
+    qemu_mutex_unlock(&fault_stats.lock);
+
+    return info;
+}
+
 static bool ufd_version_check(int ufd)
 {
     struct uffdio_api api_struct;
@@ -302,6 +425,12 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         close(mis->userfault_fd);
         close(mis->userfault_quit_fd);
         mis->have_fault_thread = false;
+
+        /* Faults still outstanding now will never be resolved */
+        qemu_mutex_lock(&fault_stats.lock);
+        g_hash_table_remove_all(fault_stats.pending);
+        atomic_set(&fault_stats.nr_pending, 0);
+        qemu_mutex_unlock(&fault_stats.lock);
     }
 
     qemu_balloon_inhibit(false);
@@ -470,6 +599,8 @@ static void *postcopy_ram_fault_thread(void *opaque)
         trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
                                                 qemu_ram_get_idstr(rb),
                                                 rb_offset);
+        postcopy_fault_start((void *)(uintptr_t)(msg.arg.pagefault.address &
+                                                 ~(uint64_t)(hostpagesize - 1)));
 
         /*
          * Send the request to the source - we want to request one
@@ -516,6 +647,7 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
         return -1;
     }
 
+    postcopy_fault_stats_reset();
     qemu_sem_init(&mis->fault_thread_sem, 0);
     qemu_thread_create(&mis->fault_thread, "postcopy/fault",
                        postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
@@ -566,6 +698,7 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
     }
 
     trace_postcopy_place_page(host);
+    postcopy_fault_end(host);
     return 0;
 }
 
@@ -590,6 +723,7 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
     }
 
     trace_postcopy_place_page_zero(host);
+    postcopy_fault_end(host);
     return 0;
 }
 
@@ -673,6 +807,11 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return NULL;
 }
 
+PostcopyFaultInfo *postcopy_fault_info(void)
+{
+    return NULL;
+}
+
 #endif
 
 /* ------------------------------------------------------------------------- */
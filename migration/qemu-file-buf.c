@@ -421,6 +421,25 @@ const QEMUSizedBuffer *qemu_buf_get(QEMUFile *f)
     return p->qsb;
 }
 
+/* Copy the contents of @qsb to @f (concatenating the iov's) */
+void qemu_put_qsb(QEMUFile *f, const QEMUSizedBuffer *qsb)
+{
+    size_t cur_iov;
+    size_t len = qsb_get_length(qsb);
+
+    for (cur_iov = 0; cur_iov < qsb->n_iov; cur_iov++) {
+        /* The iov entries are partially filled */
+        size_t towrite = MIN(qsb->iov[cur_iov].iov_len, len);
+        len -= towrite;
+
+        if (!towrite) {
+            break;
+        }
+
+        qemu_put_buffer(f, qsb->iov[cur_iov].iov_base, towrite);
+    }
+}
+
 static const QEMUFileOps buf_read_ops = {
     .get_buffer = buf_get_buffer,
     .close =      buf_close,
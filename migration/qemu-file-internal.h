@@ -31,6 +31,12 @@
 #define IO_BUF_SIZE 32768
 #define MAX_IOV_SIZE MIN(IOV_MAX, 64)
 
+/*
+ * Buffers that f->buf cycles through once it is sent without copying.
+ * One is only written to again when the sends from it have completed.
+ */
+#define ZEROCOPY_BUFS 16
+
 struct QEMUFile {
     const QEMUFileOps *ops;
     void *opaque;
@@ -42,11 +48,18 @@ struct QEMUFile {
                     when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
+    uint8_t *buf; /* io_buf, or one of zerocopy_bufs */
+    uint8_t io_buf[IO_BUF_SIZE];
 
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
 
+    bool zerocopy;
+    /* zerocopy_bufs[0] is io_buf; marks are taken after each send */
+    uint8_t *zerocopy_bufs[ZEROCOPY_BUFS];
+    uint32_t zerocopy_marks[ZEROCOPY_BUFS];
+    unsigned int zerocopy_cur;
+
     int last_error;
 };
 
@@ -29,12 +29,182 @@
 #include "qemu/coroutine.h"
 #include "migration/qemu-file.h"
 #include "migration/qemu-file-internal.h"
+#include "trace.h"
+
+#ifdef CONFIG_LINUX
+#include <linux/errqueue.h>
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define CONFIG_MSG_ZEROCOPY
+#endif
+#endif
 
 typedef struct QEMUFileSocket {
     int fd;
     QEMUFile *file;
+    /* MSG_ZEROCOPY sends issued and completions received */
+    uint32_t zerocopy_queued;
+    uint32_t zerocopy_done;
+    /* completions for which the kernel fell back to copying */
+    uint64_t zerocopy_copied;
+    bool zerocopy;
 } QEMUFileSocket;
 
+#ifdef CONFIG_MSG_ZEROCOPY
+/*
+ * Read MSG_ZEROCOPY completions from the socket error queue.  If @wait,
+ * do not return before the sends issued before @mark have completed.
+ */
+static int socket_zerocopy_reap(QEMUFileSocket *s, uint32_t mark, bool wait)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    GPollFD pfd;
+    int err;
+
+    while ((int32_t)(mark - s->zerocopy_done) > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(s->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -errno;
+            }
+            if (!wait) {
+                break;
+            }
+            /* The error queue is signalled as POLLERR */
+            pfd.fd = s->fd;
+            pfd.events = G_IO_ERR;
+            pfd.revents = 0;
+            TFR(err = g_poll(&pfd, 1, -1 /* no timeout */));
+            if (pfd.revents & G_IO_HUP) {
+                return -EPIPE;
+            }
+            continue;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm || !((cm->cmsg_level == SOL_IP &&
+                      cm->cmsg_type == IP_RECVERR) ||
+                     (cm->cmsg_level == SOL_IPV6 &&
+                      cm->cmsg_type == IPV6_RECVERR))) {
+            return -EIO;
+        }
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            return serr->ee_errno ? -serr->ee_errno : -EIO;
+        }
+        if (serr->ee_errno) {
+            return -serr->ee_errno;
+        }
+
+        /* [ee_info, ee_data] is the range of completed sends */
+        s->zerocopy_done += serr->ee_data - serr->ee_info + 1;
+        if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+            s->zerocopy_copied += serr->ee_data - serr->ee_info + 1;
+        }
+    }
+    return 0;
+}
+
+static int socket_enable_zerocopy(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    int one = 1;
+
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        return -errno;
+    }
+    s->zerocopy = true;
+    return 0;
+}
+
+/*
+ * Like socket_writev_buffer, but the kernel sends straight from the
+ * iov buffers; they stay referenced until socket_wait_zerocopy.
+ */
+static ssize_t socket_writev_zerocopy(void *opaque, struct iovec *iov,
+                                      int iovcnt, int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    unsigned int cnt = iovcnt;
+    ssize_t size = iov_size(iov, iovcnt);
+    ssize_t offset = 0;
+    struct msghdr msg;
+    ssize_t len;
+    GPollFD pfd;
+    int err;
+
+    while (size > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        len = sendmsg(s->fd, &msg, MSG_ZEROCOPY);
+        if (len > 0) {
+            s->zerocopy_queued++;
+            size -= len;
+            offset += len;
+            iov_discard_front(&iov, &cnt, len);
+            continue;
+        }
+
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0 && errno == ENOBUFS) {
+            /* Too much memory pinned for this socket */
+            err = socket_zerocopy_reap(s, s->zerocopy_queued, true);
+            if (err < 0) {
+                return err;
+            }
+            continue;
+        }
+        if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            error_report("socket_writev_zerocopy: Got err=%d for (%zu/%zu)",
+                         errno, (size_t)size, (size_t)len);
+            return -errno;
+        }
+
+        /* Emulate blocking, completions also wake us up */
+        err = socket_zerocopy_reap(s, s->zerocopy_queued, false);
+        if (err < 0) {
+            return err;
+        }
+        pfd.fd = s->fd;
+        pfd.events = G_IO_OUT | G_IO_ERR;
+        pfd.revents = 0;
+        TFR(err = g_poll(&pfd, 1, -1 /* no timeout */));
+    }
+
+    return offset;
+}
+
+/* Marks count the MSG_ZEROCOPY sends, whose completions come in order */
+static uint32_t socket_mark_zerocopy(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+
+    return s->zerocopy_queued;
+}
+
+static int socket_wait_zerocopy(void *opaque, uint32_t mark)
+{
+    QEMUFileSocket *s = opaque;
+    int ret;
+
+    ret = socket_zerocopy_reap(s, mark, true);
+    trace_qemu_file_zerocopy_wait(mark, s->zerocopy_done, s->zerocopy_copied);
+    return ret;
+}
+#endif
+
 static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                                     int64_t pos)
 {
@@ -65,6 +235,16 @@ static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                 return -errno;
             }
 
+#ifdef CONFIG_MSG_ZEROCOPY
+            /* Pending completions would make g_poll return right away */
+            if (s->zerocopy) {
+                err = socket_zerocopy_reap(s, s->zerocopy_queued, false);
+                if (err < 0) {
+                    return err;
+                }
+            }
+#endif
+
             /* Emulate blocking */
             GPollFD pfd;
 
@@ -300,7 +480,13 @@ static const QEMUFileOps socket_write_ops = {
     .writev_buffer   = socket_writev_buffer,
     .close           = socket_close,
     .shut_down       = socket_shutdown,
-    .get_return_path = socket_get_return_path
+    .get_return_path = socket_get_return_path,
+#ifdef CONFIG_MSG_ZEROCOPY
+    .enable_zerocopy = socket_enable_zerocopy,
+    .writev_zerocopy = socket_writev_zerocopy,
+    .mark_zerocopy   = socket_mark_zerocopy,
+    .wait_zerocopy   = socket_wait_zerocopy,
+#endif
 };
 
 QEMUFile *qemu_fopen_socket(int fd, const char *mode)
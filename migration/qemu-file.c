@@ -77,6 +77,7 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+    f->buf = f->io_buf;
     return f;
 }
 
@@ -104,6 +105,37 @@ bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer || f->ops->put_buffer;
 }
 
+/*
+ * Write out the iovec of a zero-copy QEMUFile in one go, f->buf included.
+ * The transport still reads f->buf after that, so the QEMUFile moves on
+ * to the next of its buffers, waiting for the sends from it to complete.
+ */
+static ssize_t qemu_fflush_zerocopy(QEMUFile *f)
+{
+    unsigned int next;
+    ssize_t ret;
+    int err;
+
+    if (f->iovcnt == 0) {
+        return 0;
+    }
+
+    ret = f->ops->writev_zerocopy(f->opaque, f->iov, f->iovcnt, f->pos);
+    if (ret < 0) {
+        return ret;
+    }
+
+    f->zerocopy_marks[f->zerocopy_cur] = f->ops->mark_zerocopy(f->opaque);
+    next = (f->zerocopy_cur + 1) % ZEROCOPY_BUFS;
+    err = f->ops->wait_zerocopy(f->opaque, f->zerocopy_marks[next]);
+    if (err < 0) {
+        return err;
+    }
+    f->zerocopy_cur = next;
+    f->buf = f->zerocopy_bufs[next];
+    return ret;
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -118,7 +150,9 @@ void qemu_fflush(QEMUFile *f)
         return;
     }
 
-    if (f->ops->writev_buffer) {
+    if (f->zerocopy) {
+        ret = qemu_fflush_zerocopy(f);
+    } else if (f->ops->writev_buffer) {
         if (f->iovcnt > 0) {
             ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
         }
@@ -252,6 +286,112 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account for @size bytes that were written to the underlying file
+ * descriptor behind the QEMUFile's back (e.g. with pwrite), so that
+ * rate limiting still sees them.
+ */
+void qemu_file_credit_transfer(QEMUFile *f, size_t size)
+{
+    f->bytes_xfer += size;
+}
+
+/*
+ * Send the buffers passed to qemu_put_buffer_async without copying
+ * them, if the transport supports it.  They are then read by the
+ * transport at some point after the QEMUFile is flushed, so the
+ * caller must keep them mapped until qemu_file_flush_zerocopy().
+ * Content changes are fine for guest RAM: a page written in the
+ * meantime is dirty and will be sent again.
+ * The rest of the stream is sent from f->buf in the same system call,
+ * so each flush costs one send whatever the mix of pages and headers.
+ */
+int qemu_file_enable_zerocopy(QEMUFile *f)
+{
+    uint32_t mark;
+    int i, ret;
+
+    if (f->zerocopy) {
+        return 0;
+    }
+    if (!f->ops->enable_zerocopy || !f->ops->writev_zerocopy ||
+        !f->ops->mark_zerocopy || !f->ops->wait_zerocopy) {
+        return -ENOTSUP;
+    }
+    qemu_fflush(f);
+    ret = f->ops->enable_zerocopy(f->opaque);
+    if (ret) {
+        return ret;
+    }
+
+    mark = f->ops->mark_zerocopy(f->opaque);
+    f->zerocopy_bufs[0] = f->io_buf;
+    for (i = 0; i < ZEROCOPY_BUFS; i++) {
+        if (i) {
+            f->zerocopy_bufs[i] = g_malloc(IO_BUF_SIZE);
+        }
+        f->zerocopy_marks[i] = mark;
+    }
+    f->zerocopy_cur = 0;
+    f->zerocopy = true;
+    return 0;
+}
+
+/*
+ * Flush the QEMUFile and wait until the transport is done with every
+ * buffer sent without copying.
+ */
+int qemu_file_flush_zerocopy(QEMUFile *f)
+{
+    int ret;
+
+    qemu_fflush(f);
+    if (!f->zerocopy || f->last_error) {
+        return f->last_error;
+    }
+    ret = f->ops->wait_zerocopy(f->opaque,
+                                f->ops->mark_zerocopy(f->opaque));
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
+/*
+ * Move the stream to absolute offset @pos of the underlying file.
+ * Pending writes are flushed and buffered reads are discarded first.
+ * Only meaningful for QEMUFiles backed by a seekable file descriptor.
+ *
+ * Returns 0 on success or a negative errno, which is also latched as
+ * the file's error.
+ */
+int qemu_file_seek(QEMUFile *f, int64_t pos)
+{
+    int fd = qemu_get_fd(f);
+    int ret;
+
+    if (fd < 0) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+
+    qemu_fflush(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    f->buf_index = 0;
+    f->buf_size = 0;
+    if (lseek(fd, pos, SEEK_SET) < 0) {
+        ret = -errno;
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    f->pos = pos;
+    return 0;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -262,7 +402,7 @@ void qemu_update_position(QEMUFile *f, size_t size)
  */
 int qemu_fclose(QEMUFile *f)
 {
-    int ret;
+    int ret, i;
     qemu_fflush(f);
     ret = qemu_file_get_error(f);
 
@@ -278,6 +418,10 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    /* The kernel keeps its own references to pages it has not sent yet */
+    for (i = 1; i < ZEROCOPY_BUFS; i++) {
+        g_free(f->zerocopy_bufs[i]);
+    }
     g_free(f);
     trace_qemu_file_fclose();
     return ret;
@@ -41,6 +41,21 @@
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/sockets.h"
+#include "qemu/mmap-alloc.h"
+#include "sysemu/balloon.h"
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/* Background snapshots track guest writes with a userfaultfd */
+#if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
+#include <sys/eventfd.h>
+#include <linux/userfaultfd.h>
+#endif
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -66,9 +81,13 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
+/* Alignment of each RAMBlock's page area in a mapped RAM stream */
+#define MAPPED_RAM_ALIGN       (1 * 1024 * 1024)
+
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
     return buffer_find_nonzero_offset(p, size) == size;
@@ -109,7 +128,6 @@ static void XBZRLE_cache_unlock(void)
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
     int64_t ret;
 
     if (new_size < TARGET_PAGE_SIZE) {
@@ -122,16 +140,12 @@ int64_t xbzrle_cache_resize(int64_t new_size)
         if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
             goto out_new_size;
         }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            error_report("Error creating cache");
+        /* keep the cached pages, the migration is likely using them */
+        if (cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) < 0) {
+            error_report("Error resizing cache");
             ret = -1;
             goto out;
         }
-
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
     }
 
 out_new_size:
@@ -151,6 +165,8 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
+    uint64_t xbzrle_cache_hit;
+    double xbzrle_cache_hit_rate;
     uint64_t xbzrle_overflows;
 } AccountingInfo;
 
@@ -211,6 +227,11 @@ double xbzrle_mig_cache_miss_rate(void)
     return acct_info.xbzrle_cache_miss_rate;
 }
 
+double xbzrle_mig_cache_hit_rate(void)
+{
+    return acct_info.xbzrle_cache_hit_rate;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
@@ -235,6 +256,8 @@ struct PageSearchStatus {
     ram_addr_t   offset;
     /* Set once we wrap around */
     bool         complete_round;
+    /* Set if the last page went to a multifd channel, not the main stream */
+    bool         multifd;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -390,6 +413,549 @@ void migrate_compress_threads_create(void)
     }
 }
 
+/* Multifd: RAM pages sent over extra connections
+ *
+ * The migration thread gathers dirty pages of one RAMBlock into packets
+ * and hands each packet to an idle channel, whose thread writes it to
+ * its own socket.  Zero pages and everything else still go through the
+ * main stream.
+ *
+ * A page is sent at most once between two dirty bitmap syncs, so pages
+ * can only be reordered across a sync.  Whenever the bitmap has been
+ * synced, the source sends a SYNC packet on every channel and a
+ * RAM_SAVE_FLAG_MULTIFD_SYNC in the main stream.  On the destination,
+ * the main stream and each receiving thread stop at their sync marker
+ * until all of them have reached it.
+ *
+ * Channel handshake: be32 magic, be32 version, be32 channel id.
+ * Packet: be32 flags, be32 page count; if pages follow, the RAMBlock
+ * idstr (length byte + string), one be64 offset per page, then the
+ * page contents.
+ */
+
+#define MULTIFD_MAGIC           0x11223344U
+#define MULTIFD_VERSION         1
+#define MULTIFD_FLAG_SYNC       (1 << 0)
+#define MULTIFD_PACKET_PAGES    128
+
+typedef struct MultiFDPages {
+    RAMBlock *block;
+    uint32_t num;
+    ram_addr_t offset[MULTIFD_PACKET_PAGES];
+} MultiFDPages;
+
+typedef struct MultiFDSendParams {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;
+    /* posted when there is work for the thread */
+    QemuSemaphore sem;
+    QemuMutex mutex;
+    /* protected by mutex */
+    bool quit;
+    bool pending;
+    bool sync;
+    MultiFDPages pages;
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* counts the channels that have nothing to do */
+    QemuSemaphore sem_idle;
+    /* packet being filled by the migration thread */
+    MultiFDPages pages;
+    /* bitmap_sync_count at the last sync */
+    uint64_t sync_count;
+    int error;
+} *multifd_send_state;
+
+typedef struct MultiFDRecvParams {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;
+    /* posted by the main stream to release the thread from a sync */
+    QemuSemaphore sem_sync_done;
+    bool quit;
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    /* channels accepted so far, out of total */
+    int count;
+    int total;
+    /* used until all channels have been accepted */
+    int listen_fd;
+    QEMUFile *main_file;
+    /* posted by each channel when it reaches a sync */
+    QemuSemaphore sem_sync;
+    int error;
+} *multifd_recv_state;
+
+static void multifd_send_set_error(int error)
+{
+    atomic_cmpxchg(&multifd_send_state->error, 0, error);
+}
+
+static void multifd_send_packet(MultiFDSendParams *p, uint32_t flags)
+{
+    MultiFDPages *pages = &p->pages;
+    size_t len;
+    int i;
+
+    qemu_put_be32(p->file, flags);
+    qemu_put_be32(p->file, pages->num);
+    if (pages->num) {
+        len = strlen(pages->block->idstr);
+        qemu_put_byte(p->file, len);
+        qemu_put_buffer(p->file, (uint8_t *)pages->block->idstr, len);
+        for (i = 0; i < pages->num; i++) {
+            qemu_put_be64(p->file, pages->offset[i]);
+        }
+        for (i = 0; i < pages->num; i++) {
+            qemu_put_buffer_async(p->file,
+                                  pages->block->host + pages->offset[i],
+                                  TARGET_PAGE_SIZE);
+        }
+    }
+    qemu_fflush(p->file);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    int ret;
+
+    for (;;) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+
+        /* The migration thread keeps the RCU read lock, and thus the
+         * RAMBlock, until the channel is idle again.
+         */
+        multifd_send_packet(p, p->sync ? MULTIFD_FLAG_SYNC : 0);
+        if (p->sync) {
+            qemu_file_flush_zerocopy(p->file);
+        }
+        ret = qemu_file_get_error(p->file);
+        if (ret) {
+            multifd_send_set_error(ret);
+        }
+
+        qemu_mutex_lock(&p->mutex);
+        p->pending = false;
+        p->sync = false;
+        p->pages.num = 0;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&multifd_send_state->sem_idle);
+    }
+
+    return NULL;
+}
+
+static int multifd_connect(const char *uri, Error **errp)
+{
+    const char *p;
+
+    if (strstart(uri, "tcp:", &p)) {
+        return inet_connect(p, errp);
+    }
+    if (strstart(uri, "unix:", &p)) {
+        return unix_connect(p, errp);
+    }
+    error_setg(errp, "multifd needs a tcp: or unix: migration URI");
+    return -1;
+}
+
+static void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        /* Unblock a thread stuck writing to an unresponsive peer */
+        qemu_file_shutdown(p->file);
+        qemu_sem_post(&p->sem);
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->file);
+        qemu_sem_destroy(&p->sem);
+        qemu_mutex_destroy(&p->mutex);
+    }
+    qemu_sem_destroy(&multifd_send_state->sem_idle);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/* Called from the migration thread before any page is sent */
+static int multifd_save_setup(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    int i, fd, count = migrate_multifd_channels();
+
+    multifd_send_state = g_new0(typeof(*multifd_send_state), 1);
+    multifd_send_state->params = g_new0(MultiFDSendParams, count);
+    qemu_sem_init(&multifd_send_state->sem_idle, 0);
+
+    for (i = 0; i < count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        char *name;
+
+        fd = multifd_connect(s->uri, errp);
+        if (fd < 0) {
+            error_prepend(errp, "multifd channel %d: ", i);
+            multifd_save_cleanup();
+            return -1;
+        }
+        qemu_set_block(fd);
+
+        p->id = i;
+        p->file = qemu_fopen_socket(fd, "wb");
+        if (migrate_use_zerocopy_send() &&
+            qemu_file_enable_zerocopy(p->file) < 0) {
+            error_setg(errp, "multifd channel %d: zero-copy send is not "
+                       "supported", i);
+            qemu_fclose(p->file);
+            multifd_save_cleanup();
+            return -1;
+        }
+        qemu_put_be32(p->file, MULTIFD_MAGIC);
+        qemu_put_be32(p->file, MULTIFD_VERSION);
+        qemu_put_be32(p->file, i);
+        qemu_fflush(p->file);
+
+        qemu_sem_init(&p->sem, 0);
+        qemu_mutex_init(&p->mutex);
+        name = g_strdup_printf("multifdsend_%d", i);
+        qemu_thread_create(&p->thread, name, multifd_send_thread, p,
+                           QEMU_THREAD_JOINABLE);
+        g_free(name);
+        multifd_send_state->count++;
+        qemu_sem_post(&multifd_send_state->sem_idle);
+    }
+    return 0;
+}
+
+/* Hand the packet being filled to an idle channel */
+static void multifd_send_pages(void)
+{
+    MultiFDSendParams *p = NULL;
+    int i;
+
+    if (!multifd_send_state->pages.num) {
+        return;
+    }
+
+    qemu_sem_wait(&multifd_send_state->sem_idle);
+    for (i = 0; i < multifd_send_state->count; i++) {
+        p = &multifd_send_state->params[i];
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending) {
+            p->pending = true;
+            p->pages = multifd_send_state->pages;
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    assert(i < multifd_send_state->count);
+    multifd_send_state->pages.num = 0;
+    qemu_sem_post(&p->sem);
+}
+
+/* Wait until every channel has written out what it was given, so
+ * that the caller can drop the RCU read lock protecting the RAMBlocks.
+ */
+static void multifd_send_wait_idle(QEMUFile *f)
+{
+    int i, ret;
+
+    multifd_send_pages();
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->sem_idle);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_post(&multifd_send_state->sem_idle);
+    }
+
+    ret = atomic_read(&multifd_send_state->error);
+    if (ret) {
+        qemu_file_set_error(f, ret);
+    }
+}
+
+static int multifd_queue_page(QEMUFile *f, RAMBlock *block,
+                              ram_addr_t offset)
+{
+    MultiFDPages *pages = &multifd_send_state->pages;
+    int ret = atomic_read(&multifd_send_state->error);
+
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+
+    if (pages->num == MULTIFD_PACKET_PAGES ||
+        (pages->num && pages->block != block)) {
+        multifd_send_pages();
+    }
+    pages->block = block;
+    pages->offset[pages->num++] = offset;
+    return 0;
+}
+
+/* Separate the pages sent so far from the ones sent afterwards.  Must
+ * be called before sending any page if the dirty bitmap was synced
+ * since the previous call, and once all pages have been sent.
+ */
+static void multifd_send_sync(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    int i;
+
+    multifd_send_state->sync_count = bitmap_sync_count;
+
+    multifd_send_pages();
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->sem_idle);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->pending = true;
+        p->sync = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    *bytes_transferred += 8;
+}
+
+static int multifd_recv_packet(MultiFDRecvParams *p)
+{
+    uint32_t flags, num, i;
+    uint64_t offsets[MULTIFD_PACKET_PAGES];
+    RAMBlock *block;
+    char id[256];
+    int len, ret;
+
+    flags = qemu_get_be32(p->file);
+    num = qemu_get_be32(p->file);
+    ret = qemu_file_get_error(p->file);
+    if (ret) {
+        return ret;
+    }
+
+    if (flags & MULTIFD_FLAG_SYNC) {
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+        qemu_sem_wait(&p->sem_sync_done);
+        return 0;
+    }
+
+    if (num > MULTIFD_PACKET_PAGES) {
+        error_report("multifd channel %d: packet with %u pages", p->id, num);
+        return -EINVAL;
+    }
+    len = qemu_get_byte(p->file);
+    qemu_get_buffer(p->file, (uint8_t *)id, len);
+    id[len] = 0;
+    for (i = 0; i < num; i++) {
+        offsets[i] = qemu_get_be64(p->file);
+    }
+
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(id);
+    if (!block) {
+        rcu_read_unlock();
+        error_report("multifd channel %d: unknown ramblock \"%s\"",
+                     p->id, id);
+        return -EINVAL;
+    }
+    for (i = 0; i < num; i++) {
+        if (!offset_in_ramblock(block, offsets[i]) ||
+            (offsets[i] & ~TARGET_PAGE_MASK)) {
+            rcu_read_unlock();
+            error_report("multifd channel %d: invalid offset 0x%" PRIx64
+                         " in ramblock \"%s\"", p->id, offsets[i], id);
+            return -EINVAL;
+        }
+        qemu_get_buffer(p->file, block->host + offsets[i], TARGET_PAGE_SIZE);
+    }
+    rcu_read_unlock();
+
+    return qemu_file_get_error(p->file);
+}
+
+/* Read the greeting the source sends at the start of every channel */
+static int multifd_recv_hello(MultiFDRecvParams *p)
+{
+    uint32_t magic, version;
+    int ret;
+
+    magic = qemu_get_be32(p->file);
+    version = qemu_get_be32(p->file);
+    p->id = qemu_get_be32(p->file);
+    ret = qemu_file_get_error(p->file);
+    if (ret) {
+        return ret;
+    }
+    if (magic != MULTIFD_MAGIC || version != MULTIFD_VERSION) {
+        error_report("multifd channel %d: bad magic %x or version %u",
+                     p->id, magic, version);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    int ret;
+
+    rcu_register_thread();
+
+    ret = multifd_recv_hello(p);
+    while (!ret) {
+        ret = multifd_recv_packet(p);
+    }
+    if (!atomic_read(&p->quit)) {
+        atomic_cmpxchg(&multifd_recv_state->error, 0, ret);
+        /* Do not leave the main stream waiting for our sync */
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Main stream reached RAM_SAVE_FLAG_MULTIFD_SYNC */
+static int multifd_recv_sync(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd sync received, but multifd is not enabled");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    if (atomic_read(&multifd_recv_state->error)) {
+        return atomic_read(&multifd_recv_state->error);
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync_done);
+    }
+    return 0;
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        atomic_set(&p->quit, true);
+        qemu_file_shutdown(p->file);
+        qemu_sem_post(&p->sem_sync_done);
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->file);
+        qemu_sem_destroy(&p->sem_sync_done);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+/* Called from the main loop whenever the listening socket is readable */
+static void multifd_accept_channel(void *opaque)
+{
+    int listen_fd = multifd_recv_state->listen_fd;
+    MultiFDRecvParams *p;
+    QEMUFile *f;
+    char *name;
+    int fd;
+
+    do {
+        fd = qemu_accept(listen_fd, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        error_report("could not accept multifd channel: %s",
+                     strerror(errno));
+        qemu_set_fd_handler(listen_fd, NULL, NULL, NULL);
+        closesocket(listen_fd);
+        qemu_fclose(multifd_recv_state->main_file);
+        multifd_load_cleanup();
+        return;
+    }
+    qemu_set_block(fd);
+
+    p = &multifd_recv_state->params[multifd_recv_state->count];
+    p->id = multifd_recv_state->count;
+    p->file = qemu_fopen_socket(fd, "rb");
+    qemu_sem_init(&p->sem_sync_done, 0);
+    name = g_strdup_printf("multifdrecv_%d", p->id);
+    qemu_thread_create(&p->thread, name, multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    g_free(name);
+    multifd_recv_state->count++;
+
+    if (multifd_recv_state->count < multifd_recv_state->total) {
+        return;
+    }
+
+    qemu_set_fd_handler(listen_fd, NULL, NULL, NULL);
+    closesocket(listen_fd);
+    f = multifd_recv_state->main_file;
+    multifd_recv_state->main_file = NULL;
+    process_incoming_migration(f);
+}
+
+/**
+ * multifd_load_start: accept the multifd channels of an incoming migration
+ *
+ * Called once the main connection @f has been accepted on @listen_fd; the
+ * source connects its channels right afterwards.  The channels are accepted
+ * from the main loop as they arrive, so a source that never opens them does
+ * not block the monitor.  Once all of them are there, @listen_fd is closed
+ * and the migration is processed on @f.
+ */
+void multifd_load_start(int listen_fd, QEMUFile *f)
+{
+    int count = migrate_multifd_channels();
+
+    multifd_recv_state = g_new0(typeof(*multifd_recv_state), 1);
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, count);
+    multifd_recv_state->total = count;
+    multifd_recv_state->listen_fd = listen_fd;
+    multifd_recv_state->main_file = f;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+
+    qemu_set_nonblock(listen_fd);
+    qemu_set_fd_handler(listen_fd, multifd_accept_channel, NULL, NULL);
+}
+
 /**
  * save_page_header: Write page header to wire
  *
@@ -499,6 +1065,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         return -1;
     }
 
+    acct_info.xbzrle_cache_hit++;
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
     /* save current buffer into memory */
@@ -600,6 +1167,9 @@ static int64_t bytes_xfer_prev;
 static int64_t num_dirty_pages_period;
 static uint64_t xbzrle_cache_miss_prev;
 static uint64_t iterations_prev;
+/* XBZRLE cache counters at the previous bitmap sync */
+static uint64_t xbzrle_sync_hit_prev;
+static uint64_t xbzrle_sync_miss_prev;
 
 static void migration_bitmap_sync_init(void)
 {
@@ -608,6 +1178,24 @@ static void migration_bitmap_sync_init(void)
     num_dirty_pages_period = 0;
     xbzrle_cache_miss_prev = 0;
     iterations_prev = 0;
+    xbzrle_sync_hit_prev = 0;
+    xbzrle_sync_miss_prev = 0;
+}
+
+/* Hit rate of the XBZRLE cache during the pass over RAM that ends with
+ * the current bitmap sync
+ */
+static void xbzrle_update_hit_rate(void)
+{
+    uint64_t hits = acct_info.xbzrle_cache_hit - xbzrle_sync_hit_prev;
+    uint64_t misses = acct_info.xbzrle_cache_miss - xbzrle_sync_miss_prev;
+
+    if (hits + misses) {
+        acct_info.xbzrle_cache_hit_rate = (double)hits / (hits + misses);
+        trace_xbzrle_cache_hit_rate(bitmap_sync_count, hits, misses);
+    }
+    xbzrle_sync_hit_prev = acct_info.xbzrle_cache_hit;
+    xbzrle_sync_miss_prev = acct_info.xbzrle_cache_miss;
 }
 
 static void migration_bitmap_sync(void)
@@ -620,6 +1208,10 @@ static void migration_bitmap_sync(void)
 
     bitmap_sync_count++;
 
+    if (migrate_use_xbzrle()) {
+        xbzrle_update_hit_rate();
+    }
+
     if (!bytes_xfer_prev) {
         bytes_xfer_prev = ram_bytes_transferred();
     }
@@ -646,6 +1238,9 @@ static void migration_bitmap_sync(void)
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
+        if (cpu_dirty_rate_available()) {
+            cpu_update_dirty_rates(end_time - start_time);
+        }
         if (migrate_auto_converge()) {
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
@@ -715,6 +1310,76 @@ static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return pages;
 }
 
+/* File offset just past the page area that starts at @pages_offset */
+static uint64_t mapped_ram_end(uint64_t pages_offset, ram_addr_t length)
+{
+    return pages_offset + ROUND_UP(length, MAPPED_RAM_ALIGN);
+}
+
+/**
+ * mapped_ram_layout: assign each RAMBlock its page area in the file
+ *
+ * The areas follow the RAM_SAVE_FLAG_MEM_SIZE block list, which is about
+ * to be written at the current position, and are aligned so that the
+ * destination can mmap them.  Called with the RCU read lock held.
+ *
+ * Returns: file offset just past the last page area
+ */
+static uint64_t mapped_ram_layout(QEMUFile *f)
+{
+    RAMBlock *block;
+    uint64_t offset = qemu_ftell(f);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        /* idstr length, idstr, used_length, pages_offset */
+        offset += 1 + strlen(block->idstr) + 8 + 8;
+    }
+
+    offset = ROUND_UP(offset, MAPPED_RAM_ALIGN);
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->pages_offset = offset;
+        offset = mapped_ram_end(offset, block->used_length);
+    }
+    return offset;
+}
+
+/**
+ * ram_save_mapped_page: write a page at its fixed offset in the file
+ *
+ * With mapped RAM every page has a slot at block->pages_offset + offset,
+ * so it is written in place instead of being appended to the stream.
+ * The file starts out sparse, so zero pages can be skipped during the
+ * bulk stage; later they may overwrite non-zero data and are written.
+ *
+ * Returns: Number of pages written (1), or -1 on error.
+ */
+static int ram_save_mapped_page(QEMUFile *f, PageSearchStatus *pss,
+                                uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    uint8_t *p = block->host + pss->offset;
+    ssize_t ret;
+
+    if (ram_bulk_stage && is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        return 1;
+    }
+
+    do {
+        ret = pwrite(qemu_get_fd(f), p, TARGET_PAGE_SIZE,
+                     block->pages_offset + pss->offset);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != TARGET_PAGE_SIZE) {
+        qemu_file_set_error(f, ret < 0 ? -errno : -EIO);
+        return -1;
+    }
+
+    qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+    return 1;
+}
+
 /**
  * ram_save_page: Send the given page to the stream
  *
@@ -737,10 +1402,16 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     ram_addr_t current_addr;
     uint8_t *p;
     int ret;
-    bool send_async = true;
+    /* A background snapshot drops the page's write protection right away */
+    bool send_async = !migrate_use_background_snapshot();
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->offset;
 
+    if (migrate_use_mapped_ram()) {
+        return ram_save_mapped_page(f, pss, bytes_transferred);
+    }
+
+    pss->multifd = false;
     p = block->host + offset;
 
     /* In doubt sent page as normal */
@@ -786,6 +1457,19 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
         }
     }
 
+    if (pages == -1 && migrate_use_multifd()) {
+        if (multifd_queue_page(f, block, pss->offset) < 0) {
+            XBZRLE_cache_unlock();
+            return -1;
+        }
+        /* Accounted here since the channels do not report back */
+        qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        pss->multifd = true;
+        pages = 1;
+        acct_info.norm_pages++;
+    }
+
     /* XBZRLE overflow or normal page */
     if (pages == -1) {
         *bytes_transferred += save_page_header(f, block,
@@ -1034,22 +1718,28 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
 }
 
 /*
- * Helper for 'get_queued_page' - gets a page off the queue
+ * Helper for 'get_queued_page' - gets a page off the queue; explicit
+ * requests from the destination are served before prefetched pages
  *      ms:      MigrationState in
  * *offset:      Used to return the offset within the RAMBlock
  * ram_addr_abs: global offset in the dirty/sent bitmaps
+ * prefetch:     set if the page came off the prefetch queue
  *
  * Returns:      block (or NULL if none available)
  */
 static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
-                              ram_addr_t *ram_addr_abs)
+                              ram_addr_t *ram_addr_abs, bool *prefetch)
 {
     RAMBlock *block = NULL;
+    struct src_page_requests *queue = &ms->src_page_requests;
 
     qemu_mutex_lock(&ms->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&ms->src_page_requests)) {
-        struct MigrationSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&ms->src_page_requests);
+    *prefetch = QSIMPLEQ_EMPTY(queue);
+    if (*prefetch) {
+        queue = &ms->src_page_prefetch;
+    }
+    if (!QSIMPLEQ_EMPTY(queue)) {
+        struct MigrationSrcPageRequest *entry = QSIMPLEQ_FIRST(queue);
         block = entry->rb;
         *offset = entry->offset;
         *ram_addr_abs = (entry->offset + entry->rb->offset) &
@@ -1060,7 +1750,7 @@ static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
             entry->offset += TARGET_PAGE_SIZE;
         } else {
             memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+            QSIMPLEQ_REMOVE_HEAD(queue, next_req);
             g_free(entry);
         }
     }
@@ -1084,10 +1774,10 @@ static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
 {
     RAMBlock  *block;
     ram_addr_t offset;
-    bool dirty;
+    bool dirty, prefetch;
 
     do {
-        block = unqueue_page(ms, &offset, ram_addr_abs);
+        block = unqueue_page(ms, &offset, ram_addr_abs, &prefetch);
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -1107,7 +1797,7 @@ static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
             } else {
                 trace_get_queued_page(block->idstr,
                                       (uint64_t)offset,
-                                      (uint64_t)*ram_addr_abs);
+                                      (uint64_t)*ram_addr_abs, prefetch);
             }
         }
 
@@ -1134,6 +1824,21 @@ static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
     return !!block;
 }
 
+/* Bounds of the window of pages pushed around sequential page requests */
+#define POSTCOPY_PREFETCH_MIN  (64 * 1024)
+#define POSTCOPY_PREFETCH_MAX  (2 * 1024 * 1024)
+
+static void flush_page_requests(struct src_page_requests *queue)
+{
+    struct MigrationSrcPageRequest *mspr, *next_mspr;
+
+    QSIMPLEQ_FOREACH_SAFE(mspr, queue, next_req, next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(queue, next_req);
+        g_free(mspr);
+    }
+}
+
 /**
  * flush_page_queue: Flush any remaining pages in the ram request queue
  *    it should be empty at the end anyway, but in error cases there may be
@@ -1143,19 +1848,96 @@ static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
  */
 void flush_page_queue(MigrationState *ms)
 {
-    struct MigrationSrcPageRequest *mspr, *next_mspr;
     /* This queue generally should be empty - but in the case of a failed
      * migration might have some droppings in.
      */
     rcu_read_lock();
-    QSIMPLEQ_FOREACH_SAFE(mspr, &ms->src_page_requests, next_req, next_mspr) {
-        memory_region_unref(mspr->rb->mr);
-        QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
-        g_free(mspr);
-    }
+    flush_page_requests(&ms->src_page_requests);
+    flush_page_requests(&ms->src_page_prefetch);
     rcu_read_unlock();
 }
 
+/**
+ * ram_save_has_page_requests: true if the destination is waiting on pages
+ *   we have not sent yet; those are sent even when the rate limit is hit.
+ *
+ * ms: MigrationState
+ */
+bool ram_save_has_page_requests(MigrationState *ms)
+{
+    bool pending;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    pending = !QSIMPLEQ_EMPTY(&ms->src_page_requests);
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+
+    return pending;
+}
+
+/*
+ * Work out which pages to push ahead of the background scan after a
+ * request for [start, start + len) of @rb.  A request that follows on
+ * from the previous one (in either direction) is treated as part of a
+ * sequential scan by the guest: the window of pages pushed beyond it
+ * doubles each time, up to POSTCOPY_PREFETCH_MAX.  Anything else resets
+ * the window and drops prefetches that are no longer useful.
+ *
+ * Called with src_page_req_mutex held.
+ * Returns: true and the range in *pf_start/*pf_len if pages should be queued
+ */
+static bool postcopy_prefetch_range(MigrationState *ms, RAMBlock *rb,
+                                    bool same_block, ram_addr_t start,
+                                    ram_addr_t len, ram_addr_t *pf_start,
+                                    ram_addr_t *pf_len)
+{
+    ram_addr_t last_end = ms->last_req_start + ms->last_req_len;
+    ram_addr_t end = start + len;
+    ram_addr_t lo, hi;
+    bool forward, backward;
+
+    forward = same_block && start >= last_end &&
+              start - last_end <= POSTCOPY_PREFETCH_MAX;
+    backward = same_block && end <= ms->last_req_start &&
+               ms->last_req_start - end <= POSTCOPY_PREFETCH_MAX;
+
+    ms->last_req_start = start;
+    ms->last_req_len = len;
+
+    if (!forward && !backward) {
+        flush_page_requests(&ms->src_page_prefetch);
+        ms->prefetch_window = 0;
+        ms->prefetch_lo = ms->prefetch_hi = start;
+        return false;
+    }
+
+    ms->prefetch_window = MIN(MAX(ms->prefetch_window * 2,
+                                  POSTCOPY_PREFETCH_MIN),
+                              POSTCOPY_PREFETCH_MAX);
+    if (forward) {
+        lo = end;
+        hi = MIN(end + ms->prefetch_window, rb->used_length);
+        /* Don't queue again what an earlier request already queued */
+        if (lo >= ms->prefetch_lo && lo < ms->prefetch_hi) {
+            lo = ms->prefetch_hi;
+        }
+    } else {
+        lo = start > ms->prefetch_window ? start - ms->prefetch_window : 0;
+        hi = start;
+        if (hi > ms->prefetch_lo && hi <= ms->prefetch_hi) {
+            hi = ms->prefetch_lo;
+        }
+    }
+    if (lo >= hi) {
+        return false;
+    }
+
+    ms->prefetch_lo = MIN(ms->prefetch_lo, lo);
+    ms->prefetch_hi = MAX(ms->prefetch_hi, hi);
+    *pf_start = lo;
+    *pf_len = hi - lo;
+    return true;
+}
+
 /**
  * Queue the pages for transmission, e.g. a request from postcopy destination
  *   ms: MigrationStatus in which the queue is held
@@ -1168,6 +1950,9 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
                          ram_addr_t start, ram_addr_t len)
 {
     RAMBlock *ramblock;
+    RAMBlock *last_rb = ms->last_req_rb;
+    ram_addr_t pf_start, pf_len;
+    struct MigrationSrcPageRequest *pf_entry = NULL;
 
     rcu_read_lock();
     if (!rbname) {
@@ -1209,9 +1994,27 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&ms->src_page_req_mutex);
     QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    if (postcopy_prefetch_range(ms, ramblock, ramblock == last_rb,
+                                start, len, &pf_start, &pf_len)) {
+        pf_entry = g_malloc0(sizeof(struct MigrationSrcPageRequest));
+        pf_entry->rb = ramblock;
+        pf_entry->offset = pf_start;
+        pf_entry->len = pf_len;
+        memory_region_ref(ramblock->mr);
+        QSIMPLEQ_INSERT_TAIL(&ms->src_page_prefetch, pf_entry, next_req);
+    }
     qemu_mutex_unlock(&ms->src_page_req_mutex);
     rcu_read_unlock();
 
+    if (pf_entry) {
+        trace_ram_save_queue_prefetch(ramblock->idstr, pf_start, pf_len,
+                                      ms->prefetch_window);
+    }
+    /* Don't leave the migration thread asleep on the rate limit */
+    if (atomic_xchg(&ms->rate_limit_waiting, false)) {
+        qemu_sem_post(&ms->rate_limit_sem);
+    }
+
     return 0;
 
 err:
@@ -1219,6 +2022,295 @@ err:
     return -1;
 }
 
+#ifdef UFFDIO_WRITEPROTECT
+/*
+ * Write tracking for background snapshots: guest RAM is registered with
+ * a userfaultfd in write-protect mode.  A guest write to a page that has
+ * not been saved yet blocks, and the fault thread queues the page the
+ * same way postcopy page requests are queued; the migration thread lifts
+ * the protection once it has copied the page into the stream.
+ */
+static struct {
+    int fd;
+    int quit_fd;
+    QemuThread thread;
+    bool active;
+} write_tracking = {
+    .fd = -1,
+    .quit_fd = -1,
+};
+
+/* Opens a userfaultfd that reports write faults, or returns -1 */
+static int ram_write_tracking_open(void)
+{
+    struct uffdio_api api_struct;
+    int ufd;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (ufd == -1) {
+        return -1;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    if (ioctl(ufd, UFFDIO_API, &api_struct) ||
+        !(api_struct.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        close(ufd);
+        return -1;
+    }
+
+    return ufd;
+}
+
+bool ram_write_tracking_available(void)
+{
+    int ufd = ram_write_tracking_open();
+
+    if (ufd < 0) {
+        return false;
+    }
+    close(ufd);
+    return true;
+}
+
+static int ram_block_write_protect(RAMBlock *block)
+{
+    struct uffdio_register reg_struct;
+    struct uffdio_writeprotect wp_struct;
+    volatile uint8_t *host = block->host;
+    ram_addr_t offset;
+
+    if (block->fd >= 0 &&
+        qemu_fd_getpagesize(block->fd) != qemu_host_page_size) {
+        error_report("Background snapshot does not support huge pages "
+                     "(RAMBlock %s)", block->idstr);
+        return -1;
+    }
+
+    /*
+     * Protection only sticks to pages that are mapped; reading maps the
+     * zero page for memory the guest has never touched.
+     */
+    for (offset = 0; offset < block->used_length;
+         offset += qemu_host_page_size) {
+        (void)host[offset];
+    }
+
+    reg_struct.range.start = (uintptr_t)block->host;
+    reg_struct.range.len = block->used_length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(write_tracking.fd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s: userfault register of %s: %s", __func__,
+                     block->idstr, strerror(errno));
+        return -1;
+    }
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+        error_report("%s: RAMBlock %s cannot be write protected", __func__,
+                     block->idstr);
+        return -1;
+    }
+
+    wp_struct.range = reg_struct.range;
+    wp_struct.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+    if (ioctl(write_tracking.fd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        error_report("%s: write protect of %s: %s", __func__,
+                     block->idstr, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Lift the protection from a range once it has been saved */
+static int ram_write_tracking_release(RAMBlock *block, ram_addr_t offset,
+                                      ram_addr_t len)
+{
+    struct uffdio_writeprotect wp_struct;
+
+    if (!write_tracking.active) {
+        return 0;
+    }
+
+    /* Also wakes up anyone blocked writing to the range */
+    wp_struct.range.start = (uintptr_t)block->host + offset;
+    wp_struct.range.len = len;
+    wp_struct.mode = 0;
+    if (ioctl(write_tracking.fd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        int ret = -errno;
+
+        error_report("%s: %s:" RAM_ADDR_FMT ": %s", __func__, block->idstr,
+                     offset, strerror(errno));
+        return ret;
+    }
+
+    return 0;
+}
+
+static void *ram_write_tracking_thread(void *opaque)
+{
+    MigrationState *ms = opaque;
+    struct uffd_msg msg;
+    RAMBlock *rb;
+    ram_addr_t in_raspace, rb_offset;
+    bool failed = true;
+    int ret;
+
+    rcu_register_thread();
+
+    while (true) {
+        struct pollfd pfd[2];
+
+        pfd[0].fd = write_tracking.fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = write_tracking.quit_fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1 /* Wait forever */) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents) {
+            failed = false;
+            break;
+        }
+
+        ret = read(write_tracking.fd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && errno == EAGAIN) {
+                continue;
+            }
+            error_report("%s: Failed to read userfault message", __func__);
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT ||
+            !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            continue;
+        }
+
+        rb = qemu_ram_block_from_host(
+                 (void *)(uintptr_t)msg.arg.pagefault.address,
+                 true, &in_raspace, &rb_offset);
+        if (!rb) {
+            error_report("%s: Fault outside guest: %" PRIx64, __func__,
+                         (uint64_t)msg.arg.pagefault.address);
+            break;
+        }
+
+        rb_offset &= ~(ram_addr_t)(qemu_host_page_size - 1);
+        trace_ram_write_tracking_fault(rb->idstr, rb_offset);
+        if (ram_save_queue_pages(ms, rb->idstr, rb_offset,
+                                 qemu_host_page_size)) {
+            break;
+        }
+    }
+
+    if (failed) {
+        /* Writers would stay blocked; fail the snapshot to release them */
+        qemu_file_set_error(ms->to_dst_file, -EIO);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+int ram_write_tracking_start(MigrationState *ms)
+{
+    RAMBlock *block;
+
+    write_tracking.fd = ram_write_tracking_open();
+    if (write_tracking.fd < 0) {
+        error_report("%s: userfaultfd write protection not available",
+                     __func__);
+        return -1;
+    }
+
+    write_tracking.quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (write_tracking.quit_fd == -1) {
+        error_report("%s: Opening quit_fd: %s", __func__, strerror(errno));
+        goto fail;
+    }
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (ram_block_write_protect(block)) {
+            rcu_read_unlock();
+            goto fail;
+        }
+    }
+    rcu_read_unlock();
+
+    /* A discarded page would be refilled without taking a write fault */
+    qemu_balloon_inhibit(true);
+    write_tracking.active = true;
+    qemu_thread_create(&write_tracking.thread, "snapshot/wp",
+                       ram_write_tracking_thread, ms, QEMU_THREAD_JOINABLE);
+    return 0;
+
+fail:
+    /* Closing the fd drops whatever was registered */
+    close(write_tracking.fd);
+    write_tracking.fd = -1;
+    if (write_tracking.quit_fd != -1) {
+        close(write_tracking.quit_fd);
+        write_tracking.quit_fd = -1;
+    }
+    return -1;
+}
+
+void ram_write_tracking_stop(void)
+{
+    uint64_t tmp64 = 1;
+
+    if (!write_tracking.active) {
+        return;
+    }
+
+    if (write(write_tracking.quit_fd, &tmp64, 8) != 8) {
+        error_report("%s: Failed to notify the fault thread: %s", __func__,
+                     strerror(errno));
+    }
+    qemu_thread_join(&write_tracking.thread);
+
+    /* Unregisters all of RAM and wakes any writer still waiting */
+    close(write_tracking.fd);
+    close(write_tracking.quit_fd);
+    write_tracking.fd = -1;
+    write_tracking.quit_fd = -1;
+    write_tracking.active = false;
+    qemu_balloon_inhibit(false);
+}
+
+#else
+/* No userfaultfd write protection on this host */
+
+bool ram_write_tracking_available(void)
+{
+    return false;
+}
+
+int ram_write_tracking_start(MigrationState *ms)
+{
+    error_report("%s: not supported on this host", __func__);
+    return -1;
+}
+
+void ram_write_tracking_stop(void)
+{
+}
+
+static int ram_write_tracking_release(RAMBlock *block, ram_addr_t offset,
+                                      ram_addr_t len)
+{
+    return 0;
+}
+#endif
+
 /**
  * ram_save_target_page: Save one target page
  *
@@ -1261,9 +2353,10 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
         }
         /* Only update last_sent_block if a block was actually sent; xbzrle
          * might have decided the page was identical so didn't bother writing
-         * to the stream.
+         * to the stream.  Pages sent through multifd carry no header in
+         * the main stream either.
          */
-        if (res > 0) {
+        if (res > 0 && !pss->multifd) {
             last_sent_block = pss->block;
         }
     }
@@ -1307,6 +2400,17 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
         dirty_ram_abs += TARGET_PAGE_SIZE;
     } while (pss->offset & (qemu_host_page_size - 1));
 
+    if (pages) {
+        /* The guest may write to this host page again */
+        int ret = ram_write_tracking_release(pss->block,
+                                             pss->offset - qemu_host_page_size,
+                                             qemu_host_page_size);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            return ret;
+        }
+    }
+
     /* The offset we leave with is the last one we looked at */
     pss->offset -= TARGET_PAGE_SIZE;
     return pages;
@@ -1341,6 +2445,7 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     pss.block = last_seen_block;
     pss.offset = last_offset;
     pss.complete_round = false;
+    pss.multifd = false;
 
     if (!pss.block) {
         pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
@@ -1428,9 +2533,12 @@ static void ram_migration_cleanup(void *opaque)
     struct BitmapRcu *bitmap = migration_bitmap_rcu;
     atomic_rcu_set(&migration_bitmap_rcu, NULL);
     if (bitmap) {
-        memory_global_dirty_log_stop();
+        if (!migrate_use_background_snapshot()) {
+            memory_global_dirty_log_stop();
+        }
         call_rcu(bitmap, migration_bitmap_free, rcu);
     }
+    ram_write_tracking_stop();
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
@@ -1442,6 +2550,8 @@ static void ram_migration_cleanup(void *opaque)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    multifd_save_cleanup();
 }
 
 static void reset_ram_globals(void)
@@ -1885,12 +2995,32 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+    uint64_t pages_end = 0;
 
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
     migration_bitmap_sync_init();
     qemu_mutex_init(&migration_bitmap_mutex);
 
+    if (migrate_use_zerocopy_send()) {
+        int ret = qemu_file_enable_zerocopy(f);
+
+        if (ret < 0) {
+            error_report("Zero-copy send is not supported: %s",
+                         strerror(-ret));
+            return ret;
+        }
+    }
+
+    if (migrate_use_multifd()) {
+        Error *local_err = NULL;
+
+        if (multifd_save_setup(&local_err) < 0) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     if (migrate_use_xbzrle()) {
         XBZRLE_cache_lock();
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
@@ -1945,17 +3075,31 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
+    if (!migrate_use_background_snapshot()) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync();
+    }
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
 
     qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
 
+    if (migrate_use_mapped_ram()) {
+        pages_end = mapped_ram_layout(f);
+    }
+
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if (migrate_use_mapped_ram()) {
+            qemu_put_be64(f, block->pages_offset);
+        }
+    }
+
+    if (migrate_use_mapped_ram()) {
+        /* Resume the stream after the page areas */
+        qemu_file_seek(f, pages_end);
     }
 
     rcu_read_unlock();
@@ -1970,6 +3114,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 
 static int ram_save_iterate(QEMUFile *f, void *opaque)
 {
+    MigrationState *ms = migrate_get_current();
     int ret;
     int i;
     int64_t t0;
@@ -1985,9 +3130,19 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
+    if (migrate_use_multifd() &&
+        multifd_send_state->sync_count != bitmap_sync_count) {
+        multifd_send_sync(f, &bytes_transferred);
+    }
+
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
+    /*
+     * Pages the postcopy destination is blocked on are sent even when we
+     * are over the bandwidth limit; they still count against it.
+     */
+    while ((ret = qemu_file_rate_limit(f)) == 0 ||
+           ram_save_has_page_requests(ms)) {
         int pages;
 
         pages = ram_find_and_save_block(f, false, &bytes_transferred);
@@ -2014,6 +3169,13 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    if (migrate_use_multifd()) {
+        multifd_send_wait_idle(f);
+    }
+    if (migrate_use_zerocopy_send()) {
+        /* Do not let pinned pages and completions pile up */
+        qemu_file_flush_zerocopy(f);
+    }
     rcu_read_unlock();
 
     /*
@@ -2038,12 +3200,18 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     rcu_read_lock();
 
-    if (!migration_in_postcopy(migrate_get_current())) {
+    /* A background snapshot saves each page once, as it was at the start */
+    if (!migration_in_postcopy(migrate_get_current()) &&
+        !migrate_use_background_snapshot()) {
         migration_bitmap_sync();
     }
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
+    if (migrate_use_multifd()) {
+        multifd_send_sync(f, &bytes_transferred);
+    }
+
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
@@ -2058,6 +3226,14 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    if (migrate_use_multifd()) {
+        /* Everything must be in place before the devices are loaded */
+        multifd_send_sync(f, &bytes_transferred);
+        multifd_send_wait_idle(f);
+    }
+    if (migrate_use_zerocopy_send()) {
+        qemu_file_flush_zerocopy(f);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2076,6 +3252,7 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
     remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
 
     if (!migration_in_postcopy(migrate_get_current()) &&
+        !migrate_use_background_snapshot() &&
         remaining_size < max_size) {
         qemu_mutex_lock_iothread();
         rcu_read_lock();
@@ -2408,6 +3585,68 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/**
+ * ram_load_mapped_block: populate a RAMBlock from its page area in the file
+ *
+ * Anonymous RAM is replaced by a private mapping of the file, so restore
+ * costs no copying and pages are faulted in as the guest touches them.
+ * Blocks backed by their own file (e.g. hugetlbfs) are read in instead.
+ *
+ * Returns: 0 on success, negative errno on failure
+ */
+static int ram_load_mapped_block(QEMUFile *f, RAMBlock *block,
+                                 uint64_t pages_offset)
+{
+    int fd = qemu_get_fd(f);
+    uint64_t done = 0;
+    ssize_t ret;
+
+    if (fd < 0) {
+        error_report("Mapped RAM needs a file-backed migration stream");
+        return -EINVAL;
+    }
+
+    if (block->fd < 0 && block->host &&
+        QEMU_IS_ALIGNED(block->used_length, getpagesize()) &&
+        QEMU_IS_ALIGNED(pages_offset, getpagesize())) {
+        void *addr = mmap(block->host, block->used_length,
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                          fd, pages_offset);
+        if (addr != MAP_FAILED) {
+            /* The new mapping lost the hugepage, dontdump and dontfork
+             * advice of the anonymous memory it replaced.
+             */
+            qemu_ram_block_advise(block, 0, block->used_length);
+            trace_ram_load_mapped_block(block->idstr, pages_offset,
+                                        block->used_length, 1);
+            return 0;
+        }
+        /* block->host is still intact, fall back to reading */
+    }
+
+    while (done < block->used_length) {
+        ret = pread(fd, block->host + done, block->used_length - done,
+                    pages_offset + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            error_report("Failed to read ramblock \"%s\": %s",
+                         block->idstr, strerror(errno));
+            return -errno;
+        }
+        if (ret == 0) {
+            /* Past the end of a sparse file: the rest is zero */
+            memset(block->host + done, 0, block->used_length - done);
+            break;
+        }
+        done += ret;
+    }
+    trace_ram_load_mapped_block(block->idstr, pages_offset,
+                                block->used_length, 0);
+    return 0;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
@@ -2438,6 +3677,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
+        uint64_t pages_end;
         void *host = NULL;
         uint8_t ch;
 
@@ -2461,15 +3701,22 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         case RAM_SAVE_FLAG_MEM_SIZE:
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
+            pages_end = 0;
             while (!ret && total_ram_bytes) {
                 RAMBlock *block;
                 char id[256];
                 ram_addr_t length;
+                uint64_t pages_offset = 0;
 
                 len = qemu_get_byte(f);
                 qemu_get_buffer(f, (uint8_t *)id, len);
                 id[len] = 0;
                 length = qemu_get_be64(f);
+                if (migrate_use_mapped_ram()) {
+                    pages_offset = qemu_get_be64(f);
+                    pages_end = MAX(pages_end,
+                                    mapped_ram_end(pages_offset, length));
+                }
 
                 block = qemu_ram_block_by_name(id);
                 if (block) {
@@ -2482,6 +3729,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             error_report_err(local_err);
                         }
                     }
+                    if (!ret && migrate_use_mapped_ram()) {
+                        ret = ram_load_mapped_block(f, block, pages_offset);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -2492,6 +3742,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && migrate_use_mapped_ram()) {
+                ret = qemu_file_seek(f, pages_end);
+            }
             break;
 
         case RAM_SAVE_FLAG_COMPRESS:
@@ -2521,6 +3774,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
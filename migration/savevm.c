@@ -47,6 +47,7 @@
 #include "trace.h"
 #include "qemu/bitops.h"
 #include "qemu/iov.h"
+#include "qemu/rcu.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
 #include "qemu/cutils.h"
@@ -263,12 +264,22 @@ typedef struct SaveStateEntry {
     int is_ram;
 } SaveStateEntry;
 
+/* Time spent saving one section while the guest was stopped */
+typedef struct SaveStateTime {
+    char *idstr;
+    int instance_id;
+    int64_t time_ns;
+    bool parallel;
+} SaveStateTime;
+
 typedef struct SaveState {
     QTAILQ_HEAD(, SaveStateEntry) handlers;
     int global_section_id;
     bool skip_configuration;
     uint32_t len;
     const char *name;
+    /* SaveStateTime of each section completed, in stream order */
+    GArray *section_times;
 } SaveState;
 
 static SaveState savevm_state = {
@@ -690,6 +701,7 @@ static void save_section_header(QEMUFile *f, SaveStateEntry *se,
     qemu_put_be32(f, se->section_id);
 
     if (section_type == QEMU_VM_SECTION_FULL ||
+        section_type == QEMU_VM_SECTION_SIZED ||
         section_type == QEMU_VM_SECTION_START) {
         /* ID string */
         size_t len = strlen(se->idstr);
@@ -761,7 +773,6 @@ void qemu_savevm_send_open_return_path(QEMUFile *f)
  */
 int qemu_savevm_send_packaged(QEMUFile *f, const QEMUSizedBuffer *qsb)
 {
-    size_t cur_iov;
     size_t len = qsb_get_length(qsb);
     uint32_t tmp;
 
@@ -776,18 +787,8 @@ int qemu_savevm_send_packaged(QEMUFile *f, const QEMUSizedBuffer *qsb)
     trace_qemu_savevm_send_packaged();
     qemu_savevm_command_send(f, MIG_CMD_PACKAGED, 4, (uint8_t *)&tmp);
 
-    /* all the data follows (concatinating the iov's) */
-    for (cur_iov = 0; cur_iov < qsb->n_iov; cur_iov++) {
-        /* The iov entries are partially filled */
-        size_t towrite = MIN(qsb->iov[cur_iov].iov_len, len);
-        len -= towrite;
-
-        if (!towrite) {
-            break;
-        }
-
-        qemu_put_buffer(f, qsb->iov[cur_iov].iov_base, towrite);
-    }
+    /* all the data follows */
+    qemu_put_qsb(f, qsb);
 
     return 0;
 }
@@ -896,6 +897,206 @@ void qemu_savevm_state_header(QEMUFile *f)
 
 }
 
+static void savevm_reset_section_times(void)
+{
+    guint i;
+
+    if (!savevm_state.section_times) {
+        savevm_state.section_times = g_array_new(false, false,
+                                                 sizeof(SaveStateTime));
+    }
+    for (i = 0; i < savevm_state.section_times->len; i++) {
+        g_free(g_array_index(savevm_state.section_times, SaveStateTime,
+                             i).idstr);
+    }
+    g_array_set_size(savevm_state.section_times, 0);
+}
+
+static void savevm_record_section_time(SaveStateEntry *se, int64_t time_ns,
+                                       bool parallel)
+{
+    SaveStateTime t = {
+        .idstr = g_strdup(se->idstr),
+        .instance_id = se->instance_id,
+        .time_ns = time_ns,
+        .parallel = parallel,
+    };
+
+    trace_savevm_section_time(se->idstr, se->instance_id, time_ns / 1000,
+                              parallel);
+    if (savevm_state.section_times) {
+        g_array_append_val(savevm_state.section_times, t);
+    } else {
+        g_free(t.idstr);
+    }
+}
+
+DeviceDowntimeList *qemu_savevm_device_downtime(void)
+{
+    DeviceDowntimeList *head = NULL, **tail = &head;
+    guint i;
+
+    if (!savevm_state.section_times) {
+        return NULL;
+    }
+    for (i = 0; i < savevm_state.section_times->len; i++) {
+        SaveStateTime *t = &g_array_index(savevm_state.section_times,
+                                          SaveStateTime, i);
+        DeviceDowntimeList *entry = g_new0(DeviceDowntimeList, 1);
+
+        entry->value = g_new0(DeviceDowntime, 1);
+        entry->value->name = g_strdup(t->idstr);
+        entry->value->instance_id = t->instance_id;
+        entry->value->time = t->time_ns / 1000;
+        entry->value->parallel = t->parallel;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+/*
+ * Worker threads that save or load the fields of sections whose
+ * VMStateDescription is marked 'parallel'.  The migration thread holds
+ * the iothread lock on their behalf and runs the pre/post hooks itself.
+ */
+#define VMSTATE_WORKER_THREADS 8
+
+typedef struct VMStateJob {
+    SaveStateEntry *se;
+    int version_id;
+    bool load;
+    /* Buffer the section is saved to, or loaded from */
+    QEMUFile *f;
+    QEMUSizedBuffer *qsb;
+    QJSON *vmdesc;
+    int64_t time_ns;
+    int ret;
+    QSIMPLEQ_ENTRY(VMStateJob) next;
+} VMStateJob;
+
+typedef struct VMStateWorkers {
+    QemuThread threads[VMSTATE_WORKER_THREADS];
+    int nr_threads;
+    QemuMutex lock;
+    QemuCond job_cond;
+    QemuCond done_cond;
+    QSIMPLEQ_HEAD(, VMStateJob) jobs;
+    int outstanding;
+    bool quit;
+} VMStateWorkers;
+
+static void vmstate_job_run(VMStateJob *job)
+{
+    const VMStateDescription *vmsd = job->se->vmsd;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (job->load) {
+        trace_vmstate_load(job->se->idstr, vmsd->name);
+        job->ret = vmstate_load_state_fields(job->f, vmsd, job->se->opaque,
+                                             job->version_id);
+        if (!job->ret) {
+            job->ret = qemu_file_get_error(job->f);
+        }
+    } else {
+        trace_vmstate_save(job->se->idstr, vmsd->name);
+        vmstate_save_state_fields(job->f, vmsd, job->se->opaque, job->vmdesc);
+        job->ret = qemu_file_get_error(job->f);
+    }
+    job->time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+}
+
+static void *vmstate_worker_thread(void *opaque)
+{
+    VMStateWorkers *w = opaque;
+    VMStateJob *job;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&w->lock);
+    while (true) {
+        while (QSIMPLEQ_EMPTY(&w->jobs) && !w->quit) {
+            qemu_cond_wait(&w->job_cond, &w->lock);
+        }
+        if (QSIMPLEQ_EMPTY(&w->jobs)) {
+            break;
+        }
+        job = QSIMPLEQ_FIRST(&w->jobs);
+        QSIMPLEQ_REMOVE_HEAD(&w->jobs, next);
+        qemu_mutex_unlock(&w->lock);
+
+        vmstate_job_run(job);
+
+        qemu_mutex_lock(&w->lock);
+        if (--w->outstanding == 0) {
+            qemu_cond_signal(&w->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&w->lock);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static VMStateWorkers *vmstate_workers_new(void)
+{
+    VMStateWorkers *w = g_new0(VMStateWorkers, 1);
+    int i;
+
+    qemu_mutex_init(&w->lock);
+    qemu_cond_init(&w->job_cond);
+    qemu_cond_init(&w->done_cond);
+    QSIMPLEQ_INIT(&w->jobs);
+
+    w->nr_threads = VMSTATE_WORKER_THREADS;
+    for (i = 0; i < w->nr_threads; i++) {
+        qemu_thread_create(&w->threads[i], "vmstate", vmstate_worker_thread,
+                           w, QEMU_THREAD_JOINABLE);
+    }
+    return w;
+}
+
+static void vmstate_workers_queue(VMStateWorkers *w, VMStateJob *job)
+{
+    qemu_mutex_lock(&w->lock);
+    QSIMPLEQ_INSERT_TAIL(&w->jobs, job, next);
+    w->outstanding++;
+    qemu_cond_signal(&w->job_cond);
+    qemu_mutex_unlock(&w->lock);
+}
+
+/* Wait until every queued job has completed */
+static void vmstate_workers_wait(VMStateWorkers *w)
+{
+    qemu_mutex_lock(&w->lock);
+    while (w->outstanding) {
+        qemu_cond_wait(&w->done_cond, &w->lock);
+    }
+    qemu_mutex_unlock(&w->lock);
+}
+
+static void vmstate_workers_free(VMStateWorkers *w)
+{
+    int i;
+
+    if (!w) {
+        return;
+    }
+
+    qemu_mutex_lock(&w->lock);
+    w->quit = true;
+    qemu_cond_broadcast(&w->job_cond);
+    qemu_mutex_unlock(&w->lock);
+
+    for (i = 0; i < w->nr_threads; i++) {
+        qemu_thread_join(&w->threads[i]);
+    }
+    qemu_cond_destroy(&w->done_cond);
+    qemu_cond_destroy(&w->job_cond);
+    qemu_mutex_destroy(&w->lock);
+    g_free(w);
+}
+
 void qemu_savevm_state_begin(QEMUFile *f,
                              const MigrationParams *params)
 {
@@ -903,6 +1104,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
     int ret;
 
     trace_savevm_state_begin();
+    savevm_reset_section_times();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops || !se->ops->set_params) {
             continue;
@@ -1031,18 +1233,113 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
+/*
+ * Save the non-iterative sections for x-parallel-device-state: every
+ * section is serialized into its own buffer, the fields of those marked
+ * 'parallel' by the worker threads while this thread saves the others,
+ * and the buffers are then copied to @f in the usual order.  'parallel'
+ * sections are sent as QEMU_VM_SECTION_SIZED so that the destination can
+ * hand them to its own workers without parsing them.
+ */
+static void qemu_savevm_save_devices_parallel(QEMUFile *f, QJSON *vmdesc)
+{
+    VMStateWorkers *workers = NULL;
+    GPtrArray *jobs = g_ptr_array_new();
+    SaveStateEntry *se;
+    VMStateJob *job;
+    int64_t start;
+    guint i;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
+            continue;
+        }
+        if (se->vmsd && !vmstate_save_needed(se->vmsd, se->opaque)) {
+            trace_savevm_section_skip(se->idstr, se->section_id);
+            continue;
+        }
+
+        trace_savevm_section_start(se->idstr, se->section_id);
+
+        job = g_new0(VMStateJob, 1);
+        job->se = se;
+        job->f = qemu_bufopen("w", NULL);
+        job->vmdesc = qjson_new();
+        g_ptr_array_add(jobs, job);
+
+        if (se->vmsd && se->vmsd->parallel) {
+            if (se->vmsd->pre_save) {
+                se->vmsd->pre_save(se->opaque);
+            }
+            if (!workers) {
+                workers = vmstate_workers_new();
+            }
+            vmstate_workers_queue(workers, job);
+        } else {
+            start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            vmstate_save(job->f, se, job->vmdesc);
+            job->time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+            job->ret = qemu_file_get_error(job->f);
+        }
+    }
+
+    if (workers) {
+        vmstate_workers_wait(workers);
+        vmstate_workers_free(workers);
+    }
+
+    for (i = 0; i < jobs->len; i++) {
+        const QEMUSizedBuffer *qsb;
+        bool sized;
+
+        job = g_ptr_array_index(jobs, i);
+        se = job->se;
+        qsb = qemu_buf_get(job->f);
+        sized = se->vmsd && se->vmsd->parallel;
+
+        if (job->ret < 0) {
+            qemu_file_set_error(f, job->ret);
+        } else if (sized && qsb_get_length(qsb) > MAX_VM_SECTION_SIZED_SIZE) {
+            error_report("%s: state of '%s' is too large: %zu", __func__,
+                         se->idstr, qsb_get_length(qsb));
+            qemu_file_set_error(f, -EFBIG);
+        }
+
+        if (!qemu_file_get_error(f)) {
+            json_start_object(vmdesc, NULL);
+            json_prop_str(vmdesc, "name", se->idstr);
+            json_prop_int(vmdesc, "instance_id", se->instance_id);
+            json_append_members(vmdesc, job->vmdesc);
+            json_end_object(vmdesc);
+
+            if (sized) {
+                save_section_header(f, se, QEMU_VM_SECTION_SIZED);
+                qemu_put_be32(f, qsb_get_length(qsb));
+            } else {
+                save_section_header(f, se, QEMU_VM_SECTION_FULL);
+            }
+            qemu_put_qsb(f, qsb);
+            trace_savevm_section_end(se->idstr, se->section_id, job->ret);
+            save_section_footer(f, se);
+            savevm_record_section_time(se, job->time_ns, sized);
+        }
+
+        qemu_fclose(job->f);
+        object_unref(OBJECT(job->vmdesc));
+        g_free(job);
+    }
+    g_ptr_array_free(jobs, true);
+}
+
 void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
 {
-    QJSON *vmdesc;
-    int vmdesc_len;
     SaveStateEntry *se;
+    int64_t start;
     int ret;
     bool in_postcopy = migration_in_postcopy(migrate_get_current());
 
     trace_savevm_state_complete_precopy();
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops ||
             (in_postcopy && se->ops->save_live_complete_postcopy) ||
@@ -1060,7 +1357,10 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         ret = se->ops->save_live_complete_precopy(f, se->opaque);
+        savevm_record_section_time(se, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                   start, false);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
         if (ret < 0) {
@@ -1069,35 +1369,59 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         }
     }
 
-    if (iterable_only) {
-        return;
+    if (!iterable_only) {
+        qemu_savevm_state_complete_devices(f);
     }
+}
+
+/*
+ * Save the state of all non-iterable devices, followed by the end of
+ * stream marker and the vmdesc.  Background snapshots call this on their
+ * own, while the guest is paused at the snapshot point, and send the
+ * iterable sections later.
+ */
+void qemu_savevm_state_complete_devices(QEMUFile *f)
+{
+    QJSON *vmdesc;
+    int vmdesc_len;
+    SaveStateEntry *se;
+    int64_t start;
+    bool in_postcopy = migration_in_postcopy(migrate_get_current());
+
+    cpu_synchronize_all_states();
 
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
     json_start_array(vmdesc, "devices");
-    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+    if (migrate_use_parallel_device_state()) {
+        qemu_savevm_save_devices_parallel(f, vmdesc);
+    } else {
+        QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
 
-        if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
-            continue;
-        }
-        if (se->vmsd && !vmstate_save_needed(se->vmsd, se->opaque)) {
-            trace_savevm_section_skip(se->idstr, se->section_id);
-            continue;
-        }
+            if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
+                continue;
+            }
+            if (se->vmsd && !vmstate_save_needed(se->vmsd, se->opaque)) {
+                trace_savevm_section_skip(se->idstr, se->section_id);
+                continue;
+            }
 
-        trace_savevm_section_start(se->idstr, se->section_id);
+            trace_savevm_section_start(se->idstr, se->section_id);
 
-        json_start_object(vmdesc, NULL);
-        json_prop_str(vmdesc, "name", se->idstr);
-        json_prop_int(vmdesc, "instance_id", se->instance_id);
+            json_start_object(vmdesc, NULL);
+            json_prop_str(vmdesc, "name", se->idstr);
+            json_prop_int(vmdesc, "instance_id", se->instance_id);
 
-        save_section_header(f, se, QEMU_VM_SECTION_FULL);
-        vmstate_save(f, se, vmdesc);
-        trace_savevm_section_end(se->idstr, se->section_id, 0);
-        save_section_footer(f, se);
+            save_section_header(f, se, QEMU_VM_SECTION_FULL);
+            start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            vmstate_save(f, se, vmdesc);
+            savevm_record_section_time(se,
+                    qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start, false);
+            trace_savevm_section_end(se->idstr, se->section_id, 0);
+            save_section_footer(f, se);
 
-        json_end_object(vmdesc);
+            json_end_object(vmdesc);
+        }
     }
 
     if (!in_postcopy) {
@@ -1757,14 +2081,21 @@ static inline bool section_from_powerkvm211(const SaveStateEntry *se,
     return false;
 }
 
-static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+/*
+ * Read the rest of the header of a QEMU_VM_SECTION_START, _FULL or _SIZED
+ * section and register the section.
+ * Returns: 0 with *lep set to the new entry, or to NULL if the section
+ *          is to be skipped; a negative errno on error
+ */
+static int qemu_loadvm_section_header(QEMUFile *f, MigrationIncomingState *mis,
+                                      LoadStateEntry **lep)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
     LoadStateEntry *le;
     char idstr[256];
-    int ret;
+
+    *lep = NULL;
 
     /* Read section start */
     section_id = qemu_get_be32(f);
@@ -1810,10 +2141,25 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     le->version_id = version_id;
     QLIST_INSERT_HEAD(&mis->loadvm_handlers, le, entry);
 
+    *lep = le;
+    return 0;
+}
+
+static int
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+{
+    LoadStateEntry *le;
+    int ret;
+
+    ret = qemu_loadvm_section_header(f, mis, &le);
+    if (ret < 0 || !le) {
+        return ret;
+    }
+
     ret = vmstate_load(f, le->se, le->version_id);
     if (ret < 0) {
         error_report("error while loading state for instance 0x%x of"
-                     " device '%s'", instance_id, idstr);
+                     " device '%s'", le->se->instance_id, le->se->idstr);
         return ret;
     }
     if (!check_section_footer(f, le)) {
@@ -1823,6 +2169,167 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     return 0;
 }
 
+/*
+ * QEMU_VM_SECTION_SIZED sections loaded by the worker threads since the
+ * last section of another kind; their post_load hooks run, in stream
+ * order, once they have all been loaded.
+ */
+typedef struct LoadvmBatch {
+    VMStateWorkers *workers;
+    GPtrArray *jobs;
+} LoadvmBatch;
+
+static void loadvm_job_free(VMStateJob *job)
+{
+    qemu_fclose(job->f);
+    qsb_free(job->qsb);
+    g_free(job);
+}
+
+/*
+ * Wait for the sections of @batch to be loaded and, if @post_load is true,
+ * run their post_load hooks.  Returns: 0 or the first error
+ */
+static int loadvm_batch_wait(LoadvmBatch *batch, bool post_load)
+{
+    VMStateJob *job;
+    int ret = 0;
+    guint i;
+
+    if (!batch->jobs || !batch->jobs->len) {
+        return 0;
+    }
+
+    vmstate_workers_wait(batch->workers);
+    for (i = 0; i < batch->jobs->len; i++) {
+        const VMStateDescription *vmsd;
+
+        job = g_ptr_array_index(batch->jobs, i);
+        vmsd = job->se->vmsd;
+        trace_loadvm_section_time(job->se->idstr, job->se->instance_id,
+                                  job->time_ns / 1000, true);
+        if (!ret && job->ret < 0) {
+            error_report("error while loading state for instance 0x%x of"
+                         " device '%s'", job->se->instance_id,
+                         job->se->idstr);
+            ret = job->ret;
+        }
+        if (!ret && post_load && vmsd->post_load) {
+            ret = vmsd->post_load(job->se->opaque, job->version_id);
+        }
+        loadvm_job_free(job);
+    }
+    g_ptr_array_set_size(batch->jobs, 0);
+
+    return ret;
+}
+
+static int loadvm_batch_finish(LoadvmBatch *batch)
+{
+    return loadvm_batch_wait(batch, true);
+}
+
+/*
+ * Free @batch.  Sections that are still queued belong to a load that
+ * failed, so their post_load hooks are not run.
+ */
+static void loadvm_batch_cleanup(LoadvmBatch *batch)
+{
+    loadvm_batch_wait(batch, false);
+    vmstate_workers_free(batch->workers);
+    if (batch->jobs) {
+        g_ptr_array_free(batch->jobs, true);
+    }
+}
+
+/*
+ * A QEMU_VM_SECTION_SIZED section: the header of a _FULL section, the
+ * length of the device state, the device state and the footer.  With
+ * x-parallel-device-state, sections marked 'parallel' on this side are
+ * loaded by the worker threads; the others are loaded here, after the
+ * previous batch of parallel sections has completed.
+ */
+static int qemu_loadvm_section_sized(QEMUFile *f, MigrationIncomingState *mis,
+                                     LoadvmBatch *batch)
+{
+    const VMStateDescription *vmsd;
+    LoadStateEntry *le;
+    VMStateJob *job;
+    uint8_t *buffer;
+    uint32_t length;
+    int ret;
+
+    ret = qemu_loadvm_section_header(f, mis, &le);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!le) {
+        error_report("%s: section cannot be skipped", __func__);
+        return -EINVAL;
+    }
+
+    length = qemu_get_be32(f);
+    if (length > MAX_VM_SECTION_SIZED_SIZE) {
+        error_report("Unreasonably large state for '%s': %u",
+                     le->se->idstr, length);
+        return -EINVAL;
+    }
+    buffer = g_malloc(length);
+    ret = qemu_get_buffer(f, buffer, length);
+    if (ret != length) {
+        g_free(buffer);
+        error_report("%s: Buffer receive fail ret=%d length=%u",
+                     __func__, ret, length);
+        return (ret < 0) ? ret : -EIO;
+    }
+    if (!check_section_footer(f, le)) {
+        g_free(buffer);
+        return -EINVAL;
+    }
+
+    job = g_new0(VMStateJob, 1);
+    job->se = le->se;
+    job->version_id = le->version_id;
+    job->load = true;
+    job->qsb = qsb_create(buffer, length);
+    g_free(buffer); /* Because qsb_create copies */
+    job->f = qemu_bufopen("r", job->qsb);
+
+    vmsd = le->se->vmsd;
+    if (!migrate_use_parallel_device_state() || !vmsd || !vmsd->parallel ||
+        le->version_id > vmsd->version_id ||
+        le->version_id < vmsd->minimum_version_id) {
+        /* Keep the stream order with respect to the parallel sections */
+        ret = loadvm_batch_finish(batch);
+        if (!ret) {
+            ret = vmstate_load(job->f, le->se, le->version_id);
+        }
+        if (ret < 0) {
+            error_report("error while loading state for instance 0x%x of"
+                         " device '%s'", le->se->instance_id, le->se->idstr);
+        }
+        loadvm_job_free(job);
+        return ret;
+    }
+
+    trace_vmstate_load(le->se->idstr, vmsd->name);
+    if (vmsd->pre_load) {
+        ret = vmsd->pre_load(le->se->opaque);
+        if (ret) {
+            loadvm_job_free(job);
+            return ret;
+        }
+    }
+    if (!batch->workers) {
+        batch->workers = vmstate_workers_new();
+        batch->jobs = g_ptr_array_new();
+    }
+    g_ptr_array_add(batch->jobs, job);
+    vmstate_workers_queue(batch->workers, job);
+
+    return 0;
+}
+
 static int
 qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
 {
@@ -1858,41 +2365,58 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
 
 static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
+    LoadvmBatch batch = { 0 };
     uint8_t section_type;
-    int ret;
+    int ret = 0;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
 
         trace_qemu_loadvm_state_section(section_type);
+        if (section_type != QEMU_VM_SECTION_SIZED) {
+            ret = loadvm_batch_finish(&batch);
+            if (ret < 0) {
+                goto out;
+            }
+        }
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
             ret = qemu_loadvm_section_start_full(f, mis);
             if (ret < 0) {
-                return ret;
+                goto out;
+            }
+            break;
+        case QEMU_VM_SECTION_SIZED:
+            ret = qemu_loadvm_section_sized(f, mis, &batch);
+            if (ret < 0) {
+                goto out;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             ret = qemu_loadvm_section_part_end(f, mis);
             if (ret < 0) {
-                return ret;
+                goto out;
             }
             break;
         case QEMU_VM_COMMAND:
             ret = loadvm_process_command(f);
             trace_qemu_loadvm_state_section_command(ret);
             if ((ret < 0) || (ret & LOADVM_QUIT)) {
-                return ret;
+                goto out;
             }
             break;
         default:
             error_report("Unknown savevm section type %d", section_type);
-            return -EINVAL;
+            ret = -EINVAL;
+            goto out;
         }
     }
 
-    return 0;
+    ret = loadvm_batch_finish(&batch);
+out:
+    loadvm_batch_cleanup(&batch);
+    return ret;
 }
 
 int qemu_loadvm_state(QEMUFile *f)
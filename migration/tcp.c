@@ -59,28 +59,37 @@ static void tcp_accept_incoming_migration(void *opaque)
     socklen_t addrlen = sizeof(addr);
     int s = (intptr_t)opaque;
     QEMUFile *f;
-    int c;
+    int c, err;
 
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
-    } while (c < 0 && errno == EINTR);
+        err = errno;
+    } while (c < 0 && err == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
         error_report("could not accept migration connection (%s)",
-                     strerror(errno));
+                     strerror(err));
+        closesocket(s);
         return;
     }
 
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         error_report("could not qemu_fopen socket");
+        closesocket(s);
         goto out;
     }
 
+    if (migrate_use_multifd()) {
+        /* The source opens its RAM channels right after this one */
+        multifd_load_start(s, f);
+        return;
+    }
+    closesocket(s);
+
     process_incoming_migration(f);
     return;
 
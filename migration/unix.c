@@ -66,22 +66,30 @@ static void unix_accept_incoming_migration(void *opaque)
         err = errno;
     } while (c < 0 && err == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    close(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
         error_report("could not accept migration connection (%s)",
                      strerror(err));
+        close(s);
         return;
     }
 
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         error_report("could not qemu_fopen socket");
+        close(s);
         goto out;
     }
 
+    if (migrate_use_multifd()) {
+        /* The source opens its RAM channels right after this one */
+        multifd_load_start(s, f);
+        return;
+    }
+    close(s);
+
     process_incoming_migration(f);
     return;
 
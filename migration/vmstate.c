@@ -75,6 +75,116 @@ static void *vmstate_base_addr(void *opaque, VMStateField *field, bool alloc)
     return base_addr;
 }
 
+/*
+ * Arrays of plain integers (TCE tables, register files, IRQ state...)
+ * are the largest fields by far.  Rather than calling info->get/put for
+ * every element they are byte-swapped a chunk at a time and moved with
+ * a single buffer operation; the wire format is exactly what the
+ * per-element callbacks produce.
+ */
+#define VMSTATE_BULK_CHUNK 4096
+
+/* Returns the element size if @field can be moved in bulk, 0 otherwise */
+static int vmstate_bulk_width(VMStateField *field)
+{
+    const VMStateInfo *info = field->info;
+    int width;
+
+    if (field->flags & (VMS_STRUCT | VMS_ARRAY_OF_POINTER | VMS_VBUFFER)) {
+        return 0;
+    }
+
+    if (info == &vmstate_info_uint8 || info == &vmstate_info_int8) {
+        width = 1;
+    } else if (info == &vmstate_info_uint16 || info == &vmstate_info_int16) {
+        width = 2;
+    } else if (info == &vmstate_info_uint32 || info == &vmstate_info_int32) {
+        width = 4;
+    } else if (info == &vmstate_info_uint64 || info == &vmstate_info_int64) {
+        width = 8;
+    } else {
+        return 0;
+    }
+
+    return field->size == width ? width : 0;
+}
+
+/* Convert @n elements of @width bytes between host and big endian */
+static void vmstate_bulk_bswap(void *buf, int width, int n)
+{
+#ifndef HOST_WORDS_BIGENDIAN
+    int i;
+
+    switch (width) {
+    case 2:
+        for (i = 0; i < n; i++) {
+            bswap16s((uint16_t *)buf + i);
+        }
+        break;
+    case 4:
+        for (i = 0; i < n; i++) {
+            bswap32s((uint32_t *)buf + i);
+        }
+        break;
+    case 8:
+        for (i = 0; i < n; i++) {
+            bswap64s((uint64_t *)buf + i);
+        }
+        break;
+    }
+#endif
+}
+
+static void vmstate_save_bulk(QEMUFile *f, const uint8_t *src, int width,
+                              int n_elems)
+{
+    uint64_t chunk[VMSTATE_BULK_CHUNK / sizeof(uint64_t)];
+    size_t len = (size_t)n_elems * width;
+
+#ifndef HOST_WORDS_BIGENDIAN
+    if (width > 1) {
+        while (len) {
+            size_t todo = MIN(len, sizeof(chunk));
+
+            /* The source may not be aligned for the swap */
+            memcpy(chunk, src, todo);
+            vmstate_bulk_bswap(chunk, width, todo / width);
+            qemu_put_buffer(f, (uint8_t *)chunk, todo);
+            src += todo;
+            len -= todo;
+        }
+        return;
+    }
+#endif
+    qemu_put_buffer(f, src, len);
+}
+
+static int vmstate_load_bulk(QEMUFile *f, uint8_t *dst, int width,
+                             int n_elems)
+{
+    uint64_t chunk[VMSTATE_BULK_CHUNK / sizeof(uint64_t)];
+    size_t len = (size_t)n_elems * width;
+
+#ifndef HOST_WORDS_BIGENDIAN
+    if (width > 1) {
+        while (len) {
+            size_t todo = MIN(len, sizeof(chunk));
+
+            if (qemu_get_buffer(f, (uint8_t *)chunk, todo) != todo) {
+                break;
+            }
+            vmstate_bulk_bswap(chunk, width, todo / width);
+            memcpy(dst, chunk, todo);
+            dst += todo;
+            len -= todo;
+        }
+        return qemu_file_get_error(f);
+    }
+#endif
+    qemu_get_buffer(f, dst, len);
+    return qemu_file_get_error(f);
+}
+
 static inline bool object_from_powerkvm211(const VMStateDescription *vmsd,
                                            const VMStateField *field,
                                            int version_id)
@@ -103,7 +213,6 @@ static inline bool object_from_powerkvm211(const VMStateDescription *vmsd,
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
-    VMStateField *field = vmsd->fields;
     int ret = 0;
 
     trace_vmstate_load_state(vmsd->name, version_id);
@@ -128,6 +237,27 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             return ret;
         }
     }
+    ret = vmstate_load_state_fields(f, vmsd, opaque, version_id);
+    if (ret != 0) {
+        return ret;
+    }
+    if (vmsd->post_load) {
+        ret = vmsd->post_load(opaque, version_id);
+    }
+    trace_vmstate_load_state_end(vmsd->name, "end", ret);
+    return ret;
+}
+
+/*
+ * Load the fields and subsections of @vmsd, without calling its pre_load
+ * and post_load hooks; the version must already have been checked.
+ */
+int vmstate_load_state_fields(QEMUFile *f, const VMStateDescription *vmsd,
+                              void *opaque, int version_id)
+{
+    VMStateField *field = vmsd->fields;
+    int ret = 0;
+
     while (field->name) {
         trace_vmstate_load_state_field(vmsd->name, field->name);
         if ((field->field_exists &&
@@ -137,6 +267,18 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             void *base_addr = vmstate_base_addr(opaque, field, true);
             int i, n_elems = vmstate_n_elems(opaque, field);
             int size = vmstate_size(opaque, field);
+            int width = n_elems > 1 ? vmstate_bulk_width(field) : 0;
+
+            if (width) {
+                ret = vmstate_load_bulk(f, base_addr, width, n_elems);
+                if (ret < 0 &&
+                    !object_from_powerkvm211(vmsd, field, version_id)) {
+                    qemu_file_set_error(f, ret);
+                    trace_vmstate_load_field_error(field->name, ret);
+                    return ret;
+                }
+                n_elems = 0;
+            }
 
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
@@ -168,15 +310,7 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
         }
         field++;
     }
-    ret = vmstate_subsection_load(f, vmsd, opaque);
-    if (ret != 0) {
-        return ret;
-    }
-    if (vmsd->post_load) {
-        ret = vmsd->post_load(opaque, version_id);
-    }
-    trace_vmstate_load_state_end(vmsd->name, "end", ret);
-    return ret;
+    return vmstate_subsection_load(f, vmsd, opaque);
 }
 
 static int vmfield_name_num(VMStateField *start, VMStateField *search)
@@ -322,11 +456,17 @@ bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque, QJSON *vmdesc)
 {
-    VMStateField *field = vmsd->fields;
-
     if (vmsd->pre_save) {
         vmsd->pre_save(opaque);
     }
+    vmstate_save_state_fields(f, vmsd, opaque, vmdesc);
+}
+
+/* Save the fields and subsections of @vmsd, without calling its pre_save */
+void vmstate_save_state_fields(QEMUFile *f, const VMStateDescription *vmsd,
+                               void *opaque, QJSON *vmdesc)
+{
+    VMStateField *field = vmsd->fields;
 
     if (vmdesc) {
         json_prop_str(vmdesc, "vmsd_name", vmsd->name);
@@ -342,6 +482,15 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
             int size = vmstate_size(opaque, field);
             int64_t old_offset, written_bytes;
             QJSON *vmdesc_loop = vmdesc;
+            int width = n_elems > 1 ? vmstate_bulk_width(field) : 0;
+
+            /* The description of a bulk field is that of a compressed array */
+            if (width && (!vmdesc || vmsd_can_compress(field))) {
+                vmsd_desc_field_start(vmsd, vmdesc, field, 0, n_elems);
+                vmstate_save_bulk(f, base_addr, width, n_elems);
+                vmsd_desc_field_end(vmsd, vmdesc, field, width, 0);
+                n_elems = 0;
+            }
 
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -24,13 +25,24 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+
+/*
+ * The encoder alternates between two scans: the end of a run of equal
+ * bytes (zrun) and the end of a run of different bytes (nzrun).  Only
+ * the scans depend on the vector width; every variant finds the same
+ * run boundaries, so the encoded stream does not depend on the host.
+ */
+typedef int (*xbzrle_scan_fn)(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen);
+
+static inline int xbzrle_encode_common(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen,
+                                       xbzrle_scan_fn zrun_end,
+                                       xbzrle_scan_fn nzrun_end)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, next;
+    uint8_t *nzrun_start;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -41,28 +53,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        next = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = next - i;
+        i = next;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,42 +69,16 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        next = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = next - i;
+        i = next;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -120,12 +87,234 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
 }
 
+static int zrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed */
+    if (!res) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+
+        /* go over the rest */
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+    }
+    return i;
+}
+
+static int nzrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
+                i += sizeof(long);
+            }
+        }
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_long(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_common(old_buf, new_buf, slen, dst, dlen,
+                                zrun_end_long, nzrun_end_long);
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Bit n of the result is set if byte n of both vectors is equal */
+static inline uint32_t xbzrle_eq_mask_sse2(const uint8_t *a, const uint8_t *b)
+{
+    __m128i va = _mm_loadu_si128((const __m128i *)a);
+    __m128i vb = _mm_loadu_si128((const __m128i *)b);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+}
+
+static int zrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    uint32_t ne;
+
+    for (; i + 16 <= slen; i += 16) {
+        ne = ~xbzrle_eq_mask_sse2(old_buf + i, new_buf + i) & 0xffff;
+        if (ne) {
+            return i + ctz32(ne);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int nzrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    uint32_t eq;
+
+    for (; i + 16 <= slen; i += 16) {
+        eq = xbzrle_eq_mask_sse2(old_buf + i, new_buf + i);
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_inner(uint8_t *old_buf, uint8_t *new_buf,
+                                      int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_common(old_buf, new_buf, slen, dst, dlen,
+                                zrun_end_sse2, nzrun_end_sse2);
+}
+#else
+#define xbzrle_encode_buffer_inner xbzrle_encode_buffer_long
+#endif
+
+/*
+ * GCC before version 4.9 has a bug which will cause the target
+ * attribute work incorrectly and failed to compile in some case,
+ * restrict the gcc version to 4.9+ to prevent the failure.
+ */
+
+#if defined CONFIG_AVX2_OPT && QEMU_GNUC_PREREQ(4, 9)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+static inline uint32_t xbzrle_eq_mask_avx2(const uint8_t *a, const uint8_t *b)
+{
+    __m256i va = _mm256_loadu_si256((const __m256i *)a);
+    __m256i vb = _mm256_loadu_si256((const __m256i *)b);
+
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+}
+
+static int zrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    uint32_t ne;
+
+    for (; i + 32 <= slen; i += 32) {
+        ne = ~xbzrle_eq_mask_avx2(old_buf + i, new_buf + i);
+        if (ne) {
+            return i + ctz32(ne);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int nzrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    uint32_t eq;
+
+    for (; i + 32 <= slen; i += 32) {
+        eq = xbzrle_eq_mask_avx2(old_buf + i, new_buf + i);
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_common(old_buf, new_buf, slen, dst, dlen,
+                                zrun_end_avx2, nzrun_end_avx2);
+}
+
+static bool avx2_support(void)
+{
+    int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+
+    return b & bit_AVX2;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen) \
+         __attribute__ ((ifunc("xbzrle_encode_buffer_ifunc")));
+
+static void *xbzrle_encode_buffer_ifunc(void)
+{
+    typeof(xbzrle_encode_buffer) *func = (avx2_support()) ?
+        xbzrle_encode_buffer_avx2 : xbzrle_encode_buffer_inner;
+
+    return func;
+}
+#pragma GCC pop_options
+#else
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_inner(old_buf, new_buf, slen, dst, dlen);
+}
+#endif
+
+/* Portable encoder, for checking the vectorized ones against */
+int xbzrle_encode_buffer_generic(uint8_t *old_buf, uint8_t *new_buf,
+                                 int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_long(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -37,6 +37,9 @@
 #include "hw/mem/pc-dimm.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
+#include "qemu/cutils.h"
+#include "sysemu/kvm.h"
+#include "sysemu/iothread.h"
 
 QemuOptsList qemu_numa_opts = {
     .name = "numa",
@@ -51,6 +54,7 @@ static int max_numa_nodeid; /* Highest specified NUMA node ID, plus one.
                              */
 int nb_numa_nodes;
 NodeInfo numa_info[MAX_NODES];
+static bool numa_affinity_active; /* threads follow their node's memdev */
 
 void numa_set_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node)
 {
@@ -389,6 +393,155 @@ void parse_numa_opts(MachineClass *mc)
     }
 }
 
+/* Memory backend of guest node @node, if it is bound to host nodes */
+static HostMemoryBackend *numa_node_host_backend(int node)
+{
+    HostMemoryBackend *backend;
+
+    if (node < 0 || node >= nb_numa_nodes) {
+        return NULL;
+    }
+    backend = numa_info[node].node_memdev;
+    if (!backend ||
+        find_first_bit(backend->host_nodes, MAX_NODES) == MAX_NODES) {
+        return NULL;
+    }
+    return backend;
+}
+
+#ifdef CONFIG_LINUX
+/* Add the CPUs of host node @host_node to @cpus, returns how many */
+static int numa_add_host_node_cpus(unsigned long host_node, cpu_set_t *cpus)
+{
+    char *path, *contents;
+    const char *p;
+    int count = 0;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%lu/cpulist",
+                           host_node);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_free(path);
+        return 0;
+    }
+    g_free(path);
+
+    /* The list looks like "0-7,16-23" */
+    p = contents;
+    while (*p && *p != '\n') {
+        unsigned long first, last;
+
+        if (qemu_strtoul(p, &p, 10, &first) < 0) {
+            break;
+        }
+        last = first;
+        if (*p == '-' && qemu_strtoul(p + 1, &p, 10, &last) < 0) {
+            break;
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, cpus);
+            count++;
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    g_free(contents);
+    return count;
+}
+#endif
+
+int numa_bind_thread(int thread_id, int node, Error **errp)
+{
+#ifdef CONFIG_LINUX
+    HostMemoryBackend *backend = numa_node_host_backend(node);
+    unsigned long host_node;
+    cpu_set_t cpus;
+    int count = 0;
+
+    if (!backend) {
+        error_setg(errp, "NUMA node %d has no memdev bound to host nodes",
+                   node);
+        return -EINVAL;
+    }
+
+    CPU_ZERO(&cpus);
+    for (host_node = find_first_bit(backend->host_nodes, MAX_NODES);
+         host_node < MAX_NODES;
+         host_node = find_next_bit(backend->host_nodes, MAX_NODES,
+                                   host_node + 1)) {
+        count += numa_add_host_node_cpus(host_node, &cpus);
+    }
+    if (!count) {
+        error_setg(errp, "host nodes backing NUMA node %d have no CPUs",
+                   node);
+        return -EINVAL;
+    }
+
+    if (sched_setaffinity(thread_id, sizeof(cpus), &cpus) < 0) {
+        int ret = -errno;
+
+        error_setg_errno(errp, errno, "cannot bind thread %d to NUMA node %d",
+                         thread_id, node);
+        return ret;
+    }
+    return 0;
+#else
+    error_setg(errp, "binding threads to NUMA nodes is not supported "
+               "on this host");
+    return -ENOTSUP;
+#endif
+}
+
+bool numa_affinity_enabled(void)
+{
+    return numa_affinity_active;
+}
+
+uint16List *numa_get_host_nodes(int node)
+{
+    HostMemoryBackend *backend = numa_node_host_backend(node);
+    uint16List *host_nodes = NULL;
+
+    if (backend) {
+        object_property_get_uint16List(OBJECT(backend), "host-nodes",
+                                       &host_nodes, &error_abort);
+    }
+    return host_nodes;
+}
+
+static int numa_bind_one_iothread(Object *obj, void *opaque)
+{
+    IOThread *iothread;
+
+    iothread = (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD);
+    if (iothread) {
+        iothread_bind_numa_node(iothread);
+    }
+    return 0;
+}
+
+static void numa_bind_vcpus(void)
+{
+    CPUState *cpu;
+    Error *local_err = NULL;
+
+    /* With TCG all vCPUs share one thread, so there is nothing to place */
+    if (!kvm_enabled()) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        if (numa_bind_thread(cpu->thread_id, cpu->numa_node,
+                             &local_err) < 0) {
+            error_reportf_err(local_err, "numa-affinity: CPU %d: ",
+                              cpu->cpu_index);
+            local_err = NULL;
+            continue;
+        }
+        cpu->numa_bound = true;
+    }
+}
+
 void numa_post_machine_init(void)
 {
     CPUState *cpu;
@@ -401,6 +554,13 @@ void numa_post_machine_init(void)
             }
         }
     }
+
+    if (nb_numa_nodes > 0 && machine_numa_affinity(current_machine)) {
+        numa_affinity_active = true;
+        numa_bind_vcpus();
+        object_child_foreach(object_get_objects_root(),
+                             numa_bind_one_iothread, NULL);
+    }
 }
 
 static void allocate_system_memory_nonnuma(MemoryRegion *mr, Object *owner,
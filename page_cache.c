@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, indexed by a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -29,12 +29,24 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* number of pages that can share a set; a page may live in any way
+ * of the set its address hashes to
+ */
+#define CACHE_WAYS 8
+
+/* it_hits saturates here, so that a page that stopped being dirtied
+ * loses its priority within a few cycles
+ */
+#define CACHE_MAX_HITS 63
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    /* number of times the page was found in the cache, decayed by age */
+    unsigned int it_hits;
 };
 
 struct PageCache {
@@ -43,12 +55,40 @@ struct PageCache {
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    /* max_num_items == num_sets * num_ways, both powers of 2 */
+    int64_t num_sets;
+    unsigned int num_ways;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+static CacheItem *cache_alloc_items(int64_t num_items)
 {
+    CacheItem *items;
     int64_t i;
 
+    /* We prefer not to abort if there is no memory */
+    items = g_try_malloc(num_items * sizeof(*items));
+    if (!items) {
+        return NULL;
+    }
+
+    for (i = 0; i < num_items; i++) {
+        items[i].it_data = NULL;
+        items[i].it_age = 0;
+        items[i].it_addr = -1;
+        items[i].it_hits = 0;
+    }
+    return items;
+}
+
+static void cache_set_geometry(PageCache *cache, int64_t num_pages)
+{
+    cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
     PageCache *cache;
 
     if (num_pages <= 0) {
@@ -70,25 +110,18 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_item_age = 0;
-    cache->max_num_items = num_pages;
+    cache_set_geometry(cache, num_pages);
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u pages\n",
+            cache->num_sets, cache->num_ways);
 
-    /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
+    cache->page_cache = cache_alloc_items(cache->max_num_items);
     if (!cache->page_cache) {
         DPRINTF("Failed to allocate cache->page_cache\n");
         g_free(cache);
         return NULL;
     }
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
-    }
-
     return cache;
 }
 
@@ -108,31 +141,82 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first way of the set @address belongs to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
     size_t pos;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache);
+    g_assert(cache->page_cache);
+    g_assert(cache->num_sets);
+
+    pos = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[pos * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    unsigned int way;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (way = 0; way < cache->num_ways; way++) {
+        if (set[way].it_addr == addr) {
+            return &set[way];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Priority of a cached page for staying in the cache: pages that keep
+ * being dirtied are hit at every cycle and score high, while the score
+ * of a page halves for every cycle it has not been used.
+ */
+static unsigned int cache_item_score(const CacheItem *it, uint64_t current_age)
+{
+    uint64_t idle = current_age - it->it_age;
+
+    return idle >= 32 ? 0 : it->it_hits >> idle;
+}
+
+/*
+ * Picks the way of @set that a new page should go to: a free way if
+ * there is one, otherwise the lowest-scoring page that is no longer
+ * fresh.  Returns NULL if every page of the set is fresh.
+ */
+static CacheItem *cache_pick_victim(const PageCache *cache, CacheItem *set,
+                                    uint64_t current_age)
+{
+    CacheItem *victim = NULL;
+    unsigned int way;
 
-    pos = cache_get_cache_pos(cache, addr);
+    for (way = 0; way < cache->num_ways; way++) {
+        CacheItem *it = &set[way];
 
-    return &cache->page_cache[pos];
+        if (!it->it_data) {
+            return it;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            continue;
+        }
+        if (!victim ||
+            cache_item_score(it, current_age) <
+                cache_item_score(victim, current_age) ||
+            (cache_item_score(it, current_age) ==
+                cache_item_score(victim, current_age) &&
+             it->it_age < victim->it_age)) {
+            victim = it;
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -142,8 +226,12 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
+        it->it_hits = cache_item_score(it, current_age);
+        if (it->it_hits < CACHE_MAX_HITS) {
+            it->it_hits++;
+        }
         it->it_age = current_age;
         return true;
     }
@@ -158,12 +246,15 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_pick_victim(cache, cache_get_set(cache, addr),
+                               current_age);
+        if (!it) {
+            return -1;
+        }
+        it->it_hits = 0;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -184,56 +275,66 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
-    PageCache *new_cache;
-    int64_t i;
-
-    CacheItem *old_it, *new_it;
+    CacheItem *old_items, *old_it, *new_it;
+    int64_t i, old_num_items;
+    uint64_t max_age = 0;
 
     g_assert(cache);
 
     /* cache was not inited */
-    if (cache->page_cache == NULL) {
+    if (cache->page_cache == NULL || new_num_pages <= 0) {
         return -1;
     }
 
     /* same size */
-    if (pow2floor(new_num_pages) == cache->max_num_items) {
+    new_num_pages = pow2floor(new_num_pages);
+    if (new_num_pages == cache->max_num_items) {
         return cache->max_num_items;
     }
 
-    new_cache = cache_init(new_num_pages, cache->page_size);
-    if (!(new_cache)) {
+    old_items = cache->page_cache;
+    old_num_items = cache->max_num_items;
+    cache->page_cache = cache_alloc_items(new_num_pages);
+    if (!cache->page_cache) {
         DPRINTF("Error creating new cache\n");
+        cache->page_cache = old_items;
         return -1;
     }
+    cache_set_geometry(cache, new_num_pages);
+    cache->num_items = 0;
+
+    for (i = 0; i < old_num_items; i++) {
+        max_age = MAX(max_age, old_items[i].it_age);
+    }
 
-    /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
-            }
+    /* move all data from old cache; on collision keep the page with the
+     * best score, as cache_insert would
+     */
+    for (i = 0; i < old_num_items; i++) {
+        old_it = &old_items[i];
+        if (!old_it->it_data) {
+            continue;
+        }
+        new_it = cache_pick_victim(cache, cache_get_set(cache, old_it->it_addr),
+                                   max_age + CACHED_PAGE_LIFETIME);
+        if (new_it && new_it->it_data &&
+            cache_item_score(new_it, max_age) >=
+                cache_item_score(old_it, max_age)) {
+            new_it = NULL;
         }
+        if (!new_it) {
+            g_free(old_it->it_data);
+            continue;
+        }
+        if (new_it->it_data) {
+            g_free(new_it->it_data);
+        } else {
+            cache->num_items++;
+        }
+        *new_it = *old_it;
     }
 
-    g_free(cache->page_cache);
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
-
-    g_free(new_cache);
+    g_free(old_items);
 
     return cache->max_num_items;
 }
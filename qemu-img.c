@@ -31,6 +31,7 @@
 #include "qemu/config-file.h"
 #include "qemu/option.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/block-backend.h"
@@ -53,6 +54,10 @@ enum {
     OPTION_BACKING_CHAIN = 257,
     OPTION_OBJECT = 258,
     OPTION_IMAGE_OPTS = 259,
+    OPTION_PATTERN = 260,
+    OPTION_FLUSH_INTERVAL = 261,
+    OPTION_NO_DRAIN = 262,
+    OPTION_DURATION = 263,
 };
 
 typedef enum OutputFormat {
@@ -138,6 +143,10 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' specifies the number of coroutines that copy the image in parallel\n"
+           "       (1 to 16, defaults to 8)\n"
+           "  '-W' allows the parallel coroutines to write out of order; this can\n"
+           "       be faster, but the target must not depend on sequential writes\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -1418,49 +1427,72 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
+#define MAX_COROUTINES 16
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
-    int src_cur, src_num;
-    int64_t src_cur_offset;
+    int src_num;
     int64_t total_sectors;
     int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
     bool target_has_backing;
+    bool wr_in_order;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
 static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
-    int64_t ret;
-    int n;
+    int64_t ret, src_cur_offset;
+    int n, src_cur;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
 
     if (s->sector_next_status <= sector_num) {
         BlockDriverState *file;
-        ret = bdrv_get_block_status(blk_bs(s->src[s->src_cur]),
-                                    sector_num - s->src_cur_offset,
-                                    n, &n, &file);
+
+        /* Without a target backing file we must copy over the contents of
+         * the backing file as well, so look at the whole chain; ranges that
+         * are allocated nowhere read as zeroes. */
+        if (s->target_has_backing) {
+            ret = bdrv_get_block_status(blk_bs(s->src[src_cur]),
+                                        sector_num - src_cur_offset,
+                                        n, &n, &file);
+        } else {
+            ret = bdrv_get_block_status_above(blk_bs(s->src[src_cur]), NULL,
+                                              sector_num - src_cur_offset,
+                                              n, &n, &file);
+        }
         if (ret < 0) {
             return ret;
         }
@@ -1469,15 +1501,8 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
             s->status = BLK_ZERO;
         } else if (ret & BDRV_BLOCK_DATA) {
             s->status = BLK_DATA;
-        } else if (!s->target_has_backing) {
-            /* Without a target backing file we must copy over the contents of
-             * the backing file as well. */
-            /* TODO Check block status of the backing file chain to avoid
-             * needlessly reading zeroes and limiting the iteration to the
-             * buffer size */
-            s->status = BLK_DATA;
         } else {
-            s->status = BLK_BACKING_FILE;
+            s->status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
         }
 
         s->sector_next_status = sector_num + n;
@@ -1503,26 +1528,34 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
 {
-    int n;
-    int ret;
+    int n, ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
 
     assert(nb_sectors <= s->buf_sectors);
     while (nb_sectors > 0) {
         BlockBackend *blk;
-        int64_t bs_sectors;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
          * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
-
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_read(blk, sector_num - s->src_cur_offset, buf, n);
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = blk_co_preadv(blk,
+                            (sector_num - src_cur_offset) << BDRV_SECTOR_BITS,
+                            n << BDRV_SECTOR_BITS, &qiov, 0);
         if (ret < 0) {
             return ret;
         }
@@ -1535,15 +1568,18 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
     int ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1564,7 +1600,7 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
                     break;
                 }
 
-                ret = blk_write_compressed(s->target, sector_num, buf, n);
+                ret = blk_co_write_compressed(s->target, sector_num, buf, n);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1577,7 +1613,12 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_write(s->target, sector_num, buf, n);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_pwritev(s->target, sector_num << BDRV_SECTOR_BITS,
+                                     n << BDRV_SECTOR_BITS, &qiov, 0);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1589,7 +1630,7 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_write_zeroes(s->target, sector_num, n, 0);
+            ret = blk_co_write_zeroes(s->target, sector_num, n, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1604,12 +1645,146 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_do_copy(ImgConvertState *s)
+/*
+ * Record a copy error and wake up the coroutines that wait for their turn to
+ * write, so that they see it and terminate as well.
+ */
+static void coroutine_fn convert_co_fail(ImgConvertState *s, int ret)
+{
+    int i;
+
+    if (s->ret == -EINPROGRESS) {
+        s->ret = ret;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1) {
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+/*
+ * Each of the s->num_coroutines copy coroutines takes the next chunk of the
+ * image, reads it and writes it.  Unless out-of-order writes are allowed, a
+ * coroutine whose read finished early waits until the chunks before its own
+ * have been written.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
 {
+    ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
-    int ret;
-    int n;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            goto out;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            convert_co_fail(s, n);
+            goto out;
+        }
+        /* Save the current sector and status, s->status may change as soon
+         * as another coroutine gets the lock */
+        sector_num = s->sector_num;
+        status = s->status;
+        if (!s->min_sparse && s->status == BLK_ZERO) {
+            n = MIN(n, s->buf_sectors);
+        }
+        /* Other coroutines can already continue reading beyond this chunk */
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                convert_co_fail(s, ret);
+                goto out;
+            }
+        } else if (!s->min_sparse && status == BLK_ZERO) {
+            status = BLK_DATA;
+            memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        /* Another coroutine may have failed while we were reading */
+        if (s->ret != -EINPROGRESS) {
+            goto out;
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            convert_co_fail(s, ret);
+            goto out;
+        }
+
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_add_bytes(n * BDRV_SECTOR_SIZE);
+            qemu_progress_print(100.0 * s->allocated_done /
+                                        s->allocated_sectors, 0);
+        }
+
+        if (s->wr_in_order) {
+            /* Reenter the coroutine that waits for this write to complete.
+             * It cannot be the current one, which has wait_sector_num -1. */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int ret, i, n;
+    int64_t sector_num = 0;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     s->has_zero_init = s->min_sparse && !s->target_has_backing
@@ -1630,21 +1805,17 @@ static int convert_do_copy(ImgConvertState *s)
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
-            ret = -EINVAL;
-            goto fail;
+            return -EINVAL;
         }
         s->buf_sectors = s->cluster_sectors;
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     /* Calculate allocated sectors for progress */
     s->allocated_sectors = 0;
-    sector_num = 0;
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            ret = n;
-            goto fail;
+            return n;
         }
         if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
         {
@@ -1654,61 +1825,31 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     /* Do the copy */
-    s->src_cur = 0;
-    s->src_cur_offset = 0;
     s->sector_next_status = 0;
+    s->ret = -EINPROGRESS;
 
-    sector_num = 0;
-    allocated_done = 0;
-
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
-        {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        if (s->status == BLK_DATA) {
-            ret = convert_read(s, sector_num, n, buf);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64
-                             ": %s", sector_num, strerror(-ret));
-                goto fail;
-            }
-        } else if (!s->min_sparse && s->status == BLK_ZERO) {
-            n = MIN(n, s->buf_sectors);
-            memset(buf, 0, n * BDRV_SECTOR_SIZE);
-            s->status = BLK_DATA;
-        }
-
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    qemu_co_mutex_init(&s->lock);
+    s->running_coroutines = s->num_coroutines;
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i], s);
+    }
 
-        sector_num += n;
+    /* After an error, wait until no coroutine has a request in flight */
+    while (s->running_coroutines) {
+        main_loop_wait(false);
     }
 
-    if (s->compressed) {
+    if (s->compressed && !s->ret) {
         /* signal EOF to align */
         ret = blk_write_compressed(s->target, 0, NULL, 0);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
 
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    return ret;
+    return s->ret;
 }
 
 static int img_convert(int argc, char **argv)
@@ -1736,6 +1877,8 @@ static int img_convert(int argc, char **argv)
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
     bool image_opts = false;
+    bool wr_in_order = true;
+    long num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1751,7 +1894,7 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn",
+        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:W",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1843,6 +1986,18 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        case 'W':
+            wr_in_order = false;
+            break;
         case OPTION_OBJECT:
             opts = qemu_opts_parse_noisily(&qemu_object_opts,
                                            optarg, true);
@@ -1856,6 +2011,12 @@ static int img_convert(int argc, char **argv)
         }
     }
 
+    if (!wr_in_order && compress) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto fail_getopt;
+    }
+
     if (qemu_opts_foreach(&qemu_object_opts,
                           user_creatable_add_opts_foreach,
                           NULL, NULL)) {
@@ -2004,7 +2165,7 @@ static int img_convert(int argc, char **argv)
         const char *preallocation =
             qemu_opt_get(opts, BLOCK_OPT_PREALLOC);
 
-        if (!drv->bdrv_write_compressed) {
+        if (!drv->bdrv_write_compressed && !drv->bdrv_co_write_compressed) {
             error_report("Compression not supported for this file format");
             ret = -1;
             goto out;
@@ -2101,6 +2262,8 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
     };
     ret = convert_do_copy(&state);
 
@@ -3437,6 +3600,560 @@ out_no_progress:
     return 0;
 }
 
+typedef struct BenchData BenchData;
+
+/*
+ * Request latencies are kept in a log-linear histogram: each power of two
+ * is split into 1 << BENCH_HIST_SUB_BITS buckets, so the percentiles are
+ * accurate to about 6% in constant memory however many requests run.
+ */
+#define BENCH_HIST_SUB_BITS 4
+#define BENCH_HIST_SUB      (1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS  ((64 - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB)
+
+typedef struct BenchRequest {
+    BenchData *b;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int64_t start;
+} BenchRequest;
+
+struct BenchData {
+    BlockBackend *blk;
+    uint64_t image_size;
+    bool write;
+    bool random;
+    int bufsize;
+    int step;
+    int nrreq;
+    int64_t count;              /* requests to submit, -1 for no limit */
+    int64_t deadline;           /* in ns, 0 for no limit */
+    uint64_t start_offset;
+    uint64_t offset;            /* next sequential offset */
+    int flush_interval;
+    bool drain_on_flush;
+    GRand *rand;
+
+    BenchRequest *reqs;
+    BenchRequest **free_reqs;
+    int nr_free;
+    int in_flight;
+    int flushes_in_flight;
+    bool in_drain_flush;
+    int writes_since_flush;
+    int64_t submitted;
+    int64_t flushes;
+    bool done;
+
+    uint64_t lat_hist[BENCH_HIST_BUCKETS];
+    int64_t nr_latencies;
+    uint64_t lat_min;
+    uint64_t lat_max;
+    double lat_sum;
+};
+
+static void bench_submit(BenchData *b);
+
+static bool bench_more(BenchData *b)
+{
+    if (b->count >= 0 && b->submitted >= b->count) {
+        return false;
+    }
+    return !b->deadline || get_clock() < b->deadline;
+}
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset;
+
+    if (b->random) {
+        uint64_t nr_blocks = (b->image_size - b->start_offset) / b->bufsize;
+        uint64_t r = ((uint64_t)g_rand_int(b->rand) << 32) |
+                     g_rand_int(b->rand);
+
+        return b->start_offset + (r % nr_blocks) * b->bufsize;
+    }
+
+    offset = b->offset;
+    b->offset += b->step;
+    if (b->offset + b->bufsize > b->image_size) {
+        b->offset = b->start_offset;
+    }
+    return offset;
+}
+
+static int bench_hist_index(uint64_t ns)
+{
+    int shift;
+
+    if (ns < BENCH_HIST_SUB) {
+        return ns;
+    }
+    shift = 63 - clz64(ns) - BENCH_HIST_SUB_BITS;
+    return (shift + 1) * BENCH_HIST_SUB + ((ns >> shift) - BENCH_HIST_SUB);
+}
+
+/* Middle of the latencies that bench_hist_index() maps to @index */
+static double bench_hist_value(int index)
+{
+    int shift = index / BENCH_HIST_SUB - 1;
+    uint64_t low;
+
+    if (shift < 0) {
+        return index;
+    }
+    low = (uint64_t)(index % BENCH_HIST_SUB + BENCH_HIST_SUB) << shift;
+    return low + ((1ULL << shift) - 1) / 2.0;
+}
+
+static void bench_add_latency(BenchData *b, uint64_t ns)
+{
+    if (!b->nr_latencies || ns < b->lat_min) {
+        b->lat_min = ns;
+    }
+    if (ns > b->lat_max) {
+        b->lat_max = ns;
+    }
+    b->lat_sum += ns;
+    b->lat_hist[bench_hist_index(ns)]++;
+    b->nr_latencies++;
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    bench_add_latency(b, get_clock() - req->start);
+
+    b->in_flight--;
+    b->free_reqs[b->nr_free++] = req;
+    bench_submit(b);
+}
+
+static void bench_flush_cb(void *opaque, int ret)
+{
+    BenchData *b = opaque;
+
+    if (ret < 0) {
+        error_report("Failed flush request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    b->flushes_in_flight--;
+    b->in_drain_flush = false;
+    bench_submit(b);
+}
+
+/* Keeps the queue filled; called again whenever a request completes */
+static void bench_submit(BenchData *b)
+{
+    while (!b->in_drain_flush && b->nr_free && bench_more(b)) {
+        BenchRequest *req;
+        BlockAIOCB *acb;
+        uint64_t offset;
+
+        if (b->flush_interval && b->writes_since_flush >= b->flush_interval) {
+            if (b->drain_on_flush) {
+                if (b->in_flight) {
+                    /* The last completion submits the flush */
+                    break;
+                }
+                b->in_drain_flush = true;
+            }
+            b->writes_since_flush = 0;
+            b->flushes++;
+            b->flushes_in_flight++;
+            blk_aio_flush(b->blk, bench_flush_cb, b);
+            continue;
+        }
+
+        req = b->free_reqs[--b->nr_free];
+        offset = bench_next_offset(b);
+        req->start = get_clock();
+        b->in_flight++;
+        b->submitted++;
+
+        if (b->write) {
+            b->writes_since_flush++;
+            acb = blk_aio_writev(b->blk, offset >> BDRV_SECTOR_BITS,
+                                 &req->qiov, b->bufsize >> BDRV_SECTOR_BITS,
+                                 bench_cb, req);
+        } else {
+            acb = blk_aio_readv(b->blk, offset >> BDRV_SECTOR_BITS,
+                                &req->qiov, b->bufsize >> BDRV_SECTOR_BITS,
+                                bench_cb, req);
+        }
+        if (!acb) {
+            error_report("Failed to issue request");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!b->in_flight && !b->flushes_in_flight && !bench_more(b)) {
+        b->done = true;
+    }
+}
+
+/* Percentile of the latencies, in microseconds */
+static double bench_percentile(BenchData *b, double percent)
+{
+    int64_t rank = (int64_t)(percent / 100 * (b->nr_latencies - 1) + 0.5);
+    int64_t seen = 0;
+    double ns = b->lat_max;
+    int i;
+
+    for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        seen += b->lat_hist[i];
+        if (seen > rank) {
+            ns = bench_hist_value(i);
+            break;
+        }
+    }
+    ns = MAX(ns, b->lat_min);
+    ns = MIN(ns, b->lat_max);
+
+    return ns / 1000.0;
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0;
+    const char *fmt = NULL, *filename;
+    const char *cache = BDRV_DEFAULT_CACHE;
+    bool quiet = false;
+    bool image_opts = false;
+    bool is_write = false;
+    bool random = false;
+    int64_t count = -1;
+    int64_t duration = 0;
+    int depth = 64;
+    int64_t offset = 0;
+    size_t bufsize = 4096;
+    int pattern = 0;
+    size_t step = 0;
+    int flush_interval = 0;
+    bool drain_on_flush = true;
+    int64_t image_size;
+    BlockBackend *blk = NULL;
+    BenchData data = {};
+    int flags = 0;
+    bool writethrough;
+    struct timeval t1, t2;
+    double elapsed;
+    int i;
+
+    for (;;) {
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"duration", required_argument, 0, OPTION_DURATION},
+            {"flush-interval", required_argument, 0, OPTION_FLUSH_INTERVAL},
+            {"object", required_argument, 0, OPTION_OBJECT},
+            {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
+            {"pattern", required_argument, 0, OPTION_PATTERN},
+            {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "hc:d:f:no:qrs:S:t:w", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'c':
+        {
+            unsigned long res;
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res <= 0 ||
+                res > INT_MAX) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            count = res;
+            break;
+        }
+        case 'd':
+        {
+            unsigned long res;
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res <= 0 ||
+                res > INT_MAX) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            depth = res;
+            break;
+        }
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'n':
+            flags |= BDRV_O_NATIVE_AIO;
+            break;
+        case 'o':
+        {
+            char *end;
+            errno = 0;
+            offset = qemu_strtosz_suffix(optarg, &end,
+                                         QEMU_STRTOSZ_DEFSUFFIX_B);
+            if (offset < 0 || *end) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        }
+        case 'q':
+            quiet = true;
+            break;
+        case 'r':
+            random = true;
+            break;
+        case 's':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = qemu_strtosz_suffix(optarg, &end, QEMU_STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+
+            bufsize = sval;
+            break;
+        }
+        case 'S':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = qemu_strtosz_suffix(optarg, &end, QEMU_STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end) {
+                error_report("Invalid step size specified");
+                return 1;
+            }
+
+            step = sval;
+            break;
+        }
+        case 't':
+            cache = optarg;
+            break;
+        case 'w':
+            flags |= BDRV_O_RDWR;
+            is_write = true;
+            break;
+        case OPTION_DURATION:
+        {
+            unsigned long res;
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res <= 0 ||
+                res > INT_MAX) {
+                error_report("Invalid duration specified");
+                return 1;
+            }
+            duration = res;
+            break;
+        }
+        case OPTION_FLUSH_INTERVAL:
+        {
+            unsigned long res;
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > INT_MAX) {
+                error_report("Invalid flush interval specified");
+                return 1;
+            }
+            flush_interval = res;
+            break;
+        }
+        case OPTION_NO_DRAIN:
+            drain_on_flush = false;
+            break;
+        case OPTION_PATTERN:
+        {
+            unsigned long res;
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 0xff) {
+                error_report("Invalid pattern byte specified");
+                return 1;
+            }
+            pattern = res;
+            break;
+        }
+        case OPTION_OBJECT: {
+            QemuOpts *opts;
+            opts = qemu_opts_parse_noisily(&qemu_object_opts,
+                                           optarg, true);
+            if (!opts) {
+                return 1;
+            }
+        }   break;
+        case OPTION_IMAGE_OPTS:
+            image_opts = true;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[argc - 1];
+
+    if (qemu_opts_foreach(&qemu_object_opts,
+                          user_creatable_add_opts_foreach,
+                          NULL, NULL)) {
+        return 1;
+    }
+
+    if (!is_write && flush_interval) {
+        error_report("--flush-interval is only available in write tests");
+        ret = -1;
+        goto out;
+    }
+    if (flush_interval && flush_interval < depth) {
+        error_report("Flush interval can't be smaller than depth");
+        ret = -1;
+        goto out;
+    }
+    if ((bufsize | step | offset) & (BDRV_SECTOR_SIZE - 1)) {
+        error_report("Buffer size, step size and offset must be multiples "
+                     "of %d", BDRV_SECTOR_SIZE);
+        ret = -1;
+        goto out;
+    }
+    if (count < 0 && !duration) {
+        count = 75000;
+    }
+
+    ret = bdrv_parse_cache_mode(cache, &flags, &writethrough);
+    if (ret < 0) {
+        error_report("Invalid cache mode: %s", cache);
+        ret = -1;
+        goto out;
+    }
+
+    blk = img_open(image_opts, filename, fmt, flags, writethrough, quiet);
+    if (!blk) {
+        ret = -1;
+        goto out;
+    }
+
+    image_size = blk_getlength(blk);
+    if (image_size < 0) {
+        error_report("Could not get image size: %s", strerror(-image_size));
+        ret = -1;
+        goto out;
+    }
+    if (offset + bufsize > image_size) {
+        error_report("Image is smaller than offset plus buffer size");
+        ret = -1;
+        goto out;
+    }
+
+    data = (BenchData) {
+        .blk            = blk,
+        .image_size     = image_size,
+        .write          = is_write,
+        .random         = random,
+        .bufsize        = bufsize,
+        .step           = step ?: bufsize,
+        .nrreq          = depth,
+        .count          = count,
+        .start_offset   = offset,
+        .offset         = offset,
+        .flush_interval = flush_interval,
+        .drain_on_flush = drain_on_flush,
+        .rand           = g_rand_new_with_seed(0),
+    };
+
+    if (count >= 0) {
+        qprintf(quiet, "Sending %" PRId64 " ", count);
+    } else {
+        qprintf(quiet, "Sending ");
+    }
+    qprintf(quiet, "%s %s requests, %d bytes each, %d in parallel "
+            "(starting at offset %" PRId64 ")\n",
+            random ? "random" : "sequential", is_write ? "write" : "read",
+            data.bufsize, depth, offset);
+    if (!random) {
+        qprintf(quiet, "Step size %d bytes\n", data.step);
+    }
+    if (duration) {
+        qprintf(quiet, "Running for at most %" PRId64 " seconds\n", duration);
+    }
+    if (flush_interval) {
+        qprintf(quiet, "Sending flush every %d requests%s\n", flush_interval,
+                drain_on_flush ? "" : ", without draining");
+    }
+
+    data.reqs = g_new0(BenchRequest, depth);
+    data.free_reqs = g_new(BenchRequest *, depth);
+    for (i = 0; i < depth; i++) {
+        BenchRequest *req = &data.reqs[i];
+
+        req->b = &data;
+        req->iov.iov_base = blk_blockalign(blk, bufsize);
+        req->iov.iov_len = bufsize;
+        memset(req->iov.iov_base, pattern, bufsize);
+        qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+        data.free_reqs[data.nr_free++] = req;
+    }
+
+    gettimeofday(&t1, NULL);
+    if (duration) {
+        data.deadline = get_clock() + duration * 1000000000LL;
+    }
+    bench_submit(&data);
+    while (!data.done) {
+        main_loop_wait(false);
+    }
+    gettimeofday(&t2, NULL);
+
+    elapsed = ((t2.tv_sec * 1000000 + t2.tv_usec) -
+               (t1.tv_sec * 1000000 + t1.tv_usec)) / 1000000.0;
+
+    qprintf(quiet, "Run completed in %3.3f seconds.\n", elapsed);
+    qprintf(quiet, "%" PRId64 " requests, %.0f IOPS, %.2f MiB/s",
+            data.nr_latencies, data.nr_latencies / elapsed,
+            (double)data.nr_latencies * bufsize / (1024 * 1024) / elapsed);
+    if (data.flushes) {
+        qprintf(quiet, ", %" PRId64 " flushes", data.flushes);
+    }
+    qprintf(quiet, "\n");
+
+    if (data.nr_latencies) {
+        qprintf(quiet, "Latency (us): min %.1f, avg %.1f, 50%% %.1f, "
+                "90%% %.1f, 99%% %.1f, 99.9%% %.1f, max %.1f\n",
+                data.lat_min / 1000.0,
+                data.lat_sum / data.nr_latencies / 1000.0,
+                bench_percentile(&data, 50), bench_percentile(&data, 90),
+                bench_percentile(&data, 99), bench_percentile(&data, 99.9),
+                data.lat_max / 1000.0);
+    }
+
+out:
+    if (data.reqs) {
+        for (i = 0; i < depth; i++) {
+            qemu_vfree(data.reqs[i].iov.iov_base);
+        }
+    }
+    g_free(data.reqs);
+    g_free(data.free_reqs);
+    if (data.rand) {
+        g_rand_free(data.rand);
+    }
+    blk_unref(blk);
+
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
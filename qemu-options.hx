@@ -38,6 +38,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                numa-affinity=on|off pins vCPU and IOThread threads to the host nodes of their NUMA node (default=off)\n"
     "                iommu=on|off controls emulated Intel IOMMU (VT-d) support (default=off)\n"
     "                igd-passthru=on|off controls IGD GFX passthrough support (default=off)\n"
     "                aes-key-wrap=on|off controls support for AES key wrapping (default=on)\n"
@@ -73,6 +74,12 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item numa-affinity=on|off
+Pins each vCPU thread, and each IOThread with a @code{numa-node} property,
+to the host CPUs of the host nodes that back its guest NUMA node, as given
+by the @code{host-nodes} of the node's @code{memdev}.  vCPU threads are only
+pinned with KVM.  The resulting placement is reported by @code{query-cpus}
+and @code{query-iothreads}.  The default is off.
 @item iommu=on|off
 Enables or disables emulated Intel IOMMU (VT-d) support. The default is off.
 @item aes-key-wrap=on|off
@@ -82,6 +82,21 @@ void json_prop_str(QJSON *json, const char *name, const char *str)
     qstring_append_chr(json->str, '"');
 }
 
+/*
+ * Append the members written so far to the unfinished top-level object
+ * of @from to the object currently open in @json
+ */
+void json_append_members(QJSON *json, QJSON *from)
+{
+    if (from->omit_comma) {
+        /* Nothing was written to @from */
+        return;
+    }
+    json_emit_element(json, NULL);
+    /* Skip the "{ " that opens @from */
+    qstring_append(json->str, qstring_get_str(from->str) + 2);
+}
+
 const char *qjson_get_str(QJSON *json)
 {
     return qstring_get_str(json->str);
@@ -1417,6 +1417,8 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image so that it survives a restart
+                of QEMU (json-bool, optional, default false)
 
 Example:
 
@@ -2725,6 +2727,15 @@ Each json-object contain the following:
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "driver-specific": Statistics specific to the format driver, if it has
+                     any (json-object, optional). For qcow2 the "data"
+                     member contains:
+    - "l2-cache-hits": L2 table lookups served from the cache (json-int)
+    - "l2-cache-misses": L2 table lookups that missed the cache (json-int)
+    - "refcount-cache-hits": refcount block lookups served from the cache
+                             (json-int)
+    - "refcount-cache-misses": refcount block lookups that missed the
+                               cache (json-int)
 
 Example:
 
@@ -2853,6 +2864,8 @@ Return a json-array. Each CPU is represented by a json-object, which contains:
      "pc" and "npc": sparc (json-int)
      "PC": mips (json-int)
 - "thread_id": ID of the underlying host thread (json-int)
+- "host-nodes": host NUMA nodes the CPU thread is pinned to, only present
+                with -machine numa-affinity=on (json-array of int, optional)
 
 Example:
 
@@ -2888,6 +2901,116 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_cpus,
     },
 
+SQMP
+calc-dirty-rate
+---------------
+
+Start estimating how fast the guest dirties its memory, without migrating.
+Random pages of each RAMBlock are hashed at the start and at the end of the
+measurement; use query-dirty-rate to read the result.
+
+Arguments:
+
+- "calc-time": length of the measurement in seconds, 1 to 60 (json-int)
+- "sample-pages": pages to sample per GiB of guest memory, 1 to 4096,
+                  default 512 (json-int, optional)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 5 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i,sample-pages:i?",
+        .mhandler.cmd_new = qmp_marshal_calc_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the state and result of the last calc-dirty-rate measurement.
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "dirty-rate": estimated dirty rate of guest memory in MB/s, once measured
+                (json-number, optional)
+- "start-time": host time the measurement started, in seconds (json-int)
+- "calc-time": length of the measurement in seconds (json-int)
+- "sample-pages": pages sampled per GiB of guest memory (json-int)
+- "ramblocks": per-RAMBlock results, once measured (json-array, optional)
+  - "id": RAMBlock name (json-string)
+  - "size": RAMBlock size in bytes (json-int)
+  - "sampled-pages": number of pages sampled (json-int)
+  - "dirtied-pages": number of sampled pages that changed (json-int)
+  - "dirty-rate": estimated dirty rate in MB/s (json-number)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured",
+        "dirty-rate": 96.0,
+        "start-time": 1476189014,
+        "calc-time": 5,
+        "sample-pages": 512,
+        "ramblocks": [
+           { "id": "pc.ram", "size": 4294967296, "sampled-pages": 2048,
+             "dirtied-pages": 240, "dirty-rate": 96.0 },
+           { "id": "vga.vram", "size": 16777216, "sampled-pages": 8,
+             "dirtied-pages": 0, "dirty-rate": 0.0 }
+        ]
+     }
+   }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_dirty_rate,
+    },
+
+SQMP
+query-vcpu-dirty-rate
+---------------------
+
+Show the rate at which each virtual CPU dirtied guest memory during the
+running or last migration.
+
+Return a json-array. Each virtual CPU is represented by a json-object, which
+contains:
+
+- "cpu-index": CPU index (json-int)
+- "dirty-rate": guest pages dirtied per second, only present with TCG
+                (json-int, optional)
+
+Example:
+
+-> { "execute": "query-vcpu-dirty-rate" }
+<- {
+      "return":[
+         {
+            "cpu-index":0,
+            "dirty-rate":21504
+         },
+         {
+            "cpu-index":1,
+            "dirty-rate":12
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-vcpu-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_vcpu_dirty_rate,
+    },
+
 SQMP
 query-iothreads
 ---------------
@@ -2902,6 +3025,8 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "host-nodes": host NUMA nodes the iothread is pinned to, only present
+                with -machine numa-affinity=on (json-array of int, optional)
 
 Example:
 
@@ -3549,10 +3674,27 @@ The main json-object contains the following:
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of XBRZRLE page cache misses
          - "cache-miss-rate": rate of XBRZRLE page cache misses
+         - "cache-hit-rate": fraction of XBZRLE page cache lookups that
+           hit during the last pass over guest memory
          - "overflow": number of times XBZRLE overflows.  This means
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+- "device-downtime": only present when migration has completed, a
+  json-array of json-objects, one per section saved while the guest was
+  stopped, in stream order:
+         - "name": section name (json-string)
+         - "instance-id": section instance (json-int)
+         - "time": time spent saving it in microseconds (json-int)
+         - "parallel": saved by a worker thread (json-bool)
+- "postcopy-faults": only present on the destination of a postcopy
+  migration once it has taken a page fault.  It is a json-object with:
+         - "requests": number of faults resolved (json-int)
+         - "pending": number of faults still waiting for their page (json-int)
+         - "latency-avg": average fault latency in microseconds (json-int)
+         - "latency-max": highest fault latency in microseconds (json-int)
+         - "histogram": json-array of json-int, element i counts the faults
+           that took 2^i to 2^(i+1) - 1 microseconds to resolve
 
 Examples:
 
@@ -3658,6 +3800,7 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
+            "cache-hit-rate":0.781,
             "overflow":34434
          }
       }
@@ -3684,6 +3827,13 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-mapped-ram": store RAM pages at fixed offsets of a "file:" migration
+- "x-multifd": send RAM pages over several parallel connections
+- "x-zerocopy-send": send RAM pages without copying them (Linux, tcp: only)
+- "x-parallel-device-state": save and load device state in worker threads
+- "x-background-snapshot": snapshot RAM while the guest keeps running
+- "x-block-zero-extents": skip zero ranges during block migration (needs a
+                          2.7 destination)
 
 Arguments:
 
@@ -3714,6 +3864,12 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-mapped-ram": mapped RAM state (json-bool)
+         - "x-multifd": multifd state (json-bool)
+         - "x-zerocopy-send": zero-copy send state (json-bool)
+         - "x-parallel-device-state": parallel device state (json-bool)
+         - "x-background-snapshot": background snapshot state (json-bool)
+         - "x-block-zero-extents": block zero extents state (json-bool)
 
 Arguments:
 
@@ -3727,7 +3883,13 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-mapped-ram"},
+     {"state": false, "capability": "x-multifd"},
+     {"state": false, "capability": "x-zerocopy-send"},
+     {"state": false, "capability": "x-parallel-device-state"},
+     {"state": false, "capability": "x-background-snapshot"},
+     {"state": false, "capability": "x-block-zero-extents"}
    ]}
 
 EQMP
@@ -3751,6 +3913,10 @@ Set migration parameters
                            throttled for auto-converge (json-int)
 - "x-cpu-throttle-increment": set throttle increasing percentage for
                              auto-converge (json-int)
+- "x-multifd-channels": set the number of extra RAM connections for
+                       multifd (json-int)
+- "x-block-queue-depth": set the number of reads in flight per device
+                        during the block migration bulk phase (json-int)
 
 Arguments:
 
@@ -3764,7 +3930,7 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?,x-multifd-channels:i?,x-block-queue-depth:i?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3781,6 +3947,10 @@ Query current migration parameters
                                       throttled (json-int)
          - "x-cpu-throttle-increment" : throttle increasing percentage for
                                         auto-converge (json-int)
+         - "x-multifd-channels" : number of extra RAM connections for
+                                  multifd (json-int)
+         - "x-block-queue-depth" : reads in flight per device during the
+                                   block migration bulk phase (json-int)
 
 Arguments:
 
@@ -3793,7 +3963,9 @@ Example:
          "x-cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "x-cpu-throttle-initial": 20
+         "x-cpu-throttle-initial": 20,
+         "x-multifd-channels": 2,
+         "x-block-queue-depth": 16
       }
    }
 
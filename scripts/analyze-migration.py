@@ -484,6 +484,7 @@ class MigrationDump(object):
     QEMU_VM_SUBSECTION    = 0x05
     QEMU_VM_VMDESCRIPTION = 0x06
     QEMU_VM_CONFIGURATION = 0x07
+    QEMU_VM_SECTION_SIZED = 0x09
     QEMU_VM_SECTION_FOOTER= 0x7e
 
     def __init__(self, filename):
@@ -527,11 +528,14 @@ class MigrationDump(object):
             elif section_type == self.QEMU_VM_CONFIGURATION:
                 section = ConfigurationSection(file)
                 section.read()
-            elif section_type == self.QEMU_VM_SECTION_START or section_type == self.QEMU_VM_SECTION_FULL:
+            elif section_type == self.QEMU_VM_SECTION_START or section_type == self.QEMU_VM_SECTION_FULL or section_type == self.QEMU_VM_SECTION_SIZED:
                 section_id = file.read32()
                 name = file.readstr()
                 instance_id = file.read32()
                 version_id = file.read32()
+                if section_type == self.QEMU_VM_SECTION_SIZED:
+                    # Length of the device state that follows
+                    file.read32()
                 section_key = (name, instance_id)
                 classdesc = self.section_classes[section_key]
                 section = classdesc[0](file, version_id, classdesc[1], section_key)
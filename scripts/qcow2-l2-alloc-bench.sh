@@ -0,0 +1,28 @@
+#! /bin/sh
+# Measures how qcow2 write requests that allocate new L2 tables scale with the
+# queue depth.  Every request lands in a different L2 table of a fresh image,
+# so each one allocates, writes and flushes a table.
+#
+# Usage: qcow2-l2-alloc-bench.sh [QEMU_IMG [DIR [CACHE]]]
+#
+# QEMU_IMG defaults to ./qemu-img, DIR to the current directory and CACHE
+# (the -t option of qemu-img bench) to none.
+
+qemu_img=${1:-./qemu-img}
+dir=${2:-.}
+cache=${3:-none}
+
+img=$dir/qcow2-l2-alloc-bench.$$.qcow2
+trap 'rm -f "$img"' 0 1 2 3 15
+
+# With 4k clusters, an L2 table covers 2M of guest data
+cluster_size=4k
+l2_coverage=2M
+count=4096
+
+for depth in 1 2 4 8 16 32 64; do
+  "$qemu_img" create -q -f qcow2 -o cluster_size=$cluster_size "$img" 16G || exit 1
+  echo "depth $depth:"
+  "$qemu_img" bench -f qcow2 -t $cache -w -c $count -d $depth -s 4k \
+      -S $l2_coverage "$img" | sed -n '/IOPS\|Latency/s/^/  /p'
+done
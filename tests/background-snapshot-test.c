@@ -0,0 +1,202 @@
+/*
+ * QTest testcase for background snapshots
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+
+#define RAM_START   (1 << 20)
+#define RAM_SIZE    (32 << 20)
+#define PAGE_SIZE   4096
+
+/* Pages the guest writes to while the snapshot is taken */
+#define WRITE_PAGES 32
+#define WRITE_STEP  (RAM_SIZE / WRITE_PAGES)
+
+static bool got_resume;
+
+/* Sends @command and returns its reply, noting the events that come first */
+static QDict *wait_command(QTestState *who, const char *command)
+{
+    QDict *response;
+
+    response = qtest_qmp(who, command);
+    while (qdict_haskey(response, "event")) {
+        if (!strcmp(qdict_get_str(response, "event"), "RESUME")) {
+            got_resume = true;
+        }
+        QDECREF(response);
+        response = qtest_qmp_receive(who);
+    }
+
+    g_assert(!qdict_haskey(response, "error"));
+    return response;
+}
+
+static char *migration_status(QTestState *who)
+{
+    QDict *response, *rsp_return;
+    char *status;
+
+    response = wait_command(who, "{ 'execute': 'query-migrate' }");
+    rsp_return = qdict_get_qdict(response, "return");
+    status = g_strdup(qdict_get_str(rsp_return, "status"));
+    QDECREF(response);
+    return status;
+}
+
+static void wait_for_migration_complete(QTestState *who)
+{
+    char *status;
+
+    while (true) {
+        status = migration_status(who);
+        g_assert_cmpstr(status, !=, "failed");
+        if (!strcmp(status, "completed")) {
+            break;
+        }
+        g_free(status);
+        g_usleep(100 * 1000);
+    }
+    g_free(status);
+}
+
+/* Waits until the destination has loaded the incoming stream */
+static void wait_for_incoming(QTestState *who)
+{
+    QDict *response, *rsp_return;
+    bool loading;
+
+    do {
+        g_usleep(100 * 1000);
+        response = wait_command(who, "{ 'execute': 'query-status' }");
+        rsp_return = qdict_get_qdict(response, "return");
+        loading = !strcmp(qdict_get_str(rsp_return, "status"), "inmigrate");
+        QDECREF(response);
+    } while (loading);
+}
+
+static bool background_snapshot_enabled(QTestState *who)
+{
+    QDict *response;
+    QList *caps;
+    QListEntry *entry;
+    bool enabled = false;
+
+    response = wait_command(who,
+                            "{ 'execute': 'query-migrate-capabilities' }");
+    caps = qdict_get_qlist(response, "return");
+    QLIST_FOREACH_ENTRY(caps, entry) {
+        QDict *cap = qobject_to_qdict(qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(cap, "capability"),
+                    "x-background-snapshot")) {
+            enabled = qdict_get_bool(cap, "state");
+        }
+    }
+    QDECREF(response);
+    return enabled;
+}
+
+static void test_write_during_snapshot(void)
+{
+    char file[] = "/tmp/qtest-snapshot-XXXXXX";
+    QTestState *from, *to;
+    QDict *response;
+    char *status;
+    char *args;
+    int fd, i;
+
+    fd = mkstemp(file);
+    g_assert(fd != -1);
+    close(fd);
+
+    from = qtest_init("-m 64M -nodefaults");
+    qtest_memset(from, RAM_START, 0x11, RAM_SIZE);
+
+    response = wait_command(from,
+        "{ 'execute': 'migrate-set-capabilities',"
+        "  'arguments': { 'capabilities': ["
+        "    { 'capability': 'x-background-snapshot', 'state': true } ] } }");
+    QDECREF(response);
+    if (!background_snapshot_enabled(from)) {
+        g_test_message("Skipping test: no userfaultfd write protection");
+        qtest_quit(from);
+        unlink(file);
+        return;
+    }
+
+    /* Slow enough that the writes below happen while RAM is saved */
+    response = wait_command(from,
+        "{ 'execute': 'migrate_set_speed',"
+        "  'arguments': { 'value': 16777216 } }");
+    QDECREF(response);
+
+    args = g_strdup_printf("{ 'execute': 'migrate',"
+                           "  'arguments': { 'uri': 'file:%s' } }", file);
+    got_resume = false;
+    response = wait_command(from, args);
+    QDECREF(response);
+    g_free(args);
+
+    /* RAM is write protected once the guest runs again */
+    while (!got_resume) {
+        response = qtest_qmp_receive(from);
+        if (qdict_haskey(response, "event") &&
+            !strcmp(qdict_get_str(response, "event"), "RESUME")) {
+            got_resume = true;
+        }
+        QDECREF(response);
+    }
+
+    /* Each write waits until the migration thread has saved the page */
+    for (i = 0; i < WRITE_PAGES; i++) {
+        qtest_memset(from, RAM_START + i * WRITE_STEP, 0x22, PAGE_SIZE);
+    }
+
+    status = migration_status(from);
+    g_assert_cmpstr(status, ==, "active");
+    g_free(status);
+
+    for (i = 0; i < WRITE_PAGES; i++) {
+        g_assert_cmphex(qtest_readb(from, RAM_START + i * WRITE_STEP), ==,
+                        0x22);
+    }
+
+    wait_for_migration_complete(from);
+    qtest_quit(from);
+
+    /* The snapshot holds RAM as it was when the guest was resumed */
+    args = g_strdup_printf("-m 64M -nodefaults -incoming file:%s", file);
+    to = qtest_init(args);
+    g_free(args);
+
+    wait_for_incoming(to);
+
+    for (i = 0; i < WRITE_PAGES; i++) {
+        g_assert_cmphex(qtest_readb(to, RAM_START + i * WRITE_STEP), ==,
+                        0x11);
+        g_assert_cmphex(qtest_readb(to, RAM_START + i * WRITE_STEP +
+                                        PAGE_SIZE - 1), ==, 0x11);
+        g_assert_cmphex(qtest_readb(to, RAM_START + i * WRITE_STEP +
+                                        PAGE_SIZE), ==, 0x11);
+    }
+
+    qtest_quit(to);
+    unlink(file);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/background-snapshot/write", test_write_during_snapshot);
+
+    return g_test_run();
+}
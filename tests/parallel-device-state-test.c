@@ -0,0 +1,257 @@
+/*
+ * QTest testcase for x-parallel-device-state
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include <sys/wait.h>
+#include "libqtest.h"
+
+/* Every VIO device and the PHB have a TCE table, which is saved in parallel */
+#define MACHINE_ARGS "-machine pseries -m 256M -nodefaults " \
+                     "-device spapr-vscsi -device spapr-vscsi "
+
+#define SET_PARALLEL_CAP \
+    "{ 'execute': 'migrate-set-capabilities'," \
+    "  'arguments': { 'capabilities': [" \
+    "    { 'capability': 'x-parallel-device-state', 'state': true } ] } }"
+
+/* QEMU_VM_SECTION_SIZED from migration/migration.h */
+#define SECTION_SIZED 0x09
+
+#define SIZED_IDSTR "spapr_iommu"
+
+/* Sends @command and returns its reply, dropping the events that come first */
+static QDict *wait_command(QTestState *who, const char *command)
+{
+    QDict *response;
+
+    response = qtest_qmp(who, command);
+    while (qdict_haskey(response, "event")) {
+        QDECREF(response);
+        response = qtest_qmp_receive(who);
+    }
+
+    g_assert(!qdict_haskey(response, "error"));
+    return response;
+}
+
+static char *query_status(QTestState *who, const char *command,
+                          const char *key)
+{
+    QDict *response, *rsp_return;
+    char *status;
+
+    response = wait_command(who, command);
+    rsp_return = qdict_get_qdict(response, "return");
+    status = g_strdup(qdict_get_str(rsp_return, key));
+    QDECREF(response);
+    return status;
+}
+
+static void wait_for_migration_complete(QTestState *who)
+{
+    char *status;
+
+    while (true) {
+        status = query_status(who, "{ 'execute': 'query-migrate' }",
+                              "status");
+        g_assert_cmpstr(status, !=, "failed");
+        if (!strcmp(status, "completed")) {
+            break;
+        }
+        g_free(status);
+        g_usleep(100 * 1000);
+    }
+    g_free(status);
+}
+
+/*
+ * Returns the offsets of the QEMU_VM_SECTION_SIZED headers of the TCE
+ * tables in @buf.  The header is the section type, the section id, the
+ * length of the idstr and the idstr, which ends in SIZED_IDSTR.
+ */
+static GArray *find_sized_sections(const uint8_t *buf, size_t len)
+{
+    GArray *sections = g_array_new(false, false, sizeof(size_t));
+    size_t idlen = strlen(SIZED_IDSTR);
+    size_t i, start;
+
+    for (i = 6; i + idlen <= len; i++) {
+        if (memcmp(buf + i, SIZED_IDSTR, idlen)) {
+            continue;
+        }
+        for (start = i - 6; start + 255 + 6 >= i; start--) {
+            if (buf[start] == SECTION_SIZED &&
+                buf[start + 5] == i + idlen - (start + 6)) {
+                g_array_append_val(sections, start);
+                break;
+            }
+            if (!start) {
+                break;
+            }
+        }
+    }
+
+    return sections;
+}
+
+/*
+ * Loads @file with x-parallel-device-state enabled in a QEMU that is not
+ * under qtest control, because a failed load makes it exit.  Returns its
+ * wait status.
+ */
+static int load_and_exit(const char *file)
+{
+    const char *qemu_binary = getenv("QTEST_QEMU_BINARY");
+    gchar **argv;
+    gchar *command, *commands;
+    GError *err = NULL;
+    GPid pid;
+    int in_fd, status, i;
+    ssize_t ret;
+    bool ok;
+
+    command = g_strdup_printf("%s -machine accel=qtest -display none "
+                              MACHINE_ARGS "-qmp stdio -incoming defer",
+                              qemu_binary);
+    ok = g_shell_parse_argv(command, NULL, &argv, &err);
+    g_assert_no_error(err);
+    g_assert(ok);
+    g_free(command);
+
+    ok = g_spawn_async_with_pipes(NULL, argv, NULL,
+                                  G_SPAWN_DO_NOT_REAP_CHILD |
+                                  G_SPAWN_STDOUT_TO_DEV_NULL,
+                                  NULL, NULL, &pid, &in_fd, NULL, NULL, &err);
+    g_assert_no_error(err);
+    g_assert(ok);
+    g_strfreev(argv);
+
+    commands = g_strdup_printf("{ 'execute': 'qmp_capabilities' }\n"
+                               SET_PARALLEL_CAP "\n"
+                               "{ 'execute': 'migrate-incoming',"
+                               "  'arguments': { 'uri': 'file:%s' } }\n",
+                               file);
+    ret = write(in_fd, commands, strlen(commands));
+    g_assert_cmpint(ret, ==, strlen(commands));
+    g_free(commands);
+
+    for (i = 0; i < 600; i++) {
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            break;
+        }
+        g_usleep(100 * 1000);
+    }
+    if (i == 600) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        g_test_message("QEMU did not exit after a truncated stream");
+        g_assert_not_reached();
+    }
+
+    close(in_fd);
+    g_spawn_close_pid(pid);
+    return status;
+}
+
+static void test_parallel_save_load(void)
+{
+    char file[] = "/tmp/qtest-parallel-XXXXXX";
+    char truncated[] = "/tmp/qtest-parallel-XXXXXX";
+    QTestState *from, *to;
+    QDict *response;
+    GArray *sections;
+    gchar *buf;
+    gsize len;
+    char *args, *status;
+    guint i;
+    int fd;
+    bool ok;
+
+    fd = mkstemp(file);
+    g_assert(fd != -1);
+    close(fd);
+
+    from = qtest_init(MACHINE_ARGS);
+    response = wait_command(from, SET_PARALLEL_CAP);
+    QDECREF(response);
+
+    args = g_strdup_printf("{ 'execute': 'migrate',"
+                           "  'arguments': { 'uri': 'file:%s' } }", file);
+    response = wait_command(from, args);
+    QDECREF(response);
+    g_free(args);
+
+    wait_for_migration_complete(from);
+    qtest_quit(from);
+
+    /* All the TCE tables went out as sized sections */
+    ok = g_file_get_contents(file, &buf, &len, NULL);
+    g_assert(ok);
+    sections = find_sized_sections((uint8_t *)buf, len);
+    g_assert_cmpint(sections->len, >=, 3);
+
+    to = qtest_init(MACHINE_ARGS "-incoming defer");
+    response = wait_command(to, SET_PARALLEL_CAP);
+    QDECREF(response);
+    args = g_strdup_printf("{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': 'file:%s' } }", file);
+    response = wait_command(to, args);
+    QDECREF(response);
+    g_free(args);
+
+    do {
+        g_usleep(100 * 1000);
+        status = query_status(to, "{ 'execute': 'query-status' }", "status");
+        if (strcmp(status, "inmigrate")) {
+            break;
+        }
+        g_free(status);
+    } while (true);
+    g_assert_cmpstr(status, ==, "running");
+    g_free(status);
+    qtest_quit(to);
+
+    /*
+     * Cut the stream inside each sized section but the first.  The load
+     * must fail cleanly, also when the sized sections before the cut are
+     * still queued to the worker threads.
+     */
+    fd = mkstemp(truncated);
+    g_assert(fd != -1);
+    close(fd);
+
+    for (i = 1; i < sections->len; i++) {
+        size_t cut = g_array_index(sections, size_t, i) + 64;
+        int wstatus;
+
+        g_assert_cmpint(cut, <, len);
+        ok = g_file_set_contents(truncated, buf, cut, NULL);
+        g_assert(ok);
+
+        wstatus = load_and_exit(truncated);
+        g_assert(WIFEXITED(wstatus));
+        g_assert_cmpint(WEXITSTATUS(wstatus), ==, EXIT_FAILURE);
+    }
+
+    g_array_free(sections, true);
+    g_free(buf);
+    unlink(truncated);
+    unlink(file);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/parallel-device-state/save-load",
+                   test_parallel_save_load);
+
+    return g_test_run();
+}
@@ -11,17 +11,26 @@
  *     ./rcu <nreaders> perf [ <seconds> ]
  *         Run a combined read/update performance test with the specified
  *         number of readers and one updater and specified duration.
+ *     ./rcu <nreaders> cperf [ <seconds> ]
+ *         Like perf, but the updater queues callbacks with call_rcu
+ *         instead of waiting for grace periods itself.
+ *
+ * Adding "expedited" after <seconds> makes updaters use
+ * synchronize_rcu_expedited().
  *
  * The above tests produce output as follows:
  *
  * n_reads: 46008000  n_updates: 146026  nreaders: 2  nupdaters: 1 duration: 1
  * ns/read: 43.4707  ns/update: 6848.1
+ * grace periods: 146030 (expedited: 0, shared: 0)  avg gp: 6.7 us  max gp: 210 us
+ * call_rcu batches: 4  callbacks: 12  max batch: 3  max batch latency: 50120 us
  *
  * The first line lists the total number of RCU reads and updates executed
  * during the test, the number of reader threads, the number of updater
  * threads, and the duration of the test in seconds.  The second line
  * lists the average duration of each type of operation in nanoseconds,
  * or "nan" if the corresponding type of operation was not performed.
+ * The last two lines are the RCU statistics from rcu_get_stats().
  *
  *     ./rcu <nreaders> stress [ <seconds> ]
  *         Run a stress test with the specified number of readers and
@@ -76,6 +85,18 @@ int nthreadsrunning;
 
 static volatile int goflag = GOFLAG_INIT;
 
+/* Use synchronize_rcu_expedited() in the update threads.  */
+static bool use_expedited;
+
+static void rcutorture_synchronize(void)
+{
+    if (use_expedited) {
+        synchronize_rcu_expedited();
+    } else {
+        synchronize_rcu();
+    }
+}
+
 #define RCU_READ_RUN 1000
 
 #define NR_THREADS 100
@@ -148,7 +169,54 @@ static void *rcu_update_perf_test(void *arg)
         g_usleep(1000);
     }
     while (goflag == GOFLAG_RUN) {
-        synchronize_rcu();
+        rcutorture_synchronize();
+        n_updates_local++;
+    }
+    qemu_mutex_lock(&counts_mutex);
+    n_updates += n_updates_local;
+    qemu_mutex_unlock(&counts_mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Bound on callbacks in flight, so that updaters do not outrun the
+ * call_rcu thread and eat all memory.
+ */
+#define RCU_CALL_MAX_PENDING 100000
+
+struct rcu_call_perf {
+    struct rcu_head rcu;
+};
+
+static int n_pending_calls;
+
+static void rcu_call_perf_free(struct rcu_call_perf *p)
+{
+    g_free(p);
+    atomic_dec(&n_pending_calls);
+}
+
+static void *rcu_call_perf_test(void *arg)
+{
+    long long n_updates_local = 0;
+    struct rcu_call_perf *p;
+
+    rcu_register_thread();
+
+    *(struct rcu_reader_data **)arg = &rcu_reader;
+    atomic_inc(&nthreadsrunning);
+    while (goflag == GOFLAG_INIT) {
+        g_usleep(1000);
+    }
+    while (goflag == GOFLAG_RUN) {
+        if (atomic_read(&n_pending_calls) >= RCU_CALL_MAX_PENDING) {
+            g_usleep(100);
+            continue;
+        }
+        p = g_new(struct rcu_call_perf, 1);
+        atomic_inc(&n_pending_calls);
+        call_rcu(p, rcu_call_perf_free, rcu);
         n_updates_local++;
     }
     qemu_mutex_lock(&counts_mutex);
@@ -164,6 +232,23 @@ static void perftestinit(void)
     nthreadsrunning = 0;
 }
 
+static void print_rcu_stats(void)
+{
+    RcuStats stats;
+
+    rcu_get_stats(&stats);
+    printf("grace periods: %" PRIu64 " (expedited: %" PRIu64
+           ", shared: %" PRIu64 ")  avg gp: %g us  max gp: %g us\n",
+           stats.grace_periods, stats.expedited, stats.shared,
+           stats.grace_periods ?
+           (double)stats.gp_total_ns / stats.grace_periods / 1000. : 0.,
+           (double)stats.gp_max_ns / 1000.);
+    printf("call_rcu batches: %" PRIu64 "  callbacks: %" PRIu64
+           "  max batch: %" PRIu64 "  max batch latency: %g us\n",
+           stats.batches, stats.callbacks, stats.batch_max,
+           (double)stats.batch_latency_max_ns / 1000.);
+}
+
 static void perftestrun(int nthreads, int duration, int nreaders, int nupdaters)
 {
     while (atomic_read(&nthreadsrunning) < nthreads) {
@@ -180,6 +265,7 @@ static void perftestrun(int nthreads, int duration, int nreaders, int nupdaters)
         (double)n_reads),
            ((duration * 1000*1000*1000.*(double)nupdaters) /
         (double)n_updates));
+    print_rcu_stats();
     exit(0);
 }
 
@@ -217,6 +303,18 @@ static void uperftest(int nupdaters, int duration)
     perftestrun(i, duration, 0, nupdaters);
 }
 
+static void cperftest(int nreaders, int duration)
+{
+    int i;
+
+    perftestinit();
+    for (i = 0; i < nreaders; i++) {
+        create_thread(rcu_read_perf_test);
+    }
+    create_thread(rcu_call_perf_test);
+    perftestrun(i + 1, duration, nreaders, 1);
+}
+
 /*
  * Stress test.
  */
@@ -313,7 +411,7 @@ static void *rcu_update_stress_test(void *arg)
                 rcu_stress_array[i].pipe_count++;
             }
         }
-        synchronize_rcu();
+        rcutorture_synchronize();
         n_updates++;
     }
 
@@ -363,6 +461,7 @@ static void stresstest(int nreaders, int duration)
         printf(" %lld", rcu_stress_count[i]);
     }
     printf("\n");
+    print_rcu_stats();
     exit(0);
 }
 
@@ -412,13 +511,51 @@ static void gtest_stress_10_5(void)
     gtest_stress(10, 5);
 }
 
+static void gtest_stress_expedited(void)
+{
+    use_expedited = true;
+    gtest_stress(10, 1);
+}
+
+/*
+ * call_rcu_expedited(): the callback is not held back for batching and
+ * runs after an expedited grace period.
+ */
+
+struct rcu_expedited_cb {
+    struct rcu_head rcu;
+    QemuEvent done;
+};
+
+static void rcu_expedited_cb_func(struct rcu_expedited_cb *cb)
+{
+    qemu_event_set(&cb->done);
+}
+
+static void gtest_call_expedited(void)
+{
+    struct rcu_expedited_cb cb;
+    RcuStats before, after;
+
+    qemu_event_init(&cb.done, false);
+    rcu_get_stats(&before);
+    call_rcu_expedited(&cb, rcu_expedited_cb_func, rcu);
+    qemu_event_wait(&cb.done);
+    rcu_get_stats(&after);
+
+    g_assert_cmpint(after.batches, >, before.batches);
+    g_assert_cmpint(after.expedited, >, before.expedited);
+    qemu_event_destroy(&cb.done);
+}
+
 /*
  * Mainprogram.
  */
 
 static void usage(int argc, char *argv[])
 {
-    fprintf(stderr, "Usage: %s [nreaders [ perf | stress ] ]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [nreaders [ perf | rperf | uperf | cperf | "
+            "stress ] [duration [expedited]]]\n", argv[0]);
     exit(-1);
 }
 
@@ -437,6 +574,8 @@ int main(int argc, char *argv[])
             g_test_add_func("/rcu/torture/1reader", gtest_stress_1_5);
             g_test_add_func("/rcu/torture/10readers", gtest_stress_10_5);
         }
+        g_test_add_func("/rcu/torture/expedited", gtest_stress_expedited);
+        g_test_add_func("/rcu/torture/call-expedited", gtest_call_expedited);
         return g_test_run();
     }
 
@@ -446,6 +585,9 @@ int main(int argc, char *argv[])
     if (argc > 3) {
         duration = strtoul(argv[3], NULL, 0);
     }
+    if (argc > 4 && strcmp(argv[4], "expedited") == 0) {
+        use_expedited = true;
+    }
     if (argc < 3 || strcmp(argv[2], "stress") == 0) {
         stresstest(nreaders, duration);
     } else if (strcmp(argv[2], "rperf") == 0) {
@@ -454,6 +596,8 @@ int main(int argc, char *argv[])
         uperftest(nreaders, duration);
     } else if (strcmp(argv[2], "perf") == 0) {
         perftest(nreaders, duration);
+    } else if (strcmp(argv[2], "cperf") == 0) {
+        cperftest(nreaders, duration);
     }
     usage(argc, argv);
     return 0;
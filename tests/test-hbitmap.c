@@ -635,6 +635,37 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    uint64_t size = L2 + 7;
+    uint64_t buf_size, i;
+    uint8_t *buf;
+
+    hbitmap_test_init(data, size, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, 100, 60);
+    hbitmap_test_set(data, L2, 7);
+
+    buf_size = hbitmap_serialization_size(data->hb, 0, size);
+    g_assert_cmpint(buf_size, ==, DIV_ROUND_UP(size, 64) * 8);
+    buf = g_malloc0(buf_size);
+    hbitmap_serialize_part(data->hb, buf, 0, size);
+
+    /* Bit N is stored as bit N % 8 of byte N / 8 */
+    for (i = 0; i < size; i++) {
+        g_assert_cmpint(!!(buf[i / 8] & (1 << (i % 8))), ==,
+                        hbitmap_get(data->hb, i));
+    }
+
+    hbitmap_free(data->hb);
+    data->hb = hbitmap_alloc(size, 0);
+    hbitmap_deserialize_part(data->hb, buf, 0, size, true);
+    hbitmap_test_check(data, 0);
+
+    g_free(buf);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -684,6 +715,8 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/serialize", test_hbitmap_serialize);
     g_test_run();
 
     return 0;
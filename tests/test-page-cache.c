@@ -0,0 +1,204 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+/* Cache geometry used by page_cache.c: up to 8 ways, sets indexed by the
+ * page number.  With 16 pages there are two sets, of the even and of the
+ * odd page numbers.
+ */
+#define CACHE_WAYS 8
+
+static uint64_t page_addr(unsigned int page)
+{
+    return (uint64_t)page * PAGE_SIZE;
+}
+
+static void insert_page(PageCache *cache, unsigned int page, uint64_t age)
+{
+    uint8_t buf[PAGE_SIZE];
+
+    memset(buf, page & 0xff, sizeof(buf));
+    g_assert_cmpint(cache_insert(cache, page_addr(page), buf, age), ==, 0);
+}
+
+static void assert_cached(PageCache *cache, unsigned int page)
+{
+    uint8_t *data = get_cached_data(cache, page_addr(page));
+    int i;
+
+    g_assert(data);
+    for (i = 0; i < PAGE_SIZE; i++) {
+        g_assert_cmpint(data[i], ==, page & 0xff);
+    }
+}
+
+static void test_init(void)
+{
+    PageCache *cache;
+
+    g_assert(cache_init(0, PAGE_SIZE) == NULL);
+    g_assert(cache_init(-1, PAGE_SIZE) == NULL);
+
+    /* rounded down to a power of 2 */
+    cache = cache_init(100, PAGE_SIZE);
+    g_assert(cache);
+    g_assert_cmpint(cache_resize(cache, 64), ==, 64);
+    cache_fini(cache);
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t buf[PAGE_SIZE];
+    unsigned int i;
+
+    for (i = 0; i < 64; i++) {
+        insert_page(cache, i, 0);
+    }
+    for (i = 0; i < 64; i++) {
+        g_assert(cache_is_cached(cache, page_addr(i), 0));
+        assert_cached(cache, i);
+    }
+    g_assert(!cache_is_cached(cache, page_addr(64), 0));
+    g_assert(get_cached_data(cache, page_addr(64)) == NULL);
+
+    /* a page that is already cached is updated in place */
+    memset(buf, 0xaa, sizeof(buf));
+    g_assert_cmpint(cache_insert(cache, page_addr(5), buf, 1), ==, 0);
+    g_assert_cmpint(get_cached_data(cache, page_addr(5))[0], ==, 0xaa);
+
+    cache_fini(cache);
+}
+
+static void test_evict(void)
+{
+    PageCache *cache = cache_init(16, PAGE_SIZE);
+    uint8_t buf[PAGE_SIZE];
+    unsigned int i, j;
+
+    /* fill the set of even pages, and put one page in the odd set */
+    for (i = 0; i < CACHE_WAYS; i++) {
+        insert_page(cache, 2 * i, 0);
+    }
+    insert_page(cache, 1, 0);
+
+    /* pages of the last two generations are never replaced */
+    memset(buf, 0, sizeof(buf));
+    g_assert_cmpint(cache_insert(cache, page_addr(16), buf, 1), ==, -1);
+    g_assert(get_cached_data(cache, page_addr(16)) == NULL);
+
+    /* page 0 is the only one that is not fresh at generation 3 */
+    for (i = 1; i < CACHE_WAYS; i++) {
+        g_assert(cache_is_cached(cache, page_addr(2 * i), 2));
+    }
+    insert_page(cache, 16, 3);
+    g_assert(get_cached_data(cache, page_addr(0)) == NULL);
+    assert_cached(cache, 16);
+    for (i = 1; i < CACHE_WAYS; i++) {
+        assert_cached(cache, 2 * i);
+    }
+    /* the other set is not affected */
+    assert_cached(cache, 1);
+
+    /* pages that keep being hit outscore page 2, hit once at generation 2,
+     * and page 16, which was never hit; of these two the older one goes
+     */
+    for (i = 2; i < CACHE_WAYS; i++) {
+        for (j = 0; j < 40; j++) {
+            g_assert(cache_is_cached(cache, page_addr(2 * i), 4));
+        }
+    }
+    insert_page(cache, 18, 7);
+    g_assert(get_cached_data(cache, page_addr(2)) == NULL);
+    assert_cached(cache, 16);
+    assert_cached(cache, 18);
+    for (i = 2; i < CACHE_WAYS; i++) {
+        assert_cached(cache, 2 * i);
+    }
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    unsigned int i, cached;
+
+    for (i = 0; i < 32; i++) {
+        insert_page(cache, i, 0);
+    }
+
+    /* growing keeps every page */
+    g_assert_cmpint(cache_resize(cache, 128), ==, 128);
+    for (i = 0; i < 32; i++) {
+        assert_cached(cache, i);
+    }
+
+    /* same size after rounding down */
+    g_assert_cmpint(cache_resize(cache, 200), ==, 128);
+    g_assert_cmpint(cache_resize(cache, 0), ==, -1);
+
+    /* shrinking keeps as many pages as fit, with their data */
+    g_assert_cmpint(cache_resize(cache, 8), ==, 8);
+    cached = 0;
+    for (i = 0; i < 32; i++) {
+        if (get_cached_data(cache, page_addr(i))) {
+            assert_cached(cache, i);
+            cached++;
+        }
+    }
+    g_assert_cmpint(cached, ==, 8);
+
+    cache_fini(cache);
+}
+
+static void test_resize_keeps_hot_pages(void)
+{
+    PageCache *cache = cache_init(16, PAGE_SIZE);
+    unsigned int i, j;
+
+    for (i = 0; i < 16; i++) {
+        insert_page(cache, i, 0);
+    }
+    /* the odd pages come last in the old cache but score higher */
+    for (i = 1; i < 16; i += 2) {
+        for (j = 0; j < 40; j++) {
+            g_assert(cache_is_cached(cache, page_addr(i), 1));
+        }
+    }
+
+    g_assert_cmpint(cache_resize(cache, 8), ==, 8);
+    for (i = 0; i < 16; i++) {
+        if (i & 1) {
+            assert_cached(cache, i);
+        } else {
+            g_assert(get_cached_data(cache, page_addr(i)) == NULL);
+        }
+    }
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/init", test_init);
+    g_test_add_func("/page_cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page_cache/evict", test_evict);
+    g_test_add_func("/page_cache/resize", test_resize);
+    g_test_add_func("/page_cache/resize_keeps_hot_pages",
+                    test_resize_keeps_hot_pages);
+
+    return g_test_run();
+}
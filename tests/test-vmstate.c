@@ -483,6 +483,156 @@ static void test_load_skip(void)
     qsb_free(qsb);
 }
 
+/* Integer arrays go through the bulk path; the wire format must not change */
+typedef struct TestArrays {
+    uint8_t u8[3];
+    uint16_t u16[3];
+    int32_t i32[3];
+    uint64_t u64[3];
+    uint32_t n_var;
+    uint64_t *var;
+} TestArrays;
+
+static const VMStateDescription vmstate_arrays = {
+    .name = "test/arrays",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8_ARRAY(u8, TestArrays, 3),
+        VMSTATE_UINT16_ARRAY(u16, TestArrays, 3),
+        VMSTATE_INT32_ARRAY(i32, TestArrays, 3),
+        VMSTATE_UINT64_ARRAY(u64, TestArrays, 3),
+        VMSTATE_UINT32(n_var, TestArrays),
+        VMSTATE_VARRAY_UINT32_ALLOC(var, TestArrays, n_var, 0,
+                                    vmstate_info_uint64, uint64_t),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void test_arrays(void)
+{
+    uint64_t var[] = { 0x0102030405060708ULL, 0x1112131415161718ULL };
+    TestArrays obj = {
+        .u8 = { 1, 2, 3 },
+        .u16 = { 0x0102, 0x0304, 0x0506 },
+        .i32 = { 1, -2, 0x01020304 },
+        .u64 = { 1, 0x0102030405060708ULL, -1ULL },
+        .n_var = 2,
+        .var = var,
+    };
+    uint8_t wire[] = {
+        /* u8 */   1, 2, 3,
+        /* u16 */  0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+        /* i32 */  0x00, 0x00, 0x00, 0x01,
+                   0xff, 0xff, 0xff, 0xfe,
+                   0x01, 0x02, 0x03, 0x04,
+        /* u64 */  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+                   0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        /* n_var */ 0x00, 0x00, 0x00, 0x02,
+        /* var */  0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                   0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+        QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+    };
+    TestArrays loaded = { };
+    QEMUSizedBuffer *qsb;
+    QEMUFile *f;
+
+    f = qemu_bufopen("w", NULL);
+    vmstate_save_state(f, &vmstate_arrays, &obj, NULL);
+    g_assert(!qemu_file_get_error(f));
+    check_mem_file(f, wire, sizeof(wire) - 1);
+    qemu_fclose(f);
+
+    qsb = qsb_create(wire, sizeof(wire));
+    g_assert(qsb);
+    f = qemu_bufopen("r", qsb);
+    SUCCESS(vmstate_load_state(f, &vmstate_arrays, &loaded, 1));
+    g_assert(!qemu_file_get_error(f));
+    g_assert_cmpint(memcmp(loaded.u8, obj.u8, sizeof(obj.u8)), ==, 0);
+    g_assert_cmpint(memcmp(loaded.u16, obj.u16, sizeof(obj.u16)), ==, 0);
+    g_assert_cmpint(memcmp(loaded.i32, obj.i32, sizeof(obj.i32)), ==, 0);
+    g_assert_cmpint(memcmp(loaded.u64, obj.u64, sizeof(obj.u64)), ==, 0);
+    g_assert_cmpint(loaded.n_var, ==, 2);
+    g_assert_cmpint(memcmp(loaded.var, var, sizeof(var)), ==, 0);
+    g_free(loaded.var);
+    qemu_fclose(f);
+    qsb_free(qsb);
+}
+
+typedef struct TestHooks {
+    uint32_t a;
+    int pre_save, pre_load, post_load;
+} TestHooks;
+
+static void hooks_pre_save(void *opaque)
+{
+    ((TestHooks *)opaque)->pre_save++;
+}
+
+static int hooks_pre_load(void *opaque)
+{
+    ((TestHooks *)opaque)->pre_load++;
+    return 0;
+}
+
+static int hooks_post_load(void *opaque, int version_id)
+{
+    ((TestHooks *)opaque)->post_load++;
+    return 0;
+}
+
+static const VMStateDescription vmstate_hooks = {
+    .name = "test/hooks",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = hooks_pre_save,
+    .pre_load = hooks_pre_load,
+    .post_load = hooks_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(a, TestHooks),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* The _fields variants used by parallel device state leave the hooks out */
+static void test_fields_no_hooks(void)
+{
+    uint8_t wire[] = {
+        0, 0, 0, 10, /* a */
+        QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+    };
+    TestHooks obj = { .a = 10 };
+    QEMUSizedBuffer *qsb;
+    QEMUFile *f;
+
+    f = qemu_bufopen("w", NULL);
+    vmstate_save_state_fields(f, &vmstate_hooks, &obj, NULL);
+    g_assert(!qemu_file_get_error(f));
+    check_mem_file(f, wire, sizeof(wire) - 1);
+    qemu_fclose(f);
+    g_assert_cmpint(obj.pre_save, ==, 0);
+
+    qsb = qsb_create(wire, sizeof(wire));
+    g_assert(qsb);
+    f = qemu_bufopen("r", qsb);
+    obj.a = 0;
+    SUCCESS(vmstate_load_state_fields(f, &vmstate_hooks, &obj, 1));
+    g_assert_cmpint(obj.a, ==, 10);
+    g_assert_cmpint(obj.pre_load, ==, 0);
+    g_assert_cmpint(obj.post_load, ==, 0);
+    qemu_fclose(f);
+
+    f = qemu_bufopen("r", qsb);
+    obj.a = 0;
+    SUCCESS(vmstate_load_state(f, &vmstate_hooks, &obj, 1));
+    g_assert_cmpint(obj.a, ==, 10);
+    g_assert_cmpint(obj.pre_load, ==, 1);
+    g_assert_cmpint(obj.post_load, ==, 1);
+    qemu_fclose(f);
+    qsb_free(qsb);
+}
+
 int main(int argc, char **argv)
 {
     temp_fd = mkstemp(temp_file);
@@ -495,6 +645,8 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/field_exists/load/skip", test_load_skip);
     g_test_add_func("/vmstate/field_exists/save/noskip", test_save_noskip);
     g_test_add_func("/vmstate/field_exists/save/skip", test_save_skip);
+    g_test_add_func("/vmstate/hooks/fields_only", test_fields_no_hooks);
+    g_test_add_func("/vmstate/arrays", test_arrays);
     g_test_run();
 
     close(temp_fd);
@@ -174,6 +174,121 @@ static void test_encode_decode(void)
     }
 }
 
+/* Dirty @nr_runs runs of up to @max_run bytes at random offsets */
+static void dirty_page(uint8_t *page, int nr_runs, int max_run)
+{
+    int i, j, start, len;
+
+    for (i = 0; i < nr_runs; i++) {
+        start = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, max_run + 1);
+        for (j = start; j < start + len && j < PAGE_SIZE; j++) {
+            page[j] += g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+static void test_encode_matches_generic(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    int i, j, dlen, expected_len, out_len;
+
+    for (i = 0; i < 10000; i++) {
+        for (j = 0; j < PAGE_SIZE; j++) {
+            old[j] = g_test_rand_int();
+        }
+        memcpy(new, old, PAGE_SIZE);
+        dirty_page(new, g_test_rand_int_range(0, 64),
+                   g_test_rand_int_range(1, 128));
+        /* also exercise the overflow checks */
+        out_len = g_test_rand_bit() ? PAGE_SIZE : PAGE_SIZE / 8;
+
+        expected_len = xbzrle_encode_buffer_generic(old, new, PAGE_SIZE,
+                                                    expected, out_len);
+        dlen = xbzrle_encode_buffer(old, new, PAGE_SIZE, compressed,
+                                    out_len);
+        g_assert_cmpint(dlen, ==, expected_len);
+        if (dlen > 0) {
+            g_assert(memcmp(compressed, expected, dlen) == 0);
+            g_assert_cmpint(xbzrle_decode_buffer(compressed, dlen, old,
+                                                 PAGE_SIZE), <=, PAGE_SIZE);
+            g_assert(memcmp(old, new, PAGE_SIZE) == 0);
+        }
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+    g_free(expected);
+}
+
+#define PERF_PAGES 4096
+
+typedef int (*encode_fn)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen);
+
+static void perf_encode_decode(const char *name, int nr_runs, int max_run)
+{
+    uint8_t *old = g_malloc0(PAGE_SIZE * PERF_PAGES);
+    uint8_t *new = g_malloc0(PAGE_SIZE * PERF_PAGES);
+    uint8_t *compressed = g_malloc(PAGE_SIZE * PERF_PAGES);
+    int *dlen = g_new(int, PERF_PAGES);
+    static const struct {
+        const char *name;
+        encode_fn fn;
+    } encoders[] = {
+        { "generic", xbzrle_encode_buffer_generic },
+        { "dispatched", xbzrle_encode_buffer },
+    };
+    double elapsed;
+    int i, e;
+
+    for (i = 0; i < PERF_PAGES; i++) {
+        dirty_page(new + i * PAGE_SIZE, nr_runs, max_run);
+    }
+
+    for (e = 0; e < ARRAY_SIZE(encoders); e++) {
+        g_test_timer_start();
+        for (i = 0; i < PERF_PAGES; i++) {
+            dlen[i] = encoders[e].fn(old + i * PAGE_SIZE, new + i * PAGE_SIZE,
+                                     PAGE_SIZE, compressed + i * PAGE_SIZE,
+                                     PAGE_SIZE);
+        }
+        elapsed = g_test_timer_elapsed();
+        g_test_message("%s encode (%s): %.1f MB/s", name, encoders[e].name,
+                       PAGE_SIZE * PERF_PAGES / elapsed / 1e6);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_PAGES; i++) {
+        if (dlen[i] > 0) {
+            xbzrle_decode_buffer(compressed + i * PAGE_SIZE, dlen[i],
+                                 old + i * PAGE_SIZE, PAGE_SIZE);
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_message("%s decode: %.1f MB/s", name,
+                   PAGE_SIZE * PERF_PAGES / elapsed / 1e6);
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+    g_free(dlen);
+}
+
+static void test_perf_sparse(void)
+{
+    perf_encode_decode("sparse", 4, 8);
+}
+
+static void test_perf_dense(void)
+{
+    perf_encode_decode("dense", 32, 64);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +301,12 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_matches_generic",
+                    test_encode_matches_generic);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/sparse", test_perf_sparse);
+        g_test_add_func("/xbzrle/perf/dense", test_perf_dense);
+    }
 
     return g_test_run();
 }
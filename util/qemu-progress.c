@@ -24,11 +24,14 @@
 
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qemu/timer.h"
 
 struct progress_state {
     float current;
     float last_print;
     float min_skip;
+    int64_t start_time;
+    uint64_t bytes;
     void (*print)(void);
     void (*end)(void);
 };
@@ -36,6 +39,17 @@ struct progress_state {
 static struct progress_state state;
 static volatile sig_atomic_t print_pending;
 
+/* Average throughput in MiB/s since qemu_progress_init() */
+static double progress_rate(void)
+{
+    int64_t elapsed = get_clock_realtime() - state.start_time;
+
+    if (elapsed <= 0) {
+        return 0;
+    }
+    return (double)state.bytes / (1024 * 1024) * 1000000000LL / elapsed;
+}
+
 /*
  * Simple progress print function.
  * @percent relative percent of current operation
@@ -43,7 +57,12 @@ static volatile sig_atomic_t print_pending;
  */
 static void progress_simple_print(void)
 {
-    printf("    (%3.2f/100%%)\r", state.current);
+    if (state.bytes) {
+        printf("    (%3.2f/100%%, %.2f MiB/s)    \r", state.current,
+               progress_rate());
+    } else {
+        printf("    (%3.2f/100%%)\r", state.current);
+    }
     fflush(stdout);
 }
 
@@ -68,7 +87,12 @@ static void sigusr_print(int signal)
 static void progress_dummy_print(void)
 {
     if (print_pending) {
-        fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        if (state.bytes) {
+            fprintf(stderr, "    (%3.2f/100%%, %.2f MiB/s)\n", state.current,
+                    progress_rate());
+        } else {
+            fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        }
         print_pending = 0;
     }
 }
@@ -113,6 +137,8 @@ static void progress_dummy_init(void)
 void qemu_progress_init(int enabled, float min_skip)
 {
     state.min_skip = min_skip;
+    state.start_time = get_clock_realtime();
+    state.bytes = 0;
     if (enabled) {
         progress_simple_init();
     } else {
@@ -125,6 +151,15 @@ void qemu_progress_end(void)
     state.end();
 }
 
+/*
+ * Account @bytes as processed.  Once anything has been accounted, reports
+ * include the average throughput since qemu_progress_init().
+ */
+void qemu_progress_add_bytes(uint64_t bytes)
+{
+    state.bytes += bytes;
+}
+
 /*
  * Report progress.
  * @delta is how much progress we made.
@@ -32,6 +32,7 @@
 #include "qemu/atomic.h"
 #include "qemu/thread.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
 
 /*
  * Global grace period counter.  Bit 0 is always one in rcu_gp_ctr.
@@ -46,6 +47,26 @@ QemuEvent rcu_gp_event;
 static QemuMutex rcu_registry_lock;
 static QemuMutex rcu_sync_lock;
 
+/* Number of grace periods started and completed.  Written under
+ * rcu_sync_lock; a synchronize_rcu() caller that sees a grace period
+ * start and complete after it was called need not wait for another one.
+ */
+static unsigned long rcu_gp_started;
+static unsigned long rcu_gp_completed;
+
+/* Set by call_rcu1_expedited(): the call_rcu thread does not hold back
+ * its next batch, and runs an expedited grace period for it.
+ */
+static bool rcu_call_expedite;
+
+/* Protected by rcu_sync_lock.  */
+static RcuStats rcu_stats;
+
+/* How many times an expedited grace period rescans the registry,
+ * yielding in between, before sleeping on rcu_gp_event.
+ */
+#define RCU_EXPEDITED_POLLS     100
+
 /*
  * Check whether a quiescent state was crossed between the beginning of
  * update_counter_and_wait and now.
@@ -68,10 +89,11 @@ typedef QLIST_HEAD(, rcu_reader_data) ThreadList;
 static ThreadList registry = QLIST_HEAD_INITIALIZER(registry);
 
 /* Wait for previous parity/grace period to be empty of readers.  */
-static void wait_for_readers(void)
+static void wait_for_readers(bool expedited)
 {
     ThreadList qsreaders = QLIST_HEAD_INITIALIZER(qsreaders);
     struct rcu_reader_data *index, *tmp;
+    int polls = expedited ? RCU_EXPEDITED_POLLS : 0;
 
     for (;;) {
         /* We want to be notified of changes made to rcu_gp_ongoing
@@ -127,9 +149,17 @@ static void wait_for_readers(void)
          * the node then will not be added back to &registry by QLIST_SWAP
          * below.  The invariant is that the node is part of one list when
          * rcu_registry_lock is released.
+         *
+         * An expedited grace period first polls, so that short critical
+         * sections do not cost a futex wait and wakeup.
          */
         qemu_mutex_unlock(&rcu_registry_lock);
-        qemu_event_wait(&rcu_gp_event);
+        if (polls > 0) {
+            polls--;
+            g_thread_yield();
+        } else {
+            qemu_event_wait(&rcu_gp_event);
+        }
         qemu_mutex_lock(&rcu_registry_lock);
     }
 
@@ -137,9 +167,27 @@ static void wait_for_readers(void)
     QLIST_SWAP(&registry, &qsreaders, node);
 }
 
-void synchronize_rcu(void)
+static void synchronize_rcu_common(bool expedited)
 {
+    unsigned long gp;
+    int64_t start, elapsed;
+
+    /* Any grace period that starts after this point is good for us.  */
+    gp = atomic_mb_read(&rcu_gp_started) + 1;
+
     qemu_mutex_lock(&rcu_sync_lock);
+    if ((long)(atomic_read(&rcu_gp_completed) - gp) >= 0) {
+        /* Another thread ran a full grace period while we waited for
+         * rcu_sync_lock.
+         */
+        rcu_stats.shared++;
+        qemu_mutex_unlock(&rcu_sync_lock);
+        return;
+    }
+
+    start = get_clock();
+    gp = rcu_gp_started + 1;
+    atomic_mb_set(&rcu_gp_started, gp);
     qemu_mutex_lock(&rcu_registry_lock);
 
     if (!QLIST_EMPTY(&registry)) {
@@ -153,23 +201,53 @@ void synchronize_rcu(void)
              * Switch parity: 0 -> 1, 1 -> 0.
              */
             atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
-            wait_for_readers();
+            wait_for_readers(expedited);
             atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
         } else {
             /* Increment current grace period.  */
             atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr + RCU_GP_CTR);
         }
 
-        wait_for_readers();
+        wait_for_readers(expedited);
     }
 
     qemu_mutex_unlock(&rcu_registry_lock);
+    atomic_mb_set(&rcu_gp_completed, gp);
+
+    elapsed = get_clock() - start;
+    rcu_stats.grace_periods++;
+    if (expedited) {
+        rcu_stats.expedited++;
+    }
+    rcu_stats.gp_total_ns += elapsed;
+    rcu_stats.gp_max_ns = MAX(rcu_stats.gp_max_ns, elapsed);
     qemu_mutex_unlock(&rcu_sync_lock);
 }
 
+void synchronize_rcu(void)
+{
+    synchronize_rcu_common(false);
+}
+
+void synchronize_rcu_expedited(void)
+{
+    synchronize_rcu_common(true);
+}
+
+void rcu_get_stats(RcuStats *stats)
+{
+    qemu_mutex_lock(&rcu_sync_lock);
+    *stats = rcu_stats;
+    qemu_mutex_unlock(&rcu_sync_lock);
+}
 
 #define RCU_CALL_MIN_SIZE        30
 
+/* Upper bound on how long the first callback of a batch is held back
+ * waiting for RCU_CALL_MIN_SIZE callbacks to pile up.
+ */
+#define RCU_CALL_MAX_DELAY_NS    (50 * SCALE_MS)
+
 /* Multi-producer, single-consumer queue based on urcu/static/wfqueue.h
  * from liburcu.  Note that head is only used by the consumer.
  */
@@ -230,31 +308,59 @@ retry:
 static void *call_rcu_thread(void *opaque)
 {
     struct rcu_head *node;
+    bool expedite;
 
     rcu_register_thread();
 
     for (;;) {
-        int tries = 0;
+        int64_t start, deadline, now;
         int n = atomic_read(&rcu_call_count);
 
-        /* Heuristically wait for a decent number of callbacks to pile up.
-         * Fetch rcu_call_count now, we only must process elements that were
-         * added before synchronize_rcu() starts.
-         */
-        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5)) {
-            g_usleep(10000);
+        while (n == 0) {
+            qemu_event_reset(&rcu_call_ready_event);
+            n = atomic_read(&rcu_call_count);
             if (n == 0) {
-                qemu_event_reset(&rcu_call_ready_event);
+                qemu_event_wait(&rcu_call_ready_event);
                 n = atomic_read(&rcu_call_count);
-                if (n == 0) {
-                    qemu_event_wait(&rcu_call_ready_event);
-                }
             }
+        }
+
+        /* Wait for a decent number of callbacks to pile up, but do not
+         * hold back the oldest one for more than RCU_CALL_MAX_DELAY_NS.
+         * Fetch rcu_call_count now, we only must process elements that
+         * were added before synchronize_rcu() starts.
+         */
+        start = get_clock();
+        deadline = start + RCU_CALL_MAX_DELAY_NS;
+        now = start;
+        while (n < RCU_CALL_MIN_SIZE && now < deadline &&
+               !atomic_read(&rcu_call_expedite)) {
+            g_usleep(MIN(deadline - now, RCU_CALL_MAX_DELAY_NS / 10) /
+                     SCALE_US + 1);
             n = atomic_read(&rcu_call_count);
+            now = get_clock();
         }
 
+        /* An expedited callback is counted before the flag is set, so
+         * reading the count after clearing the flag includes it.
+         */
+        expedite = atomic_xchg(&rcu_call_expedite, false);
+        n = atomic_read(&rcu_call_count);
         atomic_sub(&rcu_call_count, n);
-        synchronize_rcu();
+        if (expedite) {
+            synchronize_rcu_expedited();
+        } else {
+            synchronize_rcu();
+        }
+
+        qemu_mutex_lock(&rcu_sync_lock);
+        rcu_stats.batches++;
+        rcu_stats.callbacks += n;
+        rcu_stats.batch_max = MAX(rcu_stats.batch_max, n);
+        rcu_stats.batch_latency_max_ns = MAX(rcu_stats.batch_latency_max_ns,
+                                             get_clock() - start);
+        qemu_mutex_unlock(&rcu_sync_lock);
+
         qemu_mutex_lock_iothread();
         while (n > 0) {
             node = try_dequeue();
@@ -285,6 +391,16 @@ void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
     qemu_event_set(&rcu_call_ready_event);
 }
 
+void call_rcu1_expedited(struct rcu_head *node,
+                         void (*func)(struct rcu_head *node))
+{
+    node->func = func;
+    enqueue(node);
+    atomic_inc(&rcu_call_count);
+    atomic_mb_set(&rcu_call_expedite, true);
+    qemu_event_set(&rcu_call_ready_event);
+}
+
 void rcu_register_thread(void)
 {
     assert(rcu_reader.ctr == 0);